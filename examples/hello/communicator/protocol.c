@@ -253,7 +253,8 @@ proto_write_msg_and_user(struct rpma_connection *conn, void *uarg)
 }
 
 /*
- * proto_write_msg_status -- RDMA.ATOMIC_WRITE message status
+ * proto_write_msg_status -- RDMA.WRITE_WITH_IMM message status, the server is
+ * notified about the write
  */
 int
 proto_write_msg_status(struct rpma_connection *conn, void *uarg)
@@ -263,7 +264,7 @@ proto_write_msg_status(struct rpma_connection *conn, void *uarg)
 	/* write the client status */
 	size_t offset = offsetof(struct client_row, status);
 	size_t length = sizeof(args->cr->status);
-	rpma_connection_atomic_write(conn, args->dst, offset, args->src, offset,
+	rpma_connection_write_notify(conn, args->dst, offset, args->src, offset,
 				     length);
 	rpma_connection_commit(conn);
 
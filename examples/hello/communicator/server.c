@@ -81,7 +81,8 @@ on_connection_notify(struct rpma_connection *conn, void *ptr, size_t length,
 		     void *uarg)
 {
 	struct client_ctx *clnt = uarg;
-	struct client_row *cr = ptr;
+	/* ptr points to the written status */
+	struct client_row *cr = clnt->cr;
 
 	/* verify the client's message is ready */
 	assert(cr->status == CLIENT_MSG_PENDING);
@@ -223,6 +224,8 @@ on_connection_event(struct rpma_zone *zone, uint64_t event,
 							 on_connection_recv);
 			rpma_connection_register_on_notify(
 				conn, on_connection_notify);
+			rpma_connection_set_notify_memory(clnt->conn,
+							  clnt->cr_mr);
 
 			/* enqueue sending the hello message */
 			clnt->hello_args.cr_id = &clnt->cr_id;
@@ -196,10 +196,9 @@ send_msg(struct rpma_connection *conn, void *arg)
 	rpma_msg_get_ptr(conn, (void **)&msg);
 
 	memcpy(&msg->id, &svr->id, sizeof(svr->id));
-	if (!svr->ptr->valid)
-		msg->init_required = 1;
+	msg->init_required = !svr->ptr->valid;
 
-	rpma_connection_send(conn, msg);
+	rpma_connection_send_length(conn, msg, sizeof(*msg));
 
 	rpma_connection_dispatch_break(conn);
 
@@ -44,6 +44,14 @@
 
 #define RPMA_DEFAULT_MSG_SIZE 30
 #define RPMA_DEFAULT_QUEUE_LENGTH 10
+#define RPMA_DEFAULT_CQ_BATCH_SIZE 16
+#define RPMA_DEFAULT_INITIATOR_DEPTH 16
+#define RPMA_DEFAULT_SRQ_LENGTH 256
+#define RPMA_DEFAULT_SEND_SIGNAL_INTERVAL 8
+#define RPMA_DEFAULT_INLINE_THRESHOLD 64
+#define RPMA_DEFAULT_MAX_SGE 4
+#define RPMA_DEFAULT_LANE_QUEUE_LENGTH 8
+#define RPMA_DEFAULT_POLL_BUDGET 50 /* usec */
 
 static void
 config_init(struct rpma_config *cfg)
@@ -53,8 +61,24 @@ config_init(struct rpma_config *cfg)
 	cfg->msg_size = RPMA_DEFAULT_MSG_SIZE;
 	cfg->send_queue_length = RPMA_DEFAULT_QUEUE_LENGTH;
 	cfg->recv_queue_length = RPMA_DEFAULT_QUEUE_LENGTH;
+	cfg->rma_queue_length = RPMA_DEFAULT_QUEUE_LENGTH;
+	cfg->cq_size = 0; /* derived from the queue lengths */
+	cfg->initiator_depth = RPMA_DEFAULT_INITIATOR_DEPTH;
+	cfg->cq_batch_size = RPMA_DEFAULT_CQ_BATCH_SIZE;
+	cfg->send_signal_interval = RPMA_DEFAULT_SEND_SIGNAL_INTERVAL;
+	cfg->inline_threshold = RPMA_DEFAULT_INLINE_THRESHOLD;
+	cfg->max_sge = RPMA_DEFAULT_MAX_SGE;
+	cfg->srq_length = RPMA_DEFAULT_SRQ_LENGTH;
+	cfg->srq_low_watermark = RPMA_DEFAULT_SRQ_LENGTH / 2;
+	cfg->nlanes = 0;
+	cfg->lane_queue_length = RPMA_DEFAULT_LANE_QUEUE_LENGTH;
+	cfg->dispatch_mode = RPMA_DISPATCH_POLL;
+	cfg->poll_budget = RPMA_DEFAULT_POLL_BUDGET;
+	cfg->listen_backlog = 0;
+	cfg->conn_cache = 0;
 	cfg->malloc = NULL;
 	cfg->free = NULL;
+	cfg->flags = 0;
 }
 
 int
@@ -120,6 +144,123 @@ rpma_config_set_recv_queue_length(struct rpma_config *cfg, uint64_t queue_len)
 	return 0;
 }
 
+int
+rpma_config_set_rma_queue_length(struct rpma_config *cfg, uint64_t queue_len)
+{
+	if (queue_len == 0)
+		return -1;
+
+	cfg->rma_queue_length = queue_len;
+	return 0;
+}
+
+int
+rpma_config_set_cq_size(struct rpma_config *cfg, uint64_t cq_size)
+{
+	cfg->cq_size = cq_size;
+	return 0;
+}
+
+int
+rpma_config_set_initiator_depth(struct rpma_config *cfg, uint64_t depth)
+{
+	cfg->initiator_depth = depth;
+	return 0;
+}
+
+int
+rpma_config_set_cq_batch_size(struct rpma_config *cfg, uint64_t batch_size)
+{
+	if (batch_size == 0 || batch_size > RPMA_MAX_CQ_BATCH_SIZE)
+		return -1;
+
+	cfg->cq_batch_size = batch_size;
+	return 0;
+}
+
+int
+rpma_config_set_send_signal_interval(struct rpma_config *cfg,
+				     uint64_t interval)
+{
+	if (interval == 0)
+		return -1;
+
+	cfg->send_signal_interval = interval;
+	return 0;
+}
+
+int
+rpma_config_set_inline_threshold(struct rpma_config *cfg, uint32_t threshold)
+{
+	cfg->inline_threshold = threshold;
+	return 0;
+}
+
+int
+rpma_config_set_max_sge(struct rpma_config *cfg, uint64_t max_sge)
+{
+	if (max_sge == 0 || max_sge > RPMA_MAX_SGE)
+		return -1;
+
+	cfg->max_sge = max_sge;
+	return 0;
+}
+
+int
+rpma_config_set_srq(struct rpma_config *cfg, uint64_t length,
+		    uint64_t low_watermark)
+{
+	if (length == 0 || low_watermark == 0 || low_watermark > length)
+		return -1;
+
+	cfg->srq_length = length;
+	cfg->srq_low_watermark = low_watermark;
+	return 0;
+}
+
+int
+rpma_config_set_lanes(struct rpma_config *cfg, uint64_t nlanes,
+		      uint64_t lane_queue_length)
+{
+	/* room for a write and the flush */
+	if (lane_queue_length < 2)
+		return -1;
+
+	cfg->nlanes = nlanes;
+	cfg->lane_queue_length = lane_queue_length;
+	return 0;
+}
+
+int
+rpma_config_set_dispatch_mode(struct rpma_config *cfg, int mode,
+			      uint64_t poll_budget)
+{
+	if (mode != RPMA_DISPATCH_POLL && mode != RPMA_DISPATCH_HYBRID &&
+	    mode != RPMA_DISPATCH_ADAPTIVE)
+		return -1;
+
+	cfg->dispatch_mode = mode;
+	cfg->poll_budget = poll_budget;
+	return 0;
+}
+
+int
+rpma_config_set_listen_backlog(struct rpma_config *cfg, int backlog)
+{
+	if (backlog < 0)
+		return -1;
+
+	cfg->listen_backlog = backlog;
+	return 0;
+}
+
+int
+rpma_config_set_conn_cache(struct rpma_config *cfg, uint64_t nconns)
+{
+	cfg->conn_cache = nconns;
+	return 0;
+}
+
 int
 rpma_config_set_queue_alloc_funcs(struct rpma_config *cfg,
 				  rpma_malloc_func malloc_func,
@@ -38,12 +38,30 @@
 
 #include <librpma.h>
 
+#define RPMA_MAX_CQ_BATCH_SIZE 64
+#define RPMA_MAX_SGE 32
+
 struct rpma_config {
 	char *addr;
 	char *service;
 	size_t msg_size;
 	uint64_t send_queue_length;
 	uint64_t recv_queue_length;
+	uint64_t rma_queue_length;
+	uint64_t cq_size;
+	uint64_t initiator_depth;
+	uint64_t cq_batch_size;
+	uint64_t send_signal_interval;
+	uint32_t inline_threshold;
+	uint64_t max_sge;
+	uint64_t srq_length;
+	uint64_t srq_low_watermark;
+	uint64_t nlanes;
+	uint64_t lane_queue_length;
+	int dispatch_mode;
+	uint64_t poll_budget;
+	int listen_backlog;
+	uint64_t conn_cache;
 	rpma_malloc_func malloc;
 	rpma_free_func free;
 	unsigned flags;
@@ -35,20 +35,24 @@
  */
 
 #include <rdma/rdma_cma.h>
+#include <sched.h>
 
 #include <librpma.h>
 
 #include "alloc.h"
+#include "config.h"
 #include "connection.h"
 #include "dispatcher.h"
 #include "memory.h"
 #include "rpma_utils.h"
+#include "srq.h"
 #include "zone.h"
 
-#define CQ_SIZE 10 /* XXX */
-
-int
-rpma_connection_new(struct rpma_zone *zone, struct rpma_connection **conn)
+/*
+ * conn_alloc -- (internal) allocate the connection along with its buffers
+ */
+static int
+conn_alloc(struct rpma_zone *zone, struct rpma_connection **conn)
 {
 	struct rpma_connection *ptr = Malloc(sizeof(struct rpma_connection));
 	if (!ptr)
@@ -56,15 +60,32 @@ rpma_connection_new(struct rpma_zone *zone, struct rpma_connection **conn)
 
 	ptr->zone = zone;
 	ptr->id = NULL;
+	ptr->qpx = NULL;
+	ptr->native_flush = 0;
+	ptr->native_atomic_write = 0;
 	ptr->cq = NULL;
+	ptr->cq_cached = NULL;
 	ptr->disconnected = 0;
 	ptr->disp = NULL;
+	ptr->cq_disp = NULL;
+	ptr->max_inline_data = 0;
+
+	os_mutex_init(&ptr->cq_lock);
+	ptr->cq_stash = NULL;
+	ptr->cq_stash_size = 0;
+	ptr->cq_stash_head = 0;
+	ptr->cq_stash_num = 0;
 
 	ptr->on_connection_recv_func = NULL;
 	ptr->on_transmission_notify_func = NULL;
+	ptr->notify_mem = NULL;
 
 	ptr->custom_data = NULL;
 
+	ptr->state = RPMA_CONN_STATE_IDLE;
+	ptr->setup_status = 0;
+	ptr->setup_sync = 0;
+
 	int ret = rpma_connection_rma_init(ptr);
 	if (ret)
 		goto err_rma_init;
@@ -80,48 +101,345 @@ rpma_connection_new(struct rpma_zone *zone, struct rpma_connection **conn)
 err_msg_init:
 	(void)rpma_connection_rma_fini(ptr);
 err_rma_init:
+	os_mutex_destroy(&ptr->cq_lock);
 	Free(ptr);
 	return ret;
 }
 
+/*
+ * conn_free -- (internal) free the connection which has never been used
+ */
+static void
+conn_free(struct rpma_connection *conn)
+{
+	if (conn->cq_cached)
+		(void)ibv_destroy_cq(conn->cq_cached);
+
+	(void)rpma_connection_rma_fini(conn);
+	(void)rpma_connection_msg_fini(conn);
+	os_mutex_destroy(&conn->cq_lock);
+	Free(conn);
+}
+
+/*
+ * rpma_connection_cache_refill -- create the connections in advance so
+ * rpma_connection_new() does not have to register the buffers nor to create
+ * the CQ when a connection request comes, the cache is filled up only once
+ * it drops below the low watermark so not every idle moment allocates
+ */
+int
+rpma_connection_cache_refill(struct rpma_zone *zone)
+{
+	struct rpma_connection *conn;
+	uint64_t num;
+	int ret;
+
+	os_mutex_lock(&zone->conn_cache_lock);
+	num = zone->conn_cache_num;
+	os_mutex_unlock(&zone->conn_cache_lock);
+
+	if (num >= zone->conn_cache_low_watermark)
+		return 0;
+
+	while (1) {
+		os_mutex_lock(&zone->conn_cache_lock);
+		num = zone->conn_cache_num;
+		os_mutex_unlock(&zone->conn_cache_lock);
+
+		if (num >= zone->conn_cache_size)
+			return 0;
+
+		ret = conn_alloc(zone, &conn);
+		if (ret)
+			return ret;
+
+		/* a private CQ without a completion channel */
+		conn->cq_cached = ibv_create_cq(zone->device, zone->cq_size,
+						(void *)conn, NULL, 0);
+		if (!conn->cq_cached) {
+			ret = RPMA_E_ERRNO;
+			conn_free(conn);
+			return ret;
+		}
+
+		os_mutex_lock(&zone->conn_cache_lock);
+		if (zone->conn_cache_num < zone->conn_cache_size) {
+			zone->conn_cache[zone->conn_cache_num++] = conn;
+			conn = NULL;
+		}
+		os_mutex_unlock(&zone->conn_cache_lock);
+
+		/* the cache has been filled up in the meantime */
+		if (conn) {
+			conn_free(conn);
+			return 0;
+		}
+	}
+}
+
+void
+rpma_connection_cache_fini(struct rpma_zone *zone)
+{
+	while (zone->conn_cache_num)
+		conn_free(zone->conn_cache[--zone->conn_cache_num]);
+}
+
+int
+rpma_connection_new(struct rpma_zone *zone, struct rpma_connection **conn)
+{
+	struct rpma_connection *ptr = NULL;
+
+	os_mutex_lock(&zone->conn_cache_lock);
+	if (zone->conn_cache_num)
+		ptr = zone->conn_cache[--zone->conn_cache_num];
+	os_mutex_unlock(&zone->conn_cache_lock);
+
+	if (ptr) {
+		*conn = ptr;
+		return 0;
+	}
+
+	return conn_alloc(zone, conn);
+}
+
+/*
+ * cq_stash_init -- (internal) allocate the stash of the completions taken from
+ * the CQ by the other threads (the lanes or the dispatcher owning the shared
+ * CQ), no more entries of the connection can be in the CQ at once
+ */
 static int
-id_init(struct rpma_connection *conn, struct rdma_cm_id *id)
+cq_stash_init(struct rpma_connection *conn)
+{
+	if (conn->nlanes == 0 && conn->cq_disp == NULL)
+		return 0;
+
+	conn->cq_stash_size = (uint64_t)conn->zone->cq_size;
+	conn->cq_stash = Malloc(conn->cq_stash_size * sizeof(*conn->cq_stash));
+	if (!conn->cq_stash)
+		return RPMA_E_ERRNO;
+
+	conn->cq_stash_head = 0;
+	conn->cq_stash_num = 0;
+
+	return 0;
+}
+
+/*
+ * cq_init -- (internal) create a private CQ or take a part of the shared one
+ * if the connection is attached to a dispatcher owning a shared CQ
+ */
+static int
+cq_init(struct rpma_connection *conn, struct rdma_cm_id *id)
 {
 	struct rpma_zone *zone = conn->zone;
-	int ret = 0;
+	struct rpma_dispatcher *disp = conn->disp;
+
+	if (disp && disp->cq) {
+		int ret = rpma_dispatcher_cq_reserve(disp, zone->cq_size);
+		if (ret)
+			return ret;
+
+		conn->cq = disp->cq;
+		conn->cq_disp = disp;
+		return 0;
+	}
+
+	/* the attached dispatcher has to be woken up by the completions */
+	struct ibv_comp_channel *channel = disp ? disp->channel : NULL;
+
+	/* the CQ created in advance cannot be bound to the channel */
+	if (conn->cq_cached && !channel) {
+		conn->cq = conn->cq_cached;
+		conn->cq_cached = NULL;
+		return 0;
+	}
 
-	int cqe = CQ_SIZE;
-	conn->cq = ibv_create_cq(id->verbs, cqe, (void *)conn, 0, 0);
+	conn->cq = ibv_create_cq(id->verbs, zone->cq_size, (void *)conn,
+				 channel, 0);
 	if (!conn->cq)
 		return RPMA_E_ERRNO;
 
+	return 0;
+}
+
+static int
+cq_fini(struct rpma_connection *conn)
+{
+	int ret = 0;
+
+	Free(conn->cq_stash);
+	conn->cq_stash = NULL;
+	conn->cq_stash_num = 0;
+
+	if (conn->cq_disp) {
+		rpma_dispatcher_cq_release(conn->cq_disp, conn->zone->cq_size);
+		conn->cq_disp = NULL;
+	} else {
+		ret = ibv_destroy_cq(conn->cq);
+		if (ret) {
+			ERR_STR(ret, "ibv_destroy_cq");
+			ret = -ret; /* XXX macro? */
+		}
+	}
+
+	conn->cq = NULL;
+
+	return ret;
+}
+
+#if defined(NATIVE_FLUSH_SUPPORTED) || defined(NATIVE_ATOMIC_WRITE_SUPPORTED)
+#define QP_EX_SUPPORTED 1
+
+/*
+ * qp_ex_ops -- (internal) the extended QP ops the connection would use
+ */
+static uint64_t
+qp_ex_ops(struct rpma_connection *conn)
+{
+	uint64_t ops = 0;
+
+#ifdef NATIVE_FLUSH_SUPPORTED
+	if (conn->zone->native_flush)
+		ops |= IBV_QP_EX_WITH_FLUSH;
+#endif
+#ifdef NATIVE_ATOMIC_WRITE_SUPPORTED
+	ops |= IBV_QP_EX_WITH_ATOMIC_WRITE;
+#endif
+
+	return ops;
+}
+
+/*
+ * qp_create_ex -- (internal) create the extended QP supporting the ops
+ */
+static int
+qp_create_ex(struct rpma_connection *conn, struct rdma_cm_id *id,
+	     struct ibv_qp_init_attr *attr, uint64_t ops)
+{
+	struct ibv_qp_init_attr_ex attr_ex;
+	memset(&attr_ex, 0, sizeof(attr_ex));
+	attr_ex.qp_context = attr->qp_context;
+	attr_ex.send_cq = attr->send_cq;
+	attr_ex.recv_cq = attr->recv_cq;
+	attr_ex.srq = attr->srq;
+	attr_ex.cap = attr->cap;
+	attr_ex.qp_type = attr->qp_type;
+	attr_ex.sq_sig_all = attr->sq_sig_all;
+	attr_ex.comp_mask =
+		IBV_QP_INIT_ATTR_PD | IBV_QP_INIT_ATTR_SEND_OPS_FLAGS;
+	attr_ex.pd = conn->zone->pd;
+	attr_ex.send_ops_flags = IBV_QP_EX_WITH_RDMA_WRITE |
+		IBV_QP_EX_WITH_RDMA_READ | IBV_QP_EX_WITH_SEND |
+		IBV_QP_EX_WITH_SEND_WITH_IMM |
+		IBV_QP_EX_WITH_RDMA_WRITE_WITH_IMM |
+		IBV_QP_EX_WITH_ATOMIC_CMP_AND_SWP |
+		IBV_QP_EX_WITH_ATOMIC_FETCH_AND_ADD | ops;
+
+	int ret = rdma_create_qp_ex(id, &attr_ex);
+	if (ret)
+		return ret;
+
+	attr->cap = attr_ex.cap;
+	conn->qpx = ibv_qp_to_qp_ex(id->qp);
+#ifdef NATIVE_FLUSH_SUPPORTED
+	conn->native_flush = !!(ops & IBV_QP_EX_WITH_FLUSH);
+#endif
+#ifdef NATIVE_ATOMIC_WRITE_SUPPORTED
+	conn->native_atomic_write = !!(ops & IBV_QP_EX_WITH_ATOMIC_WRITE);
+#endif
+
+	return 0;
+}
+#endif
+
+/*
+ * qp_create -- (internal) create QP, the extended one if the device supports
+ * the native flush or atomic write
+ */
+static int
+qp_create(struct rpma_connection *conn, struct rdma_cm_id *id,
+	  struct ibv_qp_init_attr *attr)
+{
+#ifdef QP_EX_SUPPORTED
+	uint64_t ops = qp_ex_ops(conn);
+	if (ops) {
+		if (!qp_create_ex(conn, id, attr, ops))
+			return 0;
+
+		LOG(3, "extended QP not created, native ops not used");
+	}
+#endif
+
+	return rdma_create_qp(id, conn->zone->pd, attr);
+}
+
+static int
+id_init(struct rpma_connection *conn, struct rdma_cm_id *id)
+{
+	struct rpma_zone *zone = conn->zone;
+
+	int ret = cq_init(conn, id);
+	if (ret)
+		return ret;
+
+	ret = cq_stash_init(conn);
+	if (ret)
+		goto err_create_qp;
+
 	struct ibv_qp_init_attr init_qp_attr;
 
 	init_qp_attr.qp_context = conn;
 	init_qp_attr.send_cq = conn->cq;
 	init_qp_attr.recv_cq = conn->cq;
-	init_qp_attr.srq = NULL;
-	init_qp_attr.cap.max_send_wr = CQ_SIZE; /* XXX */
-	init_qp_attr.cap.max_recv_wr = CQ_SIZE; /* XXX */
-	init_qp_attr.cap.max_send_sge = 1;
+	init_qp_attr.srq = zone->srq ? zone->srq->srq : NULL;
+	init_qp_attr.cap.max_send_wr = zone->max_send_wr;
+	init_qp_attr.cap.max_recv_wr = zone->srq ? 0 : zone->max_recv_wr;
+	init_qp_attr.cap.max_send_sge = (uint32_t)zone->max_sge;
 	init_qp_attr.cap.max_recv_sge = 1;
-	init_qp_attr.cap.max_inline_data = 0; /* XXX */
+	init_qp_attr.cap.max_inline_data = zone->inline_threshold;
 	init_qp_attr.qp_type = IBV_QPT_RC;
 	init_qp_attr.sq_sig_all = 0;
 
-	ret = rdma_create_qp(id, zone->pd, &init_qp_attr);
+	ret = qp_create(conn, id, &init_qp_attr);
+	if (ret && init_qp_attr.cap.max_inline_data) {
+		/* the device does not support as much inline data */
+		LOG(3, "inline data of %u bytes not supported",
+		    init_qp_attr.cap.max_inline_data);
+		init_qp_attr.cap.max_inline_data = 0;
+		ret = qp_create(conn, id, &init_qp_attr);
+	}
 	if (ret) {
 		ret = RPMA_E_ERRNO;
 		goto err_create_qp;
 	}
 
+	/* the id may be the one the connection already owns */
+	struct rdma_cm_id *id_prev = conn->id;
 	conn->id = id;
 
+	/* the device may grant more than requested */
+	conn->max_inline_data = init_qp_attr.cap.max_inline_data;
+	if (conn->max_inline_data > zone->inline_threshold)
+		conn->max_inline_data = zone->inline_threshold;
+
+	/* completions from the shared CQ are routed by qp_num */
+	if (conn->cq_disp) {
+		ret = rpma_dispatcher_qp_register(conn->cq_disp, conn);
+		if (ret)
+			goto err_qp_register;
+	}
+
 	return 0;
 
+err_qp_register:
+	(void)ibv_destroy_qp(id->qp);
+	id->qp = NULL;
+	conn->qpx = NULL;
+	conn->native_flush = 0;
+	conn->native_atomic_write = 0;
+	conn->id = id_prev;
 err_create_qp:
-	ibv_destroy_cq(conn->cq);
-	conn->cq = NULL;
+	(void)cq_fini(conn);
 	return ret;
 }
 
@@ -134,64 +452,69 @@ id_fini(struct rpma_connection *conn)
 		return 0;
 
 	if (conn->id->qp) {
+		if (conn->cq_disp)
+			rpma_dispatcher_qp_unregister(conn->cq_disp, conn);
+
 		int ret = ibv_destroy_qp(conn->id->qp);
 		if (ret) {
 			ERR_STR(ret, "ibv_destroy_qp");
 			return -ret; /* XXX macro? */
 		}
+		conn->id->qp = NULL;
 	}
 
 	if (conn->cq) {
-		ret = ibv_destroy_cq(conn->cq);
-		if (ret) {
-			ERR_STR(ret, "ibv_destroy_cq");
-			return -ret; /* XXX macro? */
-		}
-	}
-
-	return 0;
-}
-
-static int
-recv_post_all(struct rpma_connection *conn)
-{
-	int ret;
-	void *ptr = conn->recv.buff->ptr;
-
-	for (uint64_t i = 0; i < conn->zone->recv_queue_length; ++i) {
-		ret = rpma_connection_recv_post(conn, ptr);
+		ret = cq_fini(conn);
 		if (ret)
 			return ret;
-		ptr = (void *)((uintptr_t)ptr + conn->zone->msg_size);
 	}
 
 	return 0;
 }
 
 int
-rpma_connection_accept(struct rpma_connection *conn)
+rpma_connection_accept_async(struct rpma_connection *conn)
 {
-	int ret = id_init(conn, conn->zone->edata->id);
+	struct rdma_cm_id *id = conn->zone->edata->id;
+
+	int ret = id_init(conn, id);
 	if (ret)
 		return ret;
 
-	ret = recv_post_all(conn);
+	ret = rpma_connection_recv_post_all(conn);
 	if (ret)
 		goto err_recv_post_all;
 
+	/* do not exceed what the requester is able to handle */
+	struct rdma_conn_param *req = &conn->zone->edata->param.conn;
+	rpma_connection_pdata_apply(conn, req->private_data,
+				    req->private_data_len);
+
+	struct rpma_conn_pdata pdata;
+	rpma_connection_pdata_init(conn, &pdata);
+
 	struct rdma_conn_param conn_param;
-	conn_param.private_data = NULL; /* XXX very interesting */
-	conn_param.private_data_len = 0;
-	conn_param.responder_resources = CQ_SIZE; /* XXX ? */
-	conn_param.initiator_depth = CQ_SIZE;	  /* XXX ? */
-	conn_param.flow_control = 1;		  /* XXX */
-	conn_param.retry_count = 0;		  /* ignored */
-	conn_param.rnr_retry_count = 7;		  /* max for 3-bit value */
+	conn_param.private_data = &pdata;
+	conn_param.private_data_len = sizeof(pdata);
+	conn_param.responder_resources = conn->zone->responder_resources;
+	if (req->initiator_depth < conn_param.responder_resources)
+		conn_param.responder_resources = req->initiator_depth;
+	conn_param.initiator_depth = conn->zone->initiator_depth;
+	if (req->responder_resources < conn_param.initiator_depth)
+		conn_param.initiator_depth = req->responder_resources;
+	conn_param.flow_control = 1;	/* XXX */
+	conn_param.retry_count = 0;	/* ignored */
+	conn_param.rnr_retry_count = 7; /* max for 3-bit value */
 	/* since QP is created on this connection id srq and qp_num are ignored
 	 */
 
+	/* the further events of the id are routed to the connection */
+	id->context = conn;
+	conn->state = RPMA_CONN_STATE_CONNECTING;
+
 	ret = rdma_accept(conn->id, &conn_param);
 	if (ret) {
+		ret = RPMA_E_ERRNO;
 		ERR_STR(ret, "rdma_accept");
 		goto err_accept;
 	}
@@ -200,20 +523,33 @@ rpma_connection_accept(struct rpma_connection *conn)
 	if (ret)
 		goto err_event_ack;
 
-	ret = rpma_zone_wait_connected(conn->zone, conn);
-	if (ret)
-		goto err_connected;
-
 	return 0;
 
-err_connected:
 err_event_ack:
 err_accept:
+	id->context = NULL;
+	conn->state = RPMA_CONN_STATE_IDLE;
 err_recv_post_all:
 	id_fini(conn);
 	return ret;
 }
 
+int
+rpma_connection_accept(struct rpma_connection *conn)
+{
+	int ret = rpma_connection_accept_async(conn);
+	if (ret)
+		return ret;
+
+	conn->setup_sync = 1;
+	ret = rpma_zone_wait_connected(conn->zone, conn);
+	conn->setup_sync = 0;
+	if (ret)
+		id_fini(conn);
+
+	return ret;
+}
+
 int
 rpma_connection_reject(struct rpma_zone *zone)
 {
@@ -233,14 +569,18 @@ rpma_connection_reject(struct rpma_zone *zone)
 }
 
 int
-rpma_connection_establish(struct rpma_connection *conn)
+rpma_connection_establish_async(struct rpma_connection *conn)
 {
-	struct rdma_addrinfo *rai = conn->zone->rai;
+	struct rpma_zone *zone = conn->zone;
+	struct rdma_addrinfo *rai = zone->rai;
 
-	int ret = rdma_create_id(NULL, &conn->id, NULL, RDMA_PS_TCP);
+	/* the events of the id come to the zone with the connection attached */
+	int ret = rdma_create_id(zone->ec, &conn->id, conn, RDMA_PS_TCP);
 	if (ret)
 		return RPMA_E_ERRNO;
 
+	conn->state = RPMA_CONN_STATE_ADDR_RESOLVING;
+
 	ret = rdma_resolve_addr(conn->id, rai->ai_src_addr, rai->ai_dst_addr,
 				RPMA_DEFAULT_TIMEOUT);
 	if (ret) {
@@ -249,25 +589,58 @@ rpma_connection_establish(struct rpma_connection *conn)
 		goto err_resolve_addr;
 	}
 
-	ret = rdma_resolve_route(conn->id, RPMA_DEFAULT_TIMEOUT);
+	return 0;
+
+err_resolve_addr:
+	conn->state = RPMA_CONN_STATE_IDLE;
+	rdma_destroy_id(conn->id);
+	conn->id = NULL;
+	return ret;
+}
+
+int
+rpma_connection_establish(struct rpma_connection *conn)
+{
+	int ret = rpma_connection_establish_async(conn);
+	if (ret)
+		return ret;
+
+	conn->setup_sync = 1;
+	ret = rpma_zone_wait_connected(conn->zone, conn);
+	conn->setup_sync = 0;
 	if (ret) {
-		ret = RPMA_E_ERRNO;
-		ERR_STR(ret, "rdma_resolve_route");
-		goto err_resolve_route;
+		id_fini(conn);
+		rdma_destroy_id(conn->id);
+		conn->id = NULL;
 	}
 
-	ret = id_init(conn, conn->id);
+	return ret;
+}
+
+/*
+ * connect_post -- (internal) create the QP and ask the peer to connect once
+ * the route is resolved
+ */
+static int
+connect_post(struct rpma_connection *conn)
+{
+	int ret = id_init(conn, conn->id);
 	if (ret)
-		goto err_id_init;
+		return ret;
 
-	ret = recv_post_all(conn);
+	ret = rpma_connection_recv_post_all(conn);
 	if (ret)
 		goto err_recv_post_all;
 
+	struct rpma_conn_pdata pdata;
+	rpma_connection_pdata_init(conn, &pdata);
+
 	struct rdma_conn_param conn_param;
 	memset(&conn_param, 0, sizeof conn_param);
-	conn_param.responder_resources = RDMA_MAX_RESP_RES;
-	conn_param.initiator_depth = RDMA_MAX_INIT_DEPTH;
+	conn_param.private_data = &pdata;
+	conn_param.private_data_len = sizeof(pdata);
+	conn_param.responder_resources = conn->zone->responder_resources;
+	conn_param.initiator_depth = conn->zone->initiator_depth;
 	conn_param.flow_control = 1;
 	conn_param.retry_count = 7;	/* max 3-bit value */
 	conn_param.rnr_retry_count = 7; /* max 3-bit value */
@@ -278,25 +651,76 @@ rpma_connection_establish(struct rpma_connection *conn)
 		goto err_connect;
 	}
 
-	ret = rdma_migrate_id(conn->id, conn->zone->ec);
-	if (ret) {
-		ret = RPMA_E_ERRNO;
-		ERR_STR(ret, "rdma_migrate_id");
-		goto err_migrate_id;
-	}
-
 	return 0;
 
-err_migrate_id:
-	(void)rdma_disconnect(conn->id);
 err_connect:
 err_recv_post_all:
 	id_fini(conn);
-err_id_init:
-err_resolve_route:
-err_resolve_addr:
-	rdma_destroy_id(conn->id);
-	conn->id = NULL;
+	return ret;
+}
+
+/*
+ * rpma_connection_setup_event -- move the connection setup forward on the CM
+ * event of its id, the event has to be acknowledged by the caller
+ */
+int
+rpma_connection_setup_event(struct rpma_connection *conn,
+			    struct rdma_cm_event *edata)
+{
+	int ret = 0;
+
+	switch (edata->event) {
+	case RDMA_CM_EVENT_ADDR_RESOLVED:
+		if (conn->state != RPMA_CONN_STATE_ADDR_RESOLVING)
+			break;
+
+		ret = rdma_resolve_route(conn->id, RPMA_DEFAULT_TIMEOUT);
+		if (ret) {
+			ret = RPMA_E_ERRNO;
+			ERR_STR(ret, "rdma_resolve_route");
+			break;
+		}
+
+		conn->state = RPMA_CONN_STATE_ROUTE_RESOLVING;
+		return 0;
+	case RDMA_CM_EVENT_ROUTE_RESOLVED:
+		if (conn->state != RPMA_CONN_STATE_ROUTE_RESOLVING)
+			break;
+
+		ret = connect_post(conn);
+		if (ret)
+			break;
+
+		conn->state = RPMA_CONN_STATE_CONNECTING;
+		return 0;
+	case RDMA_CM_EVENT_ESTABLISHED:
+		if (conn->state != RPMA_CONN_STATE_CONNECTING)
+			break;
+
+		/* the credits granted by the other side */
+		rpma_connection_pdata_apply(conn,
+					    edata->param.conn.private_data,
+					    edata->param.conn.private_data_len);
+
+		conn->state = RPMA_CONN_STATE_ESTABLISHED;
+		return 0;
+	default:
+		/* ADDR_ERROR, ROUTE_ERROR, CONNECT_ERROR, UNREACHABLE etc. */
+		ERR("connection setup failed (%u, status %d)", edata->event,
+		    edata->status);
+		ret = edata->status < 0 ? edata->status : RPMA_E_EC_EVENT;
+		break;
+	}
+
+	if (ret == 0) {
+		ERR("unexpected event received (%u) in state %d",
+		    edata->event, conn->state);
+		ret = RPMA_E_EC_EVENT;
+	}
+
+	conn->state = RPMA_CONN_STATE_FAILED;
+	conn->setup_status = ret;
+
 	return ret;
 }
 
@@ -324,7 +748,7 @@ rpma_connection_delete(struct rpma_connection **conn)
 
 	ASSERTeq(ptr->disp, NULL);
 
-	if (ptr->id && !ptr->disconnected) {
+	if (ptr->state == RPMA_CONN_STATE_ESTABLISHED && !ptr->disconnected) {
 		ret = rpma_connection_disconnect(ptr);
 		if (ret)
 			return ret;
@@ -332,6 +756,17 @@ rpma_connection_delete(struct rpma_connection **conn)
 
 	id_fini(ptr);
 
+	if (ptr->id) {
+		/* all the events of the id are acknowledged by the zone */
+		rdma_destroy_id(ptr->id);
+		ptr->id = NULL;
+	}
+
+	if (ptr->cq_cached) {
+		(void)ibv_destroy_cq(ptr->cq_cached);
+		ptr->cq_cached = NULL;
+	}
+
 	ret = rpma_connection_rma_fini(ptr);
 	if (ret)
 		goto err_rma_fini;
@@ -340,6 +775,7 @@ rpma_connection_delete(struct rpma_connection **conn)
 	if (ret)
 		goto err_msg_fini;
 
+	os_mutex_destroy(&ptr->cq_lock);
 	Free(ptr);
 	*conn = NULL;
 
@@ -418,6 +854,15 @@ rpma_connection_enqueue(struct rpma_connection *conn, rpma_queue_func func,
 	return rpma_dispatcher_enqueue_func(conn->disp, conn, func, arg);
 }
 
+int
+rpma_connection_enqueue_stealable(struct rpma_connection *conn,
+				  rpma_queue_func func, void *arg)
+{
+	ASSERTne(conn->disp, NULL);
+
+	return rpma_dispatcher_enqueue_stealable(conn->disp, conn, func, arg);
+}
+
 int
 rpma_connection_register_on_notify(struct rpma_connection *conn,
 				   rpma_on_transmission_notify_func func)
@@ -427,6 +872,15 @@ rpma_connection_register_on_notify(struct rpma_connection *conn,
 	return 0;
 }
 
+int
+rpma_connection_set_notify_memory(struct rpma_connection *conn,
+				  struct rpma_memory_local *mem)
+{
+	conn->notify_mem = mem;
+
+	return 0;
+}
+
 int
 rpma_connection_register_on_recv(struct rpma_connection *conn,
 				 rpma_on_connection_recv_func func)
@@ -441,15 +895,60 @@ rpma_connection_cq_entry_process(struct rpma_connection *conn,
 				 struct ibv_wc *wc)
 {
 	int ret = 0;
+
+	if (rpma_connection_rma_is_op(conn, wc->wr_id)) {
+		rpma_connection_rma_complete(conn, wc);
+		return 0;
+	}
+
+	if (rpma_connection_is_lane(conn, wc->wr_id)) {
+		rpma_connection_lane_complete(conn, wc);
+		return 0;
+	}
+
+	if (rpma_connection_is_send(conn, wc->wr_id)) {
+		rpma_connection_send_complete(conn, wc);
+		return 0;
+	}
+
+	ASSERTeq(wc->status, IBV_WC_SUCCESS); /* XXX */
+
+	/* the immediate data carries the offset instead of the credits */
+	if (wc->opcode == IBV_WC_RECV_RDMA_WITH_IMM) {
+		rpma_connection_recv_consumed(conn);
+		ret = rpma_connection_recv_notify(conn, wc);
+
+		/* nothing has been received into the buffer */
+		int ret_release =
+			rpma_connection_recv_release(conn, (void *)wc->wr_id);
+		if (!ret)
+			ret = ret_release;
+
+		return ret;
+	}
+
 	if (wc->opcode & IBV_WC_RECV) {
+		rpma_connection_recv_consumed(conn);
+
 		/* XXX uarg is still necesarry here? */
 		void *ptr = (void *)wc->wr_id;
-		ret = conn->on_connection_recv_func(conn, ptr,
-						    conn->zone->msg_size);
+
+		/* a credit update is not passed to the consumer */
+		if (rpma_connection_recv_credits(conn, wc))
+			return rpma_connection_recv_release(conn, ptr);
+
+		ret = conn->on_connection_recv_func(conn, ptr, wc->byte_len);
+
+		/* the consumer will release the buffer on its own */
+		if (ret == RPMA_RECV_KEEP)
+			return 0;
+
+		int ret_release = rpma_connection_recv_release(conn, ptr);
+		if (!ret)
+			ret = ret_release;
 	} else {
 		ASSERT(0);
 	}
-	/* XXX IBV_WC_RDMA_WRITE, IBV_WC_RDMA_READ */
 
 	return ret;
 }
@@ -457,16 +956,22 @@ rpma_connection_cq_entry_process(struct rpma_connection *conn,
 static int
 cq_entry_process_or_enqueue(struct rpma_connection *conn, struct ibv_wc *wc)
 {
-	if (conn->disp)
+	/* completions of the RMA ops, lanes and sends are marked as done */
+	if (conn->disp && !rpma_connection_rma_is_op(conn, wc->wr_id) &&
+	    !rpma_connection_is_lane(conn, wc->wr_id) &&
+	    !rpma_connection_is_send(conn, wc->wr_id))
 		return rpma_dispatcher_enqueue_cq_entry(conn->disp, conn, wc);
 
 	return rpma_connection_cq_entry_process(conn, wc);
 }
 
+/*
+ * cq_poll -- (internal) poll up to num entries
+ */
 static inline int
-cq_read(struct rpma_connection *conn, struct ibv_wc *wc)
+cq_poll(struct rpma_connection *conn, int num, struct ibv_wc *wcs)
 {
-	int ret = ibv_poll_cq(conn->cq, 1 /* num_entries */, wc);
+	int ret = ibv_poll_cq(conn->cq, num, wcs);
 	if (ret == 0)
 		return 0;
 	if (ret < 0) {
@@ -474,64 +979,218 @@ cq_read(struct rpma_connection *conn, struct ibv_wc *wc)
 		return ret;
 	}
 
-	ASSERTeq(ret, 1);
-	ASSERTeq(wc->status, IBV_WC_SUCCESS); /* XXX */
+	ASSERT(ret <= num);
 
 	return ret;
 }
 
+/*
+ * cq_stash_put -- (internal) keep the completion for the next consumer
+ */
+static inline void
+cq_stash_put(struct rpma_connection *conn, struct ibv_wc *wc)
+{
+	ASSERT(conn->cq_stash_num < conn->cq_stash_size);
+
+	uint64_t tail = (conn->cq_stash_head + conn->cq_stash_num) %
+		conn->cq_stash_size;
+	conn->cq_stash[tail] = *wc;
+	++conn->cq_stash_num;
+}
+
+/*
+ * rpma_connection_cq_stash -- keep the completion of the RMA op or the send
+ * taken from the shared CQ for the thread using the connection
+ */
+void
+rpma_connection_cq_stash(struct rpma_connection *conn, struct ibv_wc *wc)
+{
+	os_mutex_lock(&conn->cq_lock);
+	cq_stash_put(conn, wc);
+	os_mutex_unlock(&conn->cq_lock);
+}
+
+/*
+ * cq_read_shared -- (internal) take the stashed completions first, they are
+ * older than the ones still in the CQ
+ */
+static int
+cq_read_shared(struct rpma_connection *conn, struct ibv_wc *wcs)
+{
+	int batch = conn->zone->cq_batch_size;
+	int num = 0;
+	int ret = 0;
+
+	os_mutex_lock(&conn->cq_lock);
+
+	while (conn->cq_stash_num > 0 && num < batch) {
+		wcs[num++] = conn->cq_stash[conn->cq_stash_head];
+		conn->cq_stash_head =
+			(conn->cq_stash_head + 1) % conn->cq_stash_size;
+		--conn->cq_stash_num;
+	}
+
+	/* only the dispatcher polls the shared CQ */
+	if (num < batch && !conn->cq_disp)
+		ret = cq_poll(conn, batch - num, wcs + num);
+
+	os_mutex_unlock(&conn->cq_lock);
+
+	if (ret < 0)
+		return ret;
+
+	return num + ret;
+}
+
+/*
+ * cq_read -- (internal) poll up to zone->cq_batch_size entries at once
+ */
+static inline int
+cq_read(struct rpma_connection *conn, struct ibv_wc *wcs)
+{
+	if (conn->nlanes || conn->cq_disp)
+		return cq_read_shared(conn, wcs);
+
+	return cq_poll(conn, conn->zone->cq_batch_size, wcs);
+}
+
+/*
+ * rpma_connection_lane_cq_poll -- complete the flushes of the lanes, the other
+ * completions are stashed for the next consumer polling the CQ
+ */
+int
+rpma_connection_lane_cq_poll(struct rpma_connection *conn)
+{
+	struct ibv_wc wcs[RPMA_MAX_CQ_BATCH_SIZE];
+
+	/* the other lanes wait for whoever is polling the CQ */
+	if (os_mutex_trylock(&conn->cq_lock))
+		return 0;
+
+	/* nothing is taken from the CQ which cannot be stashed */
+	uint64_t space = conn->cq_stash_size - conn->cq_stash_num;
+	int num = conn->zone->cq_batch_size;
+	if (space < (uint64_t)num)
+		num = (int)space;
+	int ret = 0;
+
+	if (num > 0)
+		ret = cq_poll(conn, num, wcs);
+
+	for (int i = 0; i < ret; ++i) {
+		if (rpma_connection_is_lane(conn, wcs[i].wr_id)) {
+			rpma_connection_lane_complete(conn, &wcs[i]);
+			continue;
+		}
+
+		cq_stash_put(conn, &wcs[i]);
+	}
+
+	os_mutex_unlock(&conn->cq_lock);
+
+	return ret < 0 ? ret : 0;
+}
+
 int
 rpma_connection_cq_wait(struct rpma_connection *conn, enum ibv_wc_opcode opcode,
 			uint64_t wr_id)
 {
-	struct ibv_wc wc;
+	/* on stack since the entries may be processed recursively */
+	struct ibv_wc wcs[RPMA_MAX_CQ_BATCH_SIZE];
+	struct ibv_wc *wc;
+	struct ibv_wc *found = NULL;
 	int ret;
-	int mismatch;
+	int num;
+	int match;
 
 	/* XXX additional stop condition? */
-	while (1) {
-		ret = cq_read(conn, &wc);
-		if (ret == 0)
+	while (!found) {
+		num = cq_read(conn, wcs);
+		if (num == 0) {
+			/* the dispatcher stashes the completion when it comes */
+			if (conn->cq_disp)
+				sched_yield();
 			continue;
-		else if (ret < 0)
-			return ret;
+		} else if (num < 0) {
+			return num;
+		}
+
+		for (int i = 0; i < num; ++i) {
+			wc = &wcs[i];
 
-		mismatch = (wc.opcode != opcode);
-		mismatch |= (wc.wr_id != wr_id);
+			/* opcode is not valid if the status is not SUCCESS */
+			match = (wc->wr_id == wr_id);
+			match &= (wc->status != IBV_WC_SUCCESS ||
+				  wc->opcode == opcode);
 
-		if (mismatch) {
-			ret = cq_entry_process_or_enqueue(conn, &wc);
+			if (match) {
+				ASSERTeq(found, NULL);
+				found = wc;
+				continue;
+			}
+
+			/* the rest of the batch still has to be processed */
+			ret = cq_entry_process_or_enqueue(conn, wc);
 			if (ret) {
 				/* XXX */
 				ASSERT(0);
 			}
-
-			continue;
 		}
+	}
 
-		break;
+	/* only the RMA ops are waited for */
+	rpma_connection_rma_wrs_release(conn, wr_id);
+
+	if (found->status != IBV_WC_SUCCESS) {
+		ERR("op failed: %s", ibv_wc_status_str(found->status));
+		return RPMA_E_OP_FAILED;
 	}
 
 	return 0;
 }
 
 int
-rpma_connection_cq_process(struct rpma_connection *conn)
+rpma_connection_cq_process(struct rpma_connection *conn, uint64_t *nwcs)
 {
-	struct ibv_wc wc;
+	struct ibv_wc wcs[RPMA_MAX_CQ_BATCH_SIZE];
 	int ret;
+	int num;
 
-	while (1) {
-		ret = cq_read(conn, &wc);
-		if (ret == 0)
-			break;
-		else if (ret < 0)
-			return ret;
+	do {
+		num = cq_read(conn, wcs);
+		if (num < 0)
+			return num;
 
-		ret = rpma_connection_cq_entry_process(conn, &wc);
-		if (ret)
-			return ret;
-	}
+		for (int i = 0; i < num; ++i) {
+			ret = rpma_connection_cq_entry_process(conn, &wcs[i]);
+			if (ret)
+				return ret;
+		}
+
+		*nwcs += (uint64_t)num;
+	} while (num == conn->zone->cq_batch_size);
+
+	return 0;
+}
+
+int
+rpma_connection_cq_drain(struct rpma_connection *conn)
+{
+	struct ibv_wc wcs[RPMA_MAX_CQ_BATCH_SIZE];
+	int ret;
+	int num;
+
+	do {
+		num = cq_read(conn, wcs);
+		if (num < 0)
+			return num;
+
+		for (int i = 0; i < num; ++i) {
+			ret = cq_entry_process_or_enqueue(conn, &wcs[i]);
+			if (ret)
+				return ret;
+		}
+	} while (num == conn->zone->cq_batch_size);
 
 	return 0;
 }
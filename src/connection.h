@@ -41,12 +41,72 @@
 
 #include <librpma.h>
 
+#include "os_thread.h"
+
+struct rpma_op {
+	void *op_context;
+	int op;
+	int status;
+	uint64_t nwr; /* # of WRs completed along with the op */
+	uint64_t unsignaled; /* # of the unsignaled WRs charged before the op */
+};
+
+/* remote regions written since the last flush */
+struct rpma_dirty {
+	struct rpma_memory_remote **regions;
+	uint64_t num;
+	uint64_t size;
+};
+
 struct rpma_rma {
 	struct rpma_memory_local *raw_dst;
-	struct rpma_memory_remote *raw_src;
 
+	struct rpma_dirty dirty;
+
+	struct ibv_sge sge;
+	struct ibv_send_wr wr;
+
+	/* asynchronous operations - wr_id points to the op */
+	struct rpma_op *ops;
+	uint64_t ops_size;
+	uint64_t *ops_free; /* stack of free op ids */
+	uint64_t ops_nfree;
+	uint64_t wrs_avail; /* # of WRs which can be posted */
+
+	/*
+	 * the SQ completes in order so the completion of any signaled WR
+	 * releases all the unsignaled WRs charged before it
+	 */
+	uint64_t unsignaled_charged;
+	uint64_t unsignaled_released;
+	struct rpma_op release; /* signals a write if the queue runs out */
+	int release_pending;
+
+	/* a chain of WRs posted at once */
+	struct ibv_send_wr *chain_wrs;
+	struct ibv_sge *chain_sges;
+
+	/* ids of the completed ops waiting to be reaped */
+	uint64_t *done;
+	uint64_t done_head;
+	uint64_t done_num;
+};
+
+/*
+ * a lane is used by a single thread at a time, the writes of a lane are made
+ * persistent by its own flush; the lanes share the QP and the CQ with the rest
+ * of the connection so a waiting lane takes only the flushes of the lanes from
+ * the CQ and leaves the other completions to their owners
+ */
+struct rpma_lane {
 	struct ibv_sge sge;
 	struct ibv_send_wr wr;
+
+	struct rpma_dirty dirty;
+	uint64_t nposted; /* # of WRs posted since the last drain */
+
+	int drained; /* set when the flush of the lane completes */
+	int status;
 };
 
 struct rpma_msg {
@@ -59,23 +119,105 @@ struct rpma_msg {
 	};
 };
 
+/* a receive buffer reserved for the credit update messages */
+#define RPMA_CREDITS_UPDATE_BUFFS 1
+
+/* the immediate data of a message carries the credits granted to the peer */
+#define RPMA_IMM_CREDITS_ONLY (1U << 31)
+/* the reserved buffer taken by the last credit update is posted again */
+#define RPMA_IMM_CTRL_REPOSTED (1U << 30)
+#define RPMA_IMM_CREDITS_MAX (RPMA_IMM_CTRL_REPOSTED - 1)
+
+/* received buffers released by the consumer are reposted in batches */
+struct rpma_recv_repost {
+	uint64_t *free; /* ids of the released buffers */
+	uint64_t nfree;
+	uint64_t nfree_ctrl; /* # of the released credit update buffers */
+	uint64_t posted;
+	uint64_t low_watermark;
+
+	struct ibv_recv_wr *wrs;
+	struct ibv_sge *sges;
+};
+
+/*
+ * the sends complete in the background, only every signal_interval-th send is
+ * signaled and its completion releases all the send buffers posted before
+ */
+struct rpma_send_flow {
+	uint64_t acquired; /* # of buffers taken by rpma_msg_get_ptr() */
+	uint64_t posted;
+	uint64_t completed;
+	uint64_t *signaled; /* value of posted per signaled send buffer */
+	uint64_t signal_interval;
+
+	/* # of messages the peer is able to receive, 0 - no flow control */
+	int credits_enabled;
+	uint64_t credits;
+
+	/* # of reposted receive buffers not announced to the peer yet */
+	uint64_t credits_owed;
+	uint64_t credits_update_threshold;
+	int credits_update_pending; /* until the peer reposts the buffer */
+	int ctrl_reposted; /* the peer has to learn about it */
+	struct ibv_send_wr credits_update;
+};
+
+/* connection private data */
+struct rpma_conn_pdata {
+	uint32_t credits; /* # of the posted receive buffers, network order */
+};
+
+/* the connection setup, driven by the CM events of the zone */
+#define RPMA_CONN_STATE_IDLE 0
+#define RPMA_CONN_STATE_ADDR_RESOLVING 1
+#define RPMA_CONN_STATE_ROUTE_RESOLVING 2
+#define RPMA_CONN_STATE_CONNECTING 3
+#define RPMA_CONN_STATE_ESTABLISHED 4
+#define RPMA_CONN_STATE_FAILED 5
+
 struct rpma_connection {
 	struct rpma_zone *zone;
 
+	int state; /* RPMA_CONN_STATE_* */
+	int setup_status; /* the reason of RPMA_CONN_STATE_FAILED */
+	int setup_sync; /* a synchronous accept or establish waits for it */
+
 	struct rdma_cm_id *id;
+	struct ibv_qp_ex *qpx; /* set only if the extended QP ops are used */
+	int native_flush; /* IBV_WR_FLUSH */
+	int native_atomic_write; /* IBV_WR_ATOMIC_WRITE */
 	struct ibv_cq *cq;
+	struct ibv_cq *cq_cached; /* created in advance, used if possible */
 	int disconnected;
 
 	struct rpma_dispatcher *disp;
+	struct rpma_dispatcher *cq_disp; /* owner of the shared CQ if used */
+	uint32_t max_inline_data; /* as granted by the device */
 
 	rpma_on_transmission_notify_func on_transmission_notify_func;
 	rpma_on_connection_recv_func on_connection_recv_func;
+	struct rpma_memory_local *notify_mem; /* written with immediate */
 
 	struct rpma_rma rma;
 
+	struct rpma_lane *lanes;
+	uint64_t nlanes;
+
+	/*
+	 * with the lanes all the consumers poll the CQ under the lock, the
+	 * shared CQ is polled only by its dispatcher
+	 */
+	os_mutex_t cq_lock;
+	struct ibv_wc *cq_stash; /* polled by the other threads */
+	uint64_t cq_stash_size;
+	uint64_t cq_stash_head;
+	uint64_t cq_stash_num;
+
 	struct rpma_msg send;
 	struct rpma_msg recv;
-	uint64_t send_buff_id;
+	struct rpma_recv_repost recv_repost;
+	struct rpma_send_flow send_flow;
 
 	void *custom_data;
 };
@@ -83,14 +225,51 @@ struct rpma_connection {
 int rpma_connection_rma_init(struct rpma_connection *conn);
 int rpma_connection_rma_fini(struct rpma_connection *conn);
 
+int rpma_connection_rma_is_op(struct rpma_connection *conn, uint64_t wr_id);
+void rpma_connection_rma_complete(struct rpma_connection *conn,
+				  struct ibv_wc *wc);
+void rpma_connection_rma_wrs_release(struct rpma_connection *conn,
+				     uint64_t wr_id);
+
+int rpma_connection_recv_notify(struct rpma_connection *conn,
+				struct ibv_wc *wc);
+
+int rpma_connection_is_lane(struct rpma_connection *conn, uint64_t wr_id);
+void rpma_connection_lane_complete(struct rpma_connection *conn,
+				   struct ibv_wc *wc);
+int rpma_connection_lane_cq_poll(struct rpma_connection *conn);
+void rpma_connection_cq_stash(struct rpma_connection *conn, struct ibv_wc *wc);
+
 int rpma_connection_msg_init(struct rpma_connection *conn);
 int rpma_connection_msg_fini(struct rpma_connection *conn);
 
-int rpma_connection_recv_post(struct rpma_connection *conn, void *ptr);
+int rpma_connection_recv_post_all(struct rpma_connection *conn);
+void rpma_connection_recv_consumed(struct rpma_connection *conn);
+int rpma_connection_recv_credits(struct rpma_connection *conn,
+				 struct ibv_wc *wc);
+
+int rpma_connection_credit_acquire(struct rpma_connection *conn);
+void rpma_connection_credit_release(struct rpma_connection *conn);
+
+int rpma_connection_is_send(struct rpma_connection *conn, uint64_t wr_id);
+void rpma_connection_send_complete(struct rpma_connection *conn,
+				   struct ibv_wc *wc);
+
+int rpma_connection_cache_refill(struct rpma_zone *zone);
+void rpma_connection_cache_fini(struct rpma_zone *zone);
+
+int rpma_connection_setup_event(struct rpma_connection *conn,
+				struct rdma_cm_event *edata);
+
+void rpma_connection_pdata_init(struct rpma_connection *conn,
+				struct rpma_conn_pdata *pdata);
+void rpma_connection_pdata_apply(struct rpma_connection *conn,
+				 const void *data, uint8_t len);
 
 int rpma_connection_cq_wait(struct rpma_connection *conn,
 			    enum ibv_wc_opcode opcode, uint64_t wr_id);
-int rpma_connection_cq_process(struct rpma_connection *conn);
+int rpma_connection_cq_process(struct rpma_connection *conn, uint64_t *nwcs);
+int rpma_connection_cq_drain(struct rpma_connection *conn);
 
 int rpma_connection_cq_entry_process(struct rpma_connection *conn,
 				     struct ibv_wc *wc);
@@ -0,0 +1,254 @@
+/*
+ * Copyright 2020, Intel Corporation
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in
+ *       the documentation and/or other materials provided with the
+ *       distribution.
+ *
+ *     * Neither the name of the copyright holder nor the names of its
+ *       contributors may be used to endorse or promote products derived
+ *       from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+/*
+ * connection_pool.c -- entry points for librpma connection pool
+ *
+ * All the connections of the pool lead to the same peer and they are set up
+ * concurrently. Attached to a dispatcher before they are established they
+ * share its CQ if the zone is configured with RPMA_CONFIG_SHARED_CQ, and they
+ * receive into the shared buffers with RPMA_CONFIG_SHARED_RQ.
+ */
+
+#include <base.h>
+
+#include "alloc.h"
+#include "connection.h"
+#include "rpma_utils.h"
+#include "util.h"
+#include "zone.h"
+
+struct rpma_connection_pool {
+	struct rpma_zone *zone;
+	struct rpma_dispatcher *disp; /* NULL if not attached */
+
+	unsigned nconns;
+	struct rpma_connection **conns;
+
+	uint64_t next; /* for striping the ops across the connections */
+};
+
+/*
+ * pool_conns_delete -- (internal) delete the first n connections of the pool
+ */
+static void
+pool_conns_delete(struct rpma_connection_pool *pool, unsigned n)
+{
+	for (unsigned i = 0; i < n; ++i) {
+		if (pool->disp)
+			(void)rpma_connection_detach(pool->conns[i]);
+		(void)rpma_connection_delete(&pool->conns[i]);
+	}
+}
+
+int
+rpma_connection_pool_new(struct rpma_zone *zone, struct rpma_dispatcher *disp,
+			 unsigned nconns, struct rpma_connection_pool **pool)
+{
+	unsigned i;
+	int ret;
+
+	if (nconns == 0)
+		return RPMA_E_NOSUPP;
+
+	struct rpma_connection_pool *ptr = Malloc(sizeof(*ptr));
+	if (!ptr)
+		return RPMA_E_ERRNO;
+
+	ptr->zone = zone;
+	ptr->disp = disp;
+	ptr->nconns = nconns;
+	ptr->next = 0;
+
+	ptr->conns = Malloc(nconns * sizeof(*ptr->conns));
+	if (!ptr->conns) {
+		ret = RPMA_E_ERRNO;
+		goto err_free_pool;
+	}
+
+	for (i = 0; i < nconns; ++i) {
+		ret = rpma_connection_new(zone, &ptr->conns[i]);
+		if (ret)
+			goto err_conns_delete;
+
+		/* before the CQ is created so it is the shared one if used */
+		if (disp) {
+			ret = rpma_connection_attach(ptr->conns[i], disp);
+			if (ret) {
+				(void)rpma_connection_delete(&ptr->conns[i]);
+				goto err_conns_delete;
+			}
+		}
+	}
+
+	*pool = ptr;
+
+	return 0;
+
+err_conns_delete:
+	pool_conns_delete(ptr, i);
+	Free(ptr->conns);
+err_free_pool:
+	Free(ptr);
+	return ret;
+}
+
+/*
+ * pool_setup_abort -- (internal) stop the setup of the connections which are
+ * not established yet and disconnect the ones which are
+ */
+static void
+pool_setup_abort(struct rpma_connection_pool *pool, unsigned nstarted)
+{
+	for (unsigned i = 0; i < nstarted; ++i) {
+		struct rpma_connection *conn = pool->conns[i];
+
+		if (conn->state == RPMA_CONN_STATE_ESTABLISHED) {
+			if (!conn->disconnected)
+				(void)rpma_connection_disconnect(conn);
+			continue;
+		}
+
+		/* the further events of the id are dropped */
+		conn->id->context = NULL;
+		conn->state = RPMA_CONN_STATE_FAILED;
+	}
+}
+
+/*
+ * rpma_connection_pool_establish -- start the setup of all the connections at
+ * once and wait until all of them are established
+ */
+int
+rpma_connection_pool_establish(struct rpma_connection_pool *pool)
+{
+	struct rpma_connection *conn;
+	unsigned nstarted;
+	int ret = 0;
+
+	for (nstarted = 0; nstarted < pool->nconns; ++nstarted) {
+		conn = pool->conns[nstarted];
+
+		ret = rpma_connection_establish_async(conn);
+		if (ret) {
+			/* the id is already gone */
+			conn->state = RPMA_CONN_STATE_FAILED;
+			goto err_setup_abort;
+		}
+
+		/* the result is collected below instead of being reported */
+		conn->setup_sync = 1;
+	}
+
+	/* the waits for the other connections drive all of them */
+	for (unsigned i = 0; i < nstarted; ++i) {
+		ret = rpma_zone_wait_connected(pool->zone, pool->conns[i]);
+		if (ret)
+			goto err_setup_abort;
+	}
+
+	for (unsigned i = 0; i < nstarted; ++i)
+		pool->conns[i]->setup_sync = 0;
+
+	return 0;
+
+err_setup_abort:
+	for (unsigned i = 0; i < nstarted; ++i)
+		pool->conns[i]->setup_sync = 0;
+
+	pool_setup_abort(pool, nstarted);
+	return ret;
+}
+
+int
+rpma_connection_pool_size(struct rpma_connection_pool *pool, unsigned *nconns)
+{
+	*nconns = pool->nconns;
+	return 0;
+}
+
+int
+rpma_connection_pool_get(struct rpma_connection_pool *pool, unsigned i,
+			 struct rpma_connection **conn)
+{
+	if (i >= pool->nconns)
+		return RPMA_E_UNKNOWN_CONNECTION;
+
+	*conn = pool->conns[i];
+	return 0;
+}
+
+/*
+ * rpma_connection_pool_hash -- the connection the key is mapped to, the ops
+ * of the same key keep their order
+ */
+int
+rpma_connection_pool_hash(struct rpma_connection_pool *pool, uint64_t key,
+			  struct rpma_connection **conn)
+{
+	/* Fibonacci hashing spreads the sequential keys */
+	uint64_t h = (key * 0x9E3779B97F4A7C15ULL) >> 32;
+
+	*conn = pool->conns[h % pool->nconns];
+	return 0;
+}
+
+/*
+ * rpma_connection_pool_next -- the connections in turns, safe to be called
+ * from many threads at once
+ */
+int
+rpma_connection_pool_next(struct rpma_connection_pool *pool,
+			  struct rpma_connection **conn)
+{
+	uint64_t n = util_fetch_and_add64(&pool->next, 1);
+
+	*conn = pool->conns[n % pool->nconns];
+	return 0;
+}
+
+int
+rpma_connection_pool_delete(struct rpma_connection_pool **pool)
+{
+	struct rpma_connection_pool *ptr = *pool;
+	if (!ptr)
+		return 0;
+
+	pool_conns_delete(ptr, ptr->nconns);
+
+	Free(ptr->conns);
+	Free(ptr);
+	*pool = NULL;
+
+	return 0;
+}
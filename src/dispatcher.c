@@ -34,54 +34,309 @@
  * dispatcher.c -- entry points for librpma dispatcher
  */
 
+#include <errno.h>
+#include <sched.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <time.h>
+#include <unistd.h>
+
 #include <base.h>
 
 #include "alloc.h"
+#include "config.h"
 #include "connection.h"
 #include "dispatcher.h"
+#include "os.h"
 #include "os_thread.h"
+#include "ravl.h"
 #include "rpma_utils.h"
 #include "sys/queue.h"
 #include "zone.h"
 
+/* the dispatcher whose connection is being processed by the thread */
+static __thread struct rpma_dispatcher *Processing;
+
+struct qp_conn_pair {
+	uint32_t qp_num;
+	struct rpma_connection *conn;
+};
+
+static int
+qp_conn_pair_compare(const void *lhs, const void *rhs)
+{
+	const struct qp_conn_pair *l = lhs;
+	const struct qp_conn_pair *r = rhs;
+
+	if (l->qp_num != r->qp_num)
+		return l->qp_num > r->qp_num ? 1 : -1;
+
+	return 0;
+}
+
+static int
+shared_cq_init(struct rpma_dispatcher *disp)
+{
+	struct rpma_zone *zone = disp->zone;
+
+	disp->cq_size = zone->cq_size;
+	disp->cq_reserved = 0;
+	disp->cq = ibv_create_cq(zone->device, disp->cq_size, (void *)disp,
+				 disp->channel, 0);
+	if (!disp->cq)
+		return RPMA_E_ERRNO;
+
+	disp->qp_map = ravl_new_sized(qp_conn_pair_compare,
+				      sizeof(struct qp_conn_pair));
+	if (!disp->qp_map) {
+		int ret = RPMA_E_ERRNO;
+		(void)ibv_destroy_cq(disp->cq);
+		disp->cq = NULL;
+		return ret;
+	}
+
+	os_rwlock_init(&disp->qp_map_lock);
+	os_mutex_init(&disp->cq_lock);
+
+	return 0;
+}
+
+static void
+shared_cq_fini(struct rpma_dispatcher *disp)
+{
+	os_mutex_destroy(&disp->cq_lock);
+	os_rwlock_destroy(&disp->qp_map_lock);
+
+	ASSERT(ravl_empty(disp->qp_map));
+	ravl_delete(disp->qp_map);
+
+	int ret = ibv_destroy_cq(disp->cq);
+	if (ret)
+		ERR_STR(ret, "ibv_destroy_cq");
+	disp->cq = NULL;
+}
+
+static int
+pools_init(struct rpma_dispatcher *disp)
+{
+	uint64_t slab_size = RPMA_DISPATCHER_POOL_SLAB_SIZE;
+
+	int ret = rpma_pool_init(&disp->conn_pool,
+				 sizeof(struct rpma_dispatcher_conn),
+				 slab_size);
+	if (ret)
+		return ret;
+
+	ret = rpma_pool_init(&disp->wce_pool,
+			     sizeof(struct rpma_dispatcher_wc_entry),
+			     slab_size);
+	if (ret)
+		goto err_wce_pool;
+
+	ret = rpma_pool_init(&disp->func_pool,
+			     sizeof(struct rpma_dispatcher_func_entry),
+			     slab_size);
+	if (ret)
+		goto err_func_pool;
+
+	return 0;
+
+err_func_pool:
+	rpma_pool_fini(&disp->wce_pool);
+err_wce_pool:
+	rpma_pool_fini(&disp->conn_pool);
+	return ret;
+}
+
+static void
+pools_fini(struct rpma_dispatcher *disp)
+{
+	rpma_pool_fini(&disp->func_pool);
+	rpma_pool_fini(&disp->wce_pool);
+	rpma_pool_fini(&disp->conn_pool);
+}
+
+/*
+ * pools_refill -- (internal) grow the pools in advance so the entries do not
+ * have to be allocated when they are enqueued
+ */
+static int
+pools_refill(struct rpma_dispatcher *disp)
+{
+	int ret = rpma_pool_refill(&disp->wce_pool);
+	if (ret)
+		return ret;
+
+	return rpma_pool_refill(&disp->func_pool);
+}
+
+/* the sources of the events waking the dispatcher up */
+#define EVENT_CQ 0
+#define EVENT_WAKE 1
+#define EVENT_CM 2
+
+/*
+ * epoll_add -- (internal) add the fd to the epoll set of the dispatcher
+ */
+static int
+epoll_add(struct rpma_dispatcher *disp, int fd, uint32_t events, uint32_t src)
+{
+	struct epoll_event event;
+	event.events = events;
+	event.data.u32 = src;
+
+	if (epoll_ctl(disp->epoll, EPOLL_CTL_ADD, fd, &event)) {
+		int ret = RPMA_E_ERRNO;
+		ERR_STR(ret, "epoll_ctl(EPOLL_CTL_ADD)");
+		return ret;
+	}
+
+	return 0;
+}
+
+/*
+ * events_init -- (internal) prepare the completion channel, the eventfd and
+ * the epoll set the dispatcher sleeps on (RPMA_DISPATCH_HYBRID)
+ */
+static int
+events_init(struct rpma_dispatcher *disp)
+{
+	struct rpma_zone *zone = disp->zone;
+	int ret;
+
+	disp->channel = ibv_create_comp_channel(zone->device);
+	if (!disp->channel)
+		return RPMA_E_ERRNO;
+
+	ret = rpma_utils_fd_set_nonblock(disp->channel->fd);
+	if (ret)
+		goto err_destroy_channel;
+
+	disp->efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (disp->efd < 0) {
+		ret = RPMA_E_ERRNO;
+		goto err_destroy_channel;
+	}
+
+	disp->epoll = epoll_create1(EPOLL_CLOEXEC);
+	if (disp->epoll < 0) {
+		ret = RPMA_E_ERRNO;
+		ERR_STR(ret, "epoll_create1");
+		goto err_close_efd;
+	}
+
+	ret = epoll_add(disp, disp->channel->fd, EPOLLIN, EVENT_CQ);
+	if (ret)
+		goto err_close_epoll;
+
+	ret = epoll_add(disp, disp->efd, EPOLLIN, EVENT_WAKE);
+	if (ret)
+		goto err_close_epoll;
+
+	/*
+	 * the connection events are read by the zone, the dispatcher only
+	 * takes a look at the connections when a new event shows up
+	 */
+	ret = epoll_add(disp, zone->ec->fd, EPOLLIN | EPOLLET, EVENT_CM);
+	if (ret)
+		goto err_close_epoll;
+
+	return 0;
+
+err_close_epoll:
+	(void)close(disp->epoll);
+	disp->epoll = RPMA_FD_INVALID;
+err_close_efd:
+	(void)close(disp->efd);
+	disp->efd = RPMA_FD_INVALID;
+err_destroy_channel:
+	(void)ibv_destroy_comp_channel(disp->channel);
+	disp->channel = NULL;
+	return ret;
+}
+
+static void
+events_fini(struct rpma_dispatcher *disp)
+{
+	(void)close(disp->epoll);
+	disp->epoll = RPMA_FD_INVALID;
+	(void)close(disp->efd);
+	disp->efd = RPMA_FD_INVALID;
+
+	int ret = ibv_destroy_comp_channel(disp->channel);
+	if (ret)
+		ERR_STR(ret, "ibv_destroy_comp_channel");
+	disp->channel = NULL;
+}
+
 static int
 dispatcher_init(struct rpma_dispatcher *disp)
 {
 	PMDK_TAILQ_INIT(&disp->conn_set);
 	PMDK_TAILQ_INIT(&disp->queue_wce);
-	PMDK_TAILQ_INIT(&disp->queue_func);
 
-	os_mutex_init(&disp->queue_func_mtx);
+	int ret = pools_init(disp);
+	if (ret)
+		return ret;
+
+	os_rwlock_init(&disp->conn_set_lock);
+	disp->conn_set_gen = 0;
+	disp->conn_busy = NULL;
+
+	ret = rpma_func_queue_init(&disp->queue_func);
+	if (ret)
+		goto err_func_queue_init;
+
+	ret = rpma_func_queue_init(&disp->queue_steal);
+	if (ret)
+		goto err_steal_queue_init;
+
+	/* the shared CQ is bound to the completion channel if any */
+	if (disp->zone->dispatch_mode != RPMA_DISPATCH_POLL) {
+		ret = events_init(disp);
+		if (ret)
+			goto err_events_init;
+	}
+
+	disp->cq = NULL;
+	if (disp->zone->flags & RPMA_CONFIG_SHARED_CQ) {
+		ret = shared_cq_init(disp);
+		if (ret)
+			goto err_shared_cq_init;
+	}
 
 	return 0;
+
+err_shared_cq_init:
+	if (disp->channel)
+		events_fini(disp);
+err_events_init:
+	rpma_func_queue_fini(&disp->queue_steal);
+err_steal_queue_init:
+	rpma_func_queue_fini(&disp->queue_func);
+err_func_queue_init:
+	os_rwlock_destroy(&disp->conn_set_lock);
+	pools_fini(disp);
+	return ret;
 }
 
 static void
 dispatcher_fini(struct rpma_dispatcher *disp)
 {
-	os_mutex_destroy(&disp->queue_func_mtx);
+	rpma_func_queue_fini(&disp->queue_steal);
+	rpma_func_queue_fini(&disp->queue_func);
 
-	/* XXX is it ok? */
-	while (!PMDK_TAILQ_EMPTY(&disp->queue_wce)) {
-		struct rpma_dispatcher_wc_entry *e =
-			PMDK_TAILQ_FIRST(&disp->queue_wce);
-		PMDK_TAILQ_REMOVE(&disp->queue_wce, e, next);
-		Free(e);
-	}
+	if (disp->cq)
+		shared_cq_fini(disp);
 
-	while (!PMDK_TAILQ_EMPTY(&disp->queue_func)) {
-		struct rpma_dispatcher_func_entry *e =
-			PMDK_TAILQ_FIRST(&disp->queue_func);
-		PMDK_TAILQ_REMOVE(&disp->queue_func, e, next);
-		Free(e);
-	}
+	/* all the CQs bound to the channel have to be destroyed by now */
+	if (disp->channel)
+		events_fini(disp);
 
-	while (!PMDK_TAILQ_EMPTY(&disp->conn_set)) {
-		struct rpma_dispatcher_conn *e =
-			PMDK_TAILQ_FIRST(&disp->conn_set);
-		PMDK_TAILQ_REMOVE(&disp->conn_set, e, next);
-		Free(e);
-	}
+	os_rwlock_destroy(&disp->conn_set_lock);
+
+	/* XXX is it ok? - the queued entries are released along the pools */
+	pools_fini(disp);
 }
 
 int
@@ -93,6 +348,17 @@ rpma_dispatcher_new(struct rpma_zone *zone, struct rpma_dispatcher **disp)
 
 	ptr->zone = zone;
 	ptr->waiting = 0;
+	ptr->nconns = 0;
+	ptr->pool = NULL;
+	ptr->channel = NULL;
+	ptr->efd = RPMA_FD_INVALID;
+	ptr->epoll = RPMA_FD_INVALID;
+	ptr->sleeping = 0;
+	ptr->nunarmable = 0;
+
+	memset(&ptr->adaptive, 0, sizeof(ptr->adaptive));
+	ptr->adaptive.mode = RPMA_DISPATCHER_MODE_POLL;
+	ptr->adaptive.npause = 1;
 
 	int ret = dispatcher_init(ptr);
 	if (ret)
@@ -122,17 +388,49 @@ rpma_dispatcher_delete(struct rpma_dispatcher **ptr)
 	return 0;
 }
 
+/*
+ * uses_shared_cq -- (internal) check if the connection CQ is (or will be when
+ * its QP is created) the dispatcher's one
+ */
+static inline int
+uses_shared_cq(struct rpma_dispatcher *disp, struct rpma_connection *conn)
+{
+	return disp->cq && (conn->cq == NULL || conn->cq == disp->cq);
+}
+
 int
 rpma_dispatcher_attach_connection(struct rpma_dispatcher *disp,
 				  struct rpma_connection *conn)
 {
-	struct rpma_dispatcher_conn *entry = Malloc(sizeof(*entry));
-	if (!entry)
-		return RPMA_E_ERRNO;
+	/* the shared CQ is polled regardless of the attached connections */
+	if (uses_shared_cq(disp, conn)) {
+		util_fetch_and_add64(&disp->nconns, 1);
+		return 0;
+	}
+
+	/* the dispatcher thread may be walking the set right now */
+	os_rwlock_wrlock(&disp->conn_set_lock);
+
+	struct rpma_dispatcher_conn *entry = rpma_pool_get(&disp->conn_pool);
+	if (!entry) {
+		int ret = RPMA_E_ERRNO;
+		os_rwlock_unlock(&disp->conn_set_lock);
+		return ret;
+	}
 
 	entry->conn = conn;
 
+	/* a CQ created before the connection was attached never notifies */
+	entry->unarmable = disp->channel && conn->cq &&
+			   conn->cq->channel != disp->channel;
+	if (entry->unarmable)
+		util_fetch_and_add64(&disp->nunarmable, 1);
+
 	PMDK_TAILQ_INSERT_TAIL(&disp->conn_set, entry, next);
+	++disp->conn_set_gen;
+	util_fetch_and_add64(&disp->nconns, 1);
+
+	os_rwlock_unlock(&disp->conn_set_lock);
 
 	return 0;
 }
@@ -141,74 +439,727 @@ int
 rpma_dispatcher_detach_connection(struct rpma_dispatcher *disp,
 				  struct rpma_connection *conn)
 {
+	if (uses_shared_cq(disp, conn)) {
+		util_fetch_and_sub64(&disp->nconns, 1);
+		return 0;
+	}
+
+	os_rwlock_wrlock(&disp->conn_set_lock);
+
 	struct rpma_dispatcher_conn *e = PMDK_TAILQ_FIRST(&disp->conn_set);
 
 	while (e != NULL) {
-		if (e->conn == conn) {
-			PMDK_TAILQ_REMOVE(&disp->conn_set, e, next);
-			Free(e);
-			return 0;
-		}
+		if (e->conn == conn)
+			break;
 
 		e = PMDK_TAILQ_NEXT(e, next);
 	}
 
-	ASSERT(0);
+	if (e == NULL) {
+		os_rwlock_unlock(&disp->conn_set_lock);
+		ASSERT(0);
+		return RPMA_E_UNKNOWN_CONNECTION;
+	}
+
+	if (e->unarmable)
+		util_fetch_and_sub64(&disp->nunarmable, 1);
+	PMDK_TAILQ_REMOVE(&disp->conn_set, e, next);
+	rpma_pool_put(&disp->conn_pool, e);
+	++disp->conn_set_gen;
+	util_fetch_and_sub64(&disp->nconns, 1);
+
+	/*
+	 * the dispatcher picks the connections under the lock, the one it
+	 * processes right now is left alone unless the detach comes from its
+	 * own callback
+	 */
+	int busy = (disp->conn_busy == conn && Processing != disp);
+
+	os_rwlock_unlock(&disp->conn_set_lock);
+
+	struct rpma_connection *conn_busy;
+	while (busy) {
+		util_atomic_load_explicit64(&disp->conn_busy, &conn_busy,
+					    memory_order_acquire);
+		busy = (conn_busy == conn);
+		if (busy)
+			sched_yield();
+	}
+
+	return 0;
+}
+
+/*
+ * rpma_dispatcher_cq_reserve -- make room in the shared CQ for a connection,
+ * the connections are set up by any thread while the dispatcher polls the CQ
+ */
+int
+rpma_dispatcher_cq_reserve(struct rpma_dispatcher *disp, int cqe)
+{
+	int max_cqe = disp->zone->dev_attr.max_cqe;
+	int ret = 0;
+
+	os_mutex_lock(&disp->cq_lock);
+
+	int reserved = disp->cq_reserved + cqe;
+	if (reserved > max_cqe) {
+		ERR("shared CQ cannot hold more than %d entries", max_cqe);
+		ret = RPMA_E_NOSUPP;
+		goto unlock;
+	}
+
+	if (reserved > disp->cq_size) {
+		int size = disp->cq_size;
+		while (size < reserved)
+			size *= 2;
+		if (size > max_cqe)
+			size = max_cqe;
+
+		ret = ibv_resize_cq(disp->cq, size);
+		if (ret) {
+			ERR_STR(ret, "ibv_resize_cq");
+			ret = -ret;
+			goto unlock;
+		}
+
+		disp->cq_size = size;
+	}
+
+	disp->cq_reserved = reserved;
+
+unlock:
+	os_mutex_unlock(&disp->cq_lock);
+	return ret;
+}
+
+void
+rpma_dispatcher_cq_release(struct rpma_dispatcher *disp, int cqe)
+{
+	os_mutex_lock(&disp->cq_lock);
+	ASSERT(disp->cq_reserved >= cqe);
+	disp->cq_reserved -= cqe;
+	os_mutex_unlock(&disp->cq_lock);
+}
+
+int
+rpma_dispatcher_qp_register(struct rpma_dispatcher *disp,
+			    struct rpma_connection *conn)
+{
+	struct qp_conn_pair pair;
+	pair.qp_num = conn->id->qp->qp_num;
+	pair.conn = conn;
+
+	os_rwlock_wrlock(&disp->qp_map_lock);
+	int ret = ravl_emplace_copy(disp->qp_map, &pair);
+	os_rwlock_unlock(&disp->qp_map_lock);
+
+	if (ret)
+		return RPMA_E_ERRNO;
+
+	return 0;
+}
+
+void
+rpma_dispatcher_qp_unregister(struct rpma_dispatcher *disp,
+			      struct rpma_connection *conn)
+{
+	struct qp_conn_pair to_find;
+	to_find.qp_num = conn->id->qp->qp_num;
+	to_find.conn = NULL;
+
+	os_rwlock_wrlock(&disp->qp_map_lock);
+	struct ravl_node *node =
+		ravl_find(disp->qp_map, &to_find, RAVL_PREDICATE_EQUAL);
+	if (node)
+		ravl_remove(disp->qp_map, node);
+	os_rwlock_unlock(&disp->qp_map_lock);
+}
+
+struct rpma_connection *
+rpma_dispatcher_qp_lookup(struct rpma_dispatcher *disp, uint32_t qp_num)
+{
+	struct qp_conn_pair to_find;
+	to_find.qp_num = qp_num;
+	to_find.conn = NULL;
+
+	struct rpma_connection *conn = NULL;
 
-	return RPMA_E_UNKNOWN_CONNECTION;
+	os_rwlock_rdlock(&disp->qp_map_lock);
+	struct ravl_node *node =
+		ravl_find(disp->qp_map, &to_find, RAVL_PREDICATE_EQUAL);
+	if (node)
+		conn = ((struct qp_conn_pair *)ravl_data(node))->conn;
+	os_rwlock_unlock(&disp->qp_map_lock);
+
+	return conn;
 }
 
+/*
+ * dispatcher_shared_cq_process -- (internal) poll the shared CQ and route
+ * the completions to the connections by qp_num, the dispatcher is the only
+ * one polling the shared CQ so the completions of the RMA ops and the sends
+ * are stashed for the threads using the connections
+ */
 static int
-dispatcher_cqs_process(struct rpma_dispatcher *disp)
+dispatcher_shared_cq_process(struct rpma_dispatcher *disp, uint64_t *nwcs)
 {
-	struct rpma_dispatcher_conn *e = PMDK_TAILQ_FIRST(&disp->conn_set);
+	struct ibv_wc wcs[RPMA_MAX_CQ_BATCH_SIZE];
+	struct rpma_connection *conn;
+	int batch = disp->zone->cq_batch_size;
+	int ret;
+	int num;
+
+	do {
+		/* the callbacks may set up the connections reserving the CQ */
+		os_mutex_lock(&disp->cq_lock);
+		num = ibv_poll_cq(disp->cq, batch, wcs);
+		os_mutex_unlock(&disp->cq_lock);
+		if (num < 0) {
+			ERR_STR(num, "ibv_poll_cq");
+			return num;
+		}
+
+		for (int i = 0; i < num; ++i) {
+			conn = rpma_dispatcher_qp_lookup(disp, wcs[i].qp_num);
+			if (!conn) {
+				/* the QP is already gone */
+				LOG(3, "completion of unknown QP %u dropped",
+				    wcs[i].qp_num);
+				continue;
+			}
+
+			if (rpma_connection_rma_is_op(conn, wcs[i].wr_id) ||
+			    rpma_connection_is_send(conn, wcs[i].wr_id)) {
+				rpma_connection_cq_stash(conn, &wcs[i]);
+				continue;
+			}
+
+			ret = rpma_connection_cq_entry_process(conn, &wcs[i]);
+			if (ret)
+				return ret;
+		}
+
+		*nwcs += (uint64_t)num;
+	} while (num == batch);
+
+	return 0;
+}
+
+static int
+dispatcher_cqs_process(struct rpma_dispatcher *disp, uint64_t *nwcs)
+{
+	struct rpma_dispatcher_conn *e;
 	int ret = 0;
 
-	while (e != NULL) {
-		ret = rpma_connection_cq_process(e->conn);
+	if (disp->cq) {
+		ret = dispatcher_shared_cq_process(disp, nwcs);
 		if (ret)
 			return ret;
+	}
+
+	/*
+	 * the connections are attached and detached by the other threads and
+	 * by the callbacks, the lock is not held while the callbacks run
+	 */
+	os_rwlock_rdlock(&disp->conn_set_lock);
+
+	uint64_t gen = disp->conn_set_gen;
+	e = PMDK_TAILQ_FIRST(&disp->conn_set);
+
+	while (e != NULL) {
+		struct rpma_connection *conn = e->conn;
+
+		/* the CQ is created when the connection is established */
+		if (!conn->cq) {
+			e = PMDK_TAILQ_NEXT(e, next);
+			continue;
+		}
+
+		util_atomic_store_explicit64(&disp->conn_busy, conn,
+					     memory_order_release);
+		os_rwlock_unlock(&disp->conn_set_lock);
+
+		Processing = disp;
+		ret = rpma_connection_cq_process(conn, nwcs);
+		Processing = NULL;
+
+		os_rwlock_rdlock(&disp->conn_set_lock);
+		util_atomic_store_explicit64(&disp->conn_busy, NULL,
+					     memory_order_release);
+
+		/* the entry may be gone, the rest waits for the next pass */
+		if (ret || gen != disp->conn_set_gen)
+			break;
 
 		e = PMDK_TAILQ_NEXT(e, next);
 	}
 
+	os_rwlock_unlock(&disp->conn_set_lock);
+
 	return ret;
 }
 
+#define STEAL_BATCH 16 /* max # of funcs stolen at once */
+
+/*
+ * rpma_dispatcher_steal -- call the stealable funcs of the victim, the victim
+ * may be the dispatcher itself
+ */
 int
-rpma_dispatch(struct rpma_dispatcher *disp)
+rpma_dispatcher_steal(struct rpma_dispatcher *disp,
+		      struct rpma_dispatcher *victim, uint64_t *nfuncs)
+{
+	struct rpma_dispatcher_func_slot f;
+	int ret;
+
+	/* the own funcs are not left for the others if possible */
+	uint64_t batch = (disp == victim) ? UINT64_MAX : STEAL_BATCH;
+
+	for (uint64_t i = 0; i < batch; ++i) {
+		if (rpma_func_queue_pop_shared(&victim->queue_steal, &f))
+			break;
+
+		/*
+		 * the func belongs to a connection the thief may know nothing
+		 * about so its failure does not stop the dispatcher
+		 */
+		ret = f.func(f.conn, f.arg);
+		if (ret)
+			ERR("stealable func failed: %d", ret);
+		++*nfuncs;
+	}
+
+	return 0;
+}
+
+/*
+ * dispatcher_process -- (internal) a single pass over everything the
+ * dispatcher takes care of, nwork counts what was found to do
+ */
+static int
+dispatcher_process(struct rpma_dispatcher *disp, uint64_t *nwork)
 {
 	struct rpma_dispatcher_wc_entry *wce;
-	struct rpma_dispatcher_func_entry *funce;
+	int ret;
+
+	ret = dispatcher_cqs_process(disp, nwork);
+	if (ret)
+		return ret;
+
+	/* process cached CQ entries */
+	while (!PMDK_TAILQ_EMPTY(&disp->queue_wce)) {
+		wce = PMDK_TAILQ_FIRST(&disp->queue_wce);
+		PMDK_TAILQ_REMOVE(&disp->queue_wce, wce, next);
+
+		ret = rpma_connection_cq_entry_process(wce->conn, &wce->wc);
+		ASSERTeq(ret, 0); /* XXX */
+		rpma_pool_put(&disp->wce_pool, wce);
+		++*nwork;
+	}
+
+	uint64_t nfuncs = 0;
+	ret = rpma_func_queue_process(&disp->queue_func, &disp->func_pool,
+				      &nfuncs);
+	if (ret)
+		return ret;
+
+	ret = rpma_dispatcher_steal(disp, disp, &nfuncs);
+	if (ret)
+		return ret;
+
+	/* nothing to do - help the other dispatchers of the pool */
+	if (nfuncs == 0 && disp->pool) {
+		ret = rpma_dispatcher_pool_steal(disp->pool, disp);
+		if (ret)
+			return ret;
+	}
+
+	*nwork += nfuncs;
+
+	return 0;
+}
+
+/*
+ * dispatcher_cqs_arm -- (internal) request a completion event from all the
+ * CQs of the dispatcher
+ */
+static int
+dispatcher_cqs_arm(struct rpma_dispatcher *disp)
+{
+	struct rpma_dispatcher_conn *e;
+	int ret;
+
+	if (disp->cq) {
+		ret = ibv_req_notify_cq(disp->cq, 0);
+		if (ret) {
+			ERR_STR(ret, "ibv_req_notify_cq");
+			return -ret;
+		}
+	}
+
+	ret = 0;
+
+	os_rwlock_rdlock(&disp->conn_set_lock);
+
+	PMDK_TAILQ_FOREACH(e, &disp->conn_set, next) {
+		/* the CQ is created when the connection is established */
+		if (!e->conn->cq)
+			continue;
+
+		ret = ibv_req_notify_cq(e->conn->cq, 0);
+		if (ret) {
+			ERR_STR(ret, "ibv_req_notify_cq");
+			ret = -ret;
+			break;
+		}
+	}
+
+	os_rwlock_unlock(&disp->conn_set_lock);
+
+	return ret;
+}
+
+/*
+ * dispatcher_cq_events_ack -- (internal) consume the completion events, the
+ * CQs are polled and armed again before the dispatcher sleeps next time
+ */
+static int
+dispatcher_cq_events_ack(struct rpma_dispatcher *disp)
+{
+	struct ibv_cq *cq;
+	void *cq_context;
+
+	while (ibv_get_cq_event(disp->channel, &cq, &cq_context) == 0)
+		ibv_ack_cq_events(cq, 1);
+
+	if (errno != EAGAIN) {
+		int ret = RPMA_E_ERRNO;
+		ERR_STR(ret, "ibv_get_cq_event");
+		return ret;
+	}
+
+	return 0;
+}
+
+#define MAX_EVENTS 3
+
+/*
+ * dispatcher_sleep -- (internal) block until there is something to do
+ */
+static int
+dispatcher_sleep(struct rpma_dispatcher *disp)
+{
+	struct epoll_event events[MAX_EVENTS];
+	uint64_t nwork = 0;
+	uint64_t cnt;
+	int ret;
+
+	ret = dispatcher_cqs_arm(disp);
+	if (ret)
+		return ret;
+
+	/* from now on the enqueued work wakes the dispatcher up */
+	util_atomic_store_explicit64(&disp->sleeping, 1, memory_order_seq_cst);
+	util_synchronize(); /* pairs with the one in dispatcher_wake() */
+
+	/* the work which has come before the CQs were armed */
+	ret = dispatcher_process(disp, &nwork);
+	if (ret || nwork || !rpma_utils_is_waiting(&disp->waiting))
+		goto out;
+
+	int num = epoll_wait(disp->epoll, events, MAX_EVENTS, -1);
+	if (num < 0) {
+		ret = RPMA_E_ERRNO;
+		if (ret == -EINTR)
+			ret = 0;
+		goto out;
+	}
+
+	for (int i = 0; i < num && ret == 0; ++i) {
+		switch (events[i].data.u32) {
+		case EVENT_CQ:
+			ret = dispatcher_cq_events_ack(disp);
+			break;
+		case EVENT_WAKE:
+			if (read(disp->efd, &cnt, sizeof(cnt)) < 0 &&
+			    errno != EAGAIN)
+				ret = RPMA_E_ERRNO;
+			break;
+		default:
+			/* a connection event - a look at the CQs is enough */
+			break;
+		}
+	}
+
+out:
+	util_atomic_store_explicit64(&disp->sleeping, 0, memory_order_release);
+	return ret;
+}
+
+/*
+ * dispatcher_wake -- (internal) wake the dispatcher up if it sleeps
+ */
+static void
+dispatcher_wake(struct rpma_dispatcher *disp)
+{
+	uint64_t sleeping;
+	uint64_t one = 1;
+
+	if (!disp->channel)
+		return;
+
+	/*
+	 * the work has been published by a release store which may be
+	 * reordered after the load below, the dispatcher could miss it and
+	 * this thread could miss the dispatcher going to sleep
+	 */
+	util_synchronize();
+
+	util_atomic_load_explicit64(&disp->sleeping, &sleeping,
+				    memory_order_seq_cst);
+	if (!sleeping)
+		return;
+
+	if (write(disp->efd, &one, sizeof(one)) < 0)
+		ERR_STR(RPMA_E_ERRNO, "write(eventfd)");
+}
+
+/*
+ * time_usec -- (internal) monotonic time in microseconds
+ */
+static uint64_t
+time_usec(void)
+{
+	struct timespec ts;
+	os_clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000 + (uint64_t)ts.tv_nsec / 1000;
+}
+
+/*
+ * dispatcher_can_sleep -- (internal) check if all the CQs of the dispatcher
+ * are able to wake it up
+ */
+static int
+dispatcher_can_sleep(struct rpma_dispatcher *disp)
+{
+	uint64_t nunarmable;
+
+	if (!disp->channel)
+		return 0;
+
+	/* a CQ out of the channel has to be polled all the time */
+	util_atomic_load_explicit64(&disp->nunarmable, &nunarmable,
+				    memory_order_acquire);
+	return nunarmable == 0;
+}
+
+/* the sliding window the arrival rate is measured over */
+#define ADAPTIVE_SLOT_USEC 1000
+#define ADAPTIVE_WINDOW_USEC \
+	(ADAPTIVE_SLOT_USEC * RPMA_DISPATCHER_RATE_SLOTS)
+
+/* arrivals are dense when they are closer than a yield takes (~10 usec) */
+#define ADAPTIVE_DENSE_RATE 100000
+
+/* the pause steps grow up to this length, the yields come next */
+#define ADAPTIVE_PAUSE_MAX 1024
+
+/*
+ * cpu_pause -- (internal) let the sibling hyperthread run for a while
+ */
+static inline void
+cpu_pause(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+	__builtin_ia32_pause();
+#elif defined(__aarch64__)
+	__asm__ volatile("yield");
+#else
+	__asm__ volatile("" ::: "memory");
+#endif
+}
+
+/*
+ * adaptive_account -- (internal) move the window forward and count the new
+ * arrivals in
+ */
+static void
+adaptive_account(struct rpma_dispatcher_adaptive *a, uint64_t now,
+		 uint64_t nwork)
+{
+	uint64_t elapsed = now - a->slot_start;
+
+	if (elapsed >= ADAPTIVE_SLOT_USEC) {
+		uint64_t nslots = elapsed / ADAPTIVE_SLOT_USEC;
+		a->slot_start += nslots * ADAPTIVE_SLOT_USEC;
+
+		if (nslots > RPMA_DISPATCHER_RATE_SLOTS)
+			nslots = RPMA_DISPATCHER_RATE_SLOTS;
+
+		/* the slots passed since the last pass are empty */
+		for (uint64_t i = 0; i < nslots; ++i) {
+			a->slot = (a->slot + 1) % RPMA_DISPATCHER_RATE_SLOTS;
+			a->window_sum -= a->slots[a->slot];
+			a->slots[a->slot] = 0;
+		}
+	} else if (nwork == 0) {
+		return;
+	}
+
+	a->slots[a->slot] += nwork;
+	a->window_sum += nwork;
+
+	uint64_t rate = a->window_sum * 1000000 / ADAPTIVE_WINDOW_USEC;
+	util_atomic_store_explicit64(&a->rate, rate, memory_order_relaxed);
+}
+
+/*
+ * adaptive_spin_budget -- (internal) how long to keep polling when idle, about
+ * twice the expected time to the next arrival but no longer than the budget
+ */
+static uint64_t
+adaptive_spin_budget(struct rpma_dispatcher_adaptive *a, uint64_t poll_budget)
+{
+	if (a->rate == 0)
+		return 0;
+
+	uint64_t spin = 2 * 1000000 / a->rate;
+	return spin < poll_budget ? spin : poll_budget;
+}
+
+static inline void
+adaptive_mode_set(struct rpma_dispatcher_adaptive *a, uint64_t mode)
+{
+	if (a->mode != mode)
+		util_atomic_store_explicit64(&a->mode, mode,
+					     memory_order_relaxed);
+}
+
+/*
+ * adaptive_cost_add -- (internal) the work found after a backoff step might
+ * have waited for the whole step
+ */
+static void
+adaptive_cost_add(struct rpma_dispatcher_adaptive *a, uint64_t cost)
+{
+	if (cost > a->cost_max)
+		util_atomic_store_explicit64(&a->cost_max, cost,
+					     memory_order_relaxed);
+
+	util_atomic_store_explicit64(&a->cost_sum, a->cost_sum + cost,
+				     memory_order_relaxed);
+	util_atomic_store_explicit64(&a->ncosts, a->ncosts + 1,
+				     memory_order_relaxed);
+}
+
+/*
+ * dispatcher_adapt -- (internal) decide what to do after a dispatcher pass
+ * (RPMA_DISPATCH_ADAPTIVE)
+ */
+static int
+dispatcher_adapt(struct rpma_dispatcher *disp, uint64_t nwork)
+{
+	struct rpma_dispatcher_adaptive *a = &disp->adaptive;
+	uint64_t poll_budget = disp->zone->poll_budget;
+	uint64_t now = time_usec();
+	int ret;
+
+	adaptive_account(a, now, nwork);
+
+	if (nwork) {
+		if (a->mode != RPMA_DISPATCHER_MODE_POLL) {
+			adaptive_cost_add(a, now - a->step_start);
+			adaptive_mode_set(a, RPMA_DISPATCHER_MODE_POLL);
+		}
+
+		a->idle_start = 0;
+		a->npause = 1;
+		return 0;
+	}
+
+	if (a->idle_start == 0)
+		a->idle_start = now;
+	uint64_t idle = now - a->idle_start;
+
+	/* keep polling as long as the next arrival is expected soon */
+	if (a->rate >= ADAPTIVE_DENSE_RATE ||
+	    idle < adaptive_spin_budget(a, poll_budget))
+		return 0;
+
+	a->step_start = now;
+
+	if (idle >= poll_budget && dispatcher_can_sleep(disp)) {
+		adaptive_mode_set(a, RPMA_DISPATCHER_MODE_SLEEP);
+		ret = dispatcher_sleep(disp);
+
+		/* the dispatcher is woken up as soon as the work arrives */
+		a->step_start = time_usec();
+		return ret;
+	}
+
+	if (a->npause <= ADAPTIVE_PAUSE_MAX) {
+		adaptive_mode_set(a, RPMA_DISPATCHER_MODE_PAUSE);
+		for (uint64_t i = 0; i < a->npause; ++i)
+			cpu_pause();
+		a->npause *= 2;
+	} else {
+		adaptive_mode_set(a, RPMA_DISPATCHER_MODE_YIELD);
+		sched_yield();
+	}
+
+	return 0;
+}
+
+int
+rpma_dispatch(struct rpma_dispatcher *disp)
+{
+	uint64_t poll_budget = disp->zone->poll_budget;
+	uint64_t idle_start = 0;
 	int ret;
 
 	uint64_t *waiting = &disp->waiting;
 	rpma_utils_wait_start(waiting);
 
 	while (rpma_utils_is_waiting(waiting)) {
-		ret = dispatcher_cqs_process(disp);
+		uint64_t nwork = 0;
+		ret = dispatcher_process(disp, &nwork);
 		if (ret)
 			return ret;
 
-		/* process cached CQ entries */
-		while (!PMDK_TAILQ_EMPTY(&disp->queue_wce)) {
-			wce = PMDK_TAILQ_FIRST(&disp->queue_wce);
-			PMDK_TAILQ_REMOVE(&disp->queue_wce, wce, next);
+		ret = pools_refill(disp);
+		if (ret)
+			return ret;
 
-			ret = rpma_connection_cq_entry_process(wce->conn,
-							       NULL /* wc */);
-			ASSERTeq(ret, 0); /* XXX */
-			Free(wce);
+		if (disp->zone->dispatch_mode == RPMA_DISPATCH_ADAPTIVE) {
+			ret = dispatcher_adapt(disp, nwork);
+			if (ret)
+				return ret;
+			continue;
 		}
 
-		while (!PMDK_TAILQ_EMPTY(&disp->queue_func)) {
-			funce = PMDK_TAILQ_FIRST(&disp->queue_func);
-			PMDK_TAILQ_REMOVE(&disp->queue_func, funce, next);
+		if (!disp->channel)
+			continue;
 
-			ret = funce->func(funce->conn, funce->arg);
-			ASSERTeq(ret, 0); /* XXX */
-			Free(funce);
+		/* keep polling as long as there is something to do */
+		if (nwork) {
+			idle_start = 0;
+			continue;
 		}
+
+		uint64_t now = time_usec();
+		if (idle_start == 0)
+			idle_start = now;
+		if (now - idle_start < poll_budget)
+			continue;
+
+		if (!dispatcher_can_sleep(disp))
+			continue;
+
+		ret = dispatcher_sleep(disp);
+		if (ret)
+			return ret;
+
+		idle_start = 0;
 	}
 
 	return 0;
@@ -218,6 +1169,7 @@ int
 rpma_dispatch_break(struct rpma_dispatcher *disp)
 {
 	rpma_utils_wait_break(&disp->waiting);
+	dispatcher_wake(disp);
 	return 0;
 }
 
@@ -226,7 +1178,8 @@ rpma_dispatcher_enqueue_cq_entry(struct rpma_dispatcher *disp,
 				 struct rpma_connection *conn,
 				 struct ibv_wc *wc)
 {
-	struct rpma_dispatcher_wc_entry *entry = Malloc(sizeof(*entry));
+	struct rpma_dispatcher_wc_entry *entry =
+		rpma_pool_get(&disp->wce_pool);
 	if (!entry)
 		return RPMA_E_ERRNO;
 
@@ -234,6 +1187,7 @@ rpma_dispatcher_enqueue_cq_entry(struct rpma_dispatcher *disp,
 	memcpy(&entry->wc, wc, sizeof(*wc));
 
 	PMDK_TAILQ_INSERT_TAIL(&disp->queue_wce, entry, next);
+	dispatcher_wake(disp);
 
 	return 0;
 }
@@ -243,14 +1197,61 @@ rpma_dispatcher_enqueue_func(struct rpma_dispatcher *disp,
 			     struct rpma_connection *conn, rpma_queue_func func,
 			     void *arg)
 {
-	struct rpma_dispatcher_func_entry *entry = Malloc(sizeof(*entry));
-	entry->conn = conn;
-	entry->func = func;
-	entry->arg = arg;
+	int ret = rpma_func_queue_enqueue(&disp->queue_func, &disp->func_pool,
+					  conn, func, arg);
+	if (ret)
+		return ret;
+
+	dispatcher_wake(disp);
+
+	return 0;
+}
 
-	os_mutex_lock(&disp->queue_func_mtx);
-	PMDK_TAILQ_INSERT_TAIL(&disp->queue_func, entry, next);
-	os_mutex_unlock(&disp->queue_func_mtx);
+int
+rpma_dispatcher_get_stats(struct rpma_dispatcher *disp,
+			  struct rpma_dispatcher_stats *stats)
+{
+	rpma_pool_get_stats(&disp->wce_pool, &stats->wc_entries_high_water,
+			    &stats->wc_entries_allocated);
+	rpma_pool_get_stats(&disp->func_pool, &stats->func_entries_high_water,
+			    &stats->func_entries_allocated);
+	rpma_pool_get_stats(&disp->conn_pool, &stats->conn_entries_high_water,
+			    &stats->conn_entries_allocated);
+
+	struct rpma_dispatcher_adaptive *a = &disp->adaptive;
+	uint64_t cost_sum;
+	uint64_t ncosts;
+
+	util_atomic_load_explicit64(&a->mode, &stats->mode,
+				    memory_order_relaxed);
+	util_atomic_load_explicit64(&a->rate, &stats->arrival_rate,
+				    memory_order_relaxed);
+	util_atomic_load_explicit64(&a->cost_max, &stats->backoff_cost_max,
+				    memory_order_relaxed);
+	util_atomic_load_explicit64(&a->cost_sum, &cost_sum,
+				    memory_order_relaxed);
+	util_atomic_load_explicit64(&a->ncosts, &ncosts,
+				    memory_order_relaxed);
+	stats->backoff_cost_avg = ncosts ? cost_sum / ncosts : 0;
 
 	return 0;
 }
+
+/*
+ * rpma_dispatcher_enqueue_stealable -- enqueue the func which may be called
+ * by any dispatcher of the pool, if there is no room for it the func is
+ * called by the dispatcher itself
+ */
+int
+rpma_dispatcher_enqueue_stealable(struct rpma_dispatcher *disp,
+				  struct rpma_connection *conn,
+				  rpma_queue_func func, void *arg)
+{
+	if (disp->pool && rpma_func_queue_push(&disp->queue_steal, conn, func,
+					       arg) == 0) {
+		dispatcher_wake(disp);
+		return 0;
+	}
+
+	return rpma_dispatcher_enqueue_func(disp, conn, func, arg);
+}
@@ -36,13 +36,21 @@
 #ifndef RPMA_DISPATCHER_H
 #define RPMA_DISPATCHER_H
 
+#include <infiniband/verbs.h>
+
+#include <librpma.h>
+
+#include "func_queue.h"
 #include "os_thread.h"
+#include "pool.h"
 #include "sys/queue.h"
+#include "util.h"
 
 struct rpma_dispatcher_conn {
 	PMDK_TAILQ_ENTRY(rpma_dispatcher_conn) next;
 
 	struct rpma_connection *conn;
+	int unarmable; /* the CQ is out of the dispatcher's channel */
 };
 
 struct rpma_dispatcher_wc_entry {
@@ -52,25 +60,71 @@ struct rpma_dispatcher_wc_entry {
 	struct ibv_wc wc;
 };
 
-struct rpma_dispatcher_func_entry {
-	PMDK_TAILQ_ENTRY(rpma_dispatcher_func_entry) next;
+#define RPMA_DISPATCHER_POOL_SLAB_SIZE 64
 
-	struct rpma_connection *conn;
-	rpma_queue_func func;
-	void *arg;
+#define RPMA_DISPATCHER_RATE_SLOTS 8
+
+/* the state of RPMA_DISPATCH_ADAPTIVE */
+struct rpma_dispatcher_adaptive {
+	/* the arrival rate is measured over a sliding window of slots */
+	uint64_t slots[RPMA_DISPATCHER_RATE_SLOTS]; /* # of arrivals per slot */
+	unsigned slot;
+	uint64_t slot_start; /* usec */
+	uint64_t window_sum;
+	uint64_t rate; /* # of arrivals per second */
+
+	uint64_t mode; /* RPMA_DISPATCHER_MODE_* */
+	uint64_t idle_start; /* usec, 0 - the last pass found some work */
+	uint64_t step_start; /* usec, start of the last backoff step */
+	uint64_t npause; /* length of the next pause step, doubled each time */
+
+	uint64_t cost_max; /* usec */
+	uint64_t cost_sum;
+	uint64_t ncosts;
 };
 
 struct rpma_dispatcher {
 	struct rpma_zone *zone;
 
+	/* the entries are taken from the pools instead of being allocated */
+	struct rpma_pool conn_pool;
+	struct rpma_pool wce_pool;
+	struct rpma_pool func_pool;
+
+	/* connections with a private CQ, attached from any thread */
 	PMDK_TAILQ_HEAD(head_conn, rpma_dispatcher_conn) conn_set;
+	os_rwlock_t conn_set_lock;
+	uint64_t conn_set_gen; /* changed by each attach and detach */
+	/* processed without the lock held, a detach waits until it is done */
+	struct rpma_connection *conn_busy;
+	uint64_t nconns; /* # of all the attached connections */
+
+	/* CQ shared by the attached connections (RPMA_CONFIG_SHARED_CQ) */
+	struct ibv_cq *cq;
+	os_mutex_t cq_lock; /* the resize goes along with the polling */
+	int cq_size;
+	int cq_reserved;
+	os_rwlock_t qp_map_lock;
+	struct ravl *qp_map; /* qp_num -> connection */
 
 	uint64_t waiting;
 
+	/* sleeping when there is nothing to do (RPMA_DISPATCH_HYBRID) */
+	struct ibv_comp_channel *channel;
+	int efd; /* eventfd waking the dispatcher up */
+	int epoll;
+	uint64_t sleeping;
+	uint64_t nunarmable; /* # of the CQs which cannot wake the dispatcher */
+
+	struct rpma_dispatcher_adaptive adaptive;
+
 	PMDK_TAILQ_HEAD(head_cq, rpma_dispatcher_wc_entry) queue_wce;
 
-	os_mutex_t queue_func_mtx;
-	PMDK_TAILQ_HEAD(head_fq, rpma_dispatcher_func_entry) queue_func;
+	struct rpma_dispatcher_func_queue queue_func;
+
+	/* funcs which any dispatcher of the pool may call */
+	struct rpma_dispatcher_func_queue queue_steal;
+	struct rpma_dispatcher_pool *pool; /* NULL if not a part of a pool */
 };
 
 int rpma_dispatcher_attach_connection(struct rpma_dispatcher *disp,
@@ -81,11 +135,29 @@ int rpma_dispatcher_detach_connection(struct rpma_dispatcher *disp,
 
 int rpma_dispatch_break(struct rpma_dispatcher *disp);
 
+int rpma_dispatcher_cq_reserve(struct rpma_dispatcher *disp, int cqe);
+void rpma_dispatcher_cq_release(struct rpma_dispatcher *disp, int cqe);
+
+int rpma_dispatcher_qp_register(struct rpma_dispatcher *disp,
+				struct rpma_connection *conn);
+void rpma_dispatcher_qp_unregister(struct rpma_dispatcher *disp,
+				   struct rpma_connection *conn);
+struct rpma_connection *rpma_dispatcher_qp_lookup(struct rpma_dispatcher *disp,
+						  uint32_t qp_num);
+
 int rpma_dispatcher_enqueue_cq_entry(struct rpma_dispatcher *disp,
 				     struct rpma_connection *conn,
 				     struct ibv_wc *wc);
 int rpma_dispatcher_enqueue_func(struct rpma_dispatcher *disp,
 				 struct rpma_connection *conn,
 				 rpma_queue_func func, void *arg);
+int rpma_dispatcher_enqueue_stealable(struct rpma_dispatcher *disp,
+				      struct rpma_connection *conn,
+				      rpma_queue_func func, void *arg);
+
+int rpma_dispatcher_steal(struct rpma_dispatcher *disp,
+			  struct rpma_dispatcher *victim, uint64_t *nfuncs);
+int rpma_dispatcher_pool_steal(struct rpma_dispatcher_pool *pool,
+			       struct rpma_dispatcher *disp);
 
 #endif /* dispatcher.h */
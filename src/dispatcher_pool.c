@@ -0,0 +1,349 @@
+/*
+ * Copyright 2020, Intel Corporation
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in
+ *       the documentation and/or other materials provided with the
+ *       distribution.
+ *
+ *     * Neither the name of the copyright holder nor the names of its
+ *       contributors may be used to endorse or promote products derived
+ *       from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * dispatcher_pool.c -- entry points for librpma dispatcher pool
+ *
+ * Each dispatcher of the pool is run by its own thread pinned to a single CPU.
+ * Unless the CPUs are provided they are taken from the NUMA node local to
+ * the RDMA device so the CQs are polled close to the device.
+ */
+
+#include <errno.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <base.h>
+
+#include "alloc.h"
+#include "connection.h"
+#include "dispatcher.h"
+#include "os_thread.h"
+#include "rpma_utils.h"
+#include "util.h"
+#include "zone.h"
+
+#define CPULIST_PATH_FMT "/sys/class/infiniband/%s/device/local_cpulist"
+#define CPULIST_MAX 4096
+#define MAX_CPUS 1024 /* as CPU_SETSIZE */
+
+struct rpma_dispatcher_pool_thread {
+	struct rpma_dispatcher *disp;
+	os_thread_t thread;
+	int cpu; /* -1 - not pinned */
+
+	uint64_t running;
+	int ret; /* of rpma_dispatch() */
+};
+
+struct rpma_dispatcher_pool {
+	struct rpma_zone *zone;
+
+	unsigned nthreads;
+	struct rpma_dispatcher_pool_thread *threads;
+};
+
+/*
+ * cpulist_parse -- (internal) parse the list of CPUs e.g. "0-3,8,10-11"
+ */
+static unsigned
+cpulist_parse(const char *list, unsigned *cpus, unsigned max)
+{
+	unsigned n = 0;
+	const char *p = list;
+	char *end;
+
+	while (*p && n < max) {
+		unsigned long first = strtoul(p, &end, 10);
+		if (end == p)
+			break;
+
+		unsigned long last = first;
+		p = end;
+		if (*p == '-') {
+			last = strtoul(p + 1, &end, 10);
+			if (end == p + 1)
+				break;
+			p = end;
+		}
+
+		for (unsigned long cpu = first; cpu <= last && n < max; ++cpu)
+			cpus[n++] = (unsigned)cpu;
+
+		if (*p != ',')
+			break;
+		++p;
+	}
+
+	return n;
+}
+
+/*
+ * device_local_cpus -- (internal) read the CPUs of the NUMA node the RDMA
+ * device is attached to, returns 0 if they are unknown
+ */
+static unsigned
+device_local_cpus(struct rpma_zone *zone, unsigned *cpus, unsigned max)
+{
+	const char *name = ibv_get_device_name(zone->device->device);
+	if (!name)
+		return 0;
+
+	char path[PATH_MAX];
+	int ret = snprintf(path, sizeof(path), CPULIST_PATH_FMT, name);
+	if (ret < 0 || (size_t)ret >= sizeof(path))
+		return 0;
+
+	FILE *file = fopen(path, "r");
+	if (!file) {
+		LOG(3, "local CPUs of %s unknown", name);
+		return 0;
+	}
+
+	char list[CPULIST_MAX];
+	unsigned n = 0;
+	if (fgets(list, sizeof(list), file))
+		n = cpulist_parse(list, cpus, max);
+
+	(void)fclose(file);
+
+	return n;
+}
+
+/*
+ * pool_thread_func -- (internal) run the dispatcher until the pool is deleted
+ */
+static void *
+pool_thread_func(void *arg)
+{
+	struct rpma_dispatcher_pool_thread *t = arg;
+
+	t->ret = rpma_dispatch(t->disp);
+
+	util_atomic_store_explicit64(&t->running, 0, memory_order_release);
+
+	return NULL;
+}
+
+/*
+ * pool_thread_pin -- (internal) pin the thread to its CPU
+ */
+static void
+pool_thread_pin(struct rpma_dispatcher_pool_thread *t)
+{
+	if (t->cpu < 0)
+		return;
+
+	os_cpu_set_t set;
+	memset(&set, 0, sizeof(set));
+	os_cpu_zero(&set);
+	os_cpu_set((size_t)t->cpu, &set);
+
+	int ret = os_thread_setaffinity_np(&t->thread, sizeof(set), &set);
+	if (ret)
+		LOG(3, "dispatcher thread not pinned to CPU %d: %s", t->cpu,
+		    strerror(ret));
+}
+
+/*
+ * pool_thread_stop -- (internal) break the dispatcher until its thread
+ * notices it, the thread may not have started dispatching yet
+ */
+static int
+pool_thread_stop(struct rpma_dispatcher_pool_thread *t)
+{
+	uint64_t running;
+
+	do {
+		(void)rpma_dispatch_break(t->disp);
+		util_atomic_load_explicit64(&t->running, &running,
+					    memory_order_acquire);
+	} while (running);
+
+	int ret = os_thread_join(&t->thread, NULL);
+	if (ret)
+		return -ret;
+
+	return t->ret;
+}
+
+int
+rpma_dispatcher_pool_new(struct rpma_zone *zone, unsigned nthreads,
+			 const unsigned *cpus, unsigned ncpus,
+			 struct rpma_dispatcher_pool **pool)
+{
+	if (nthreads == 0 || (cpus == NULL && ncpus != 0))
+		return -EINVAL;
+
+	struct rpma_dispatcher_pool *ptr = Malloc(sizeof(*ptr));
+	if (!ptr)
+		return RPMA_E_ERRNO;
+
+	int ret;
+
+	ptr->zone = zone;
+	ptr->nthreads = nthreads;
+	ptr->threads = Malloc(nthreads * sizeof(*ptr->threads));
+	if (!ptr->threads) {
+		ret = RPMA_E_ERRNO;
+		goto err_free_pool;
+	}
+
+	unsigned local_cpus[MAX_CPUS];
+	if (!cpus) {
+		ncpus = device_local_cpus(zone, local_cpus, MAX_CPUS);
+		cpus = local_cpus;
+	}
+
+	/*
+	 * the threads steal from each other so all the dispatchers have to
+	 * exist before the first thread starts
+	 */
+	unsigned ndisps;
+	for (ndisps = 0; ndisps < nthreads; ++ndisps) {
+		struct rpma_dispatcher_pool_thread *t = &ptr->threads[ndisps];
+
+		t->cpu = ncpus ? (int)cpus[ndisps % ncpus] : -1;
+		t->ret = 0;
+		t->running = 1;
+
+		ret = rpma_dispatcher_new(zone, &t->disp);
+		if (ret)
+			goto err_disps_delete;
+
+		t->disp->pool = ptr;
+	}
+
+	unsigned i;
+	for (i = 0; i < nthreads; ++i) {
+		struct rpma_dispatcher_pool_thread *t = &ptr->threads[i];
+
+		ret = os_thread_create(&t->thread, NULL, pool_thread_func, t);
+		if (ret) {
+			ret = -ret;
+			goto err_threads_stop;
+		}
+
+		pool_thread_pin(t);
+	}
+
+	*pool = ptr;
+
+	return 0;
+
+err_threads_stop:
+	while (i > 0)
+		(void)pool_thread_stop(&ptr->threads[--i]);
+err_disps_delete:
+	while (ndisps > 0)
+		(void)rpma_dispatcher_delete(&ptr->threads[--ndisps].disp);
+	Free(ptr->threads);
+err_free_pool:
+	Free(ptr);
+	return ret;
+}
+
+int
+rpma_dispatcher_pool_attach(struct rpma_dispatcher_pool *pool,
+			    struct rpma_connection *conn)
+{
+	struct rpma_dispatcher *least = NULL;
+	uint64_t least_nconns = UINT64_MAX;
+	uint64_t nconns;
+
+	for (unsigned i = 0; i < pool->nthreads; ++i) {
+		struct rpma_dispatcher *disp = pool->threads[i].disp;
+
+		util_atomic_load_explicit64(&disp->nconns, &nconns,
+					    memory_order_relaxed);
+		if (nconns < least_nconns) {
+			least = disp;
+			least_nconns = nconns;
+		}
+	}
+
+	return rpma_connection_attach(conn, least);
+}
+
+/*
+ * rpma_dispatcher_pool_steal -- call the stealable funcs of the other
+ * dispatchers of the pool, starting from the next one so the victims differ
+ */
+int
+rpma_dispatcher_pool_steal(struct rpma_dispatcher_pool *pool,
+			   struct rpma_dispatcher *disp)
+{
+	unsigned self = 0;
+	while (pool->threads[self].disp != disp)
+		++self;
+
+	uint64_t nfuncs = 0;
+
+	for (unsigned i = 1; i < pool->nthreads && nfuncs == 0; ++i) {
+		struct rpma_dispatcher *victim =
+			pool->threads[(self + i) % pool->nthreads].disp;
+
+		int ret = rpma_dispatcher_steal(disp, victim, &nfuncs);
+		if (ret)
+			return ret;
+	}
+
+	return 0;
+}
+
+int
+rpma_dispatcher_pool_delete(struct rpma_dispatcher_pool **pool)
+{
+	struct rpma_dispatcher_pool *ptr = *pool;
+	if (!ptr)
+		return 0;
+
+	int ret = 0;
+
+	/* no thread may steal from a dispatcher being deleted */
+	for (unsigned i = 0; i < ptr->nthreads; ++i) {
+		int ret_stop = pool_thread_stop(&ptr->threads[i]);
+		if (!ret)
+			ret = ret_stop;
+	}
+
+	for (unsigned i = 0; i < ptr->nthreads; ++i)
+		(void)rpma_dispatcher_delete(&ptr->threads[i].disp);
+
+	Free(ptr->threads);
+	Free(ptr);
+	*pool = NULL;
+
+	return ret;
+}
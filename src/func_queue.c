@@ -0,0 +1,295 @@
+/*
+ * Copyright 2020, Intel Corporation
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in
+ *       the documentation and/or other materials provided with the
+ *       distribution.
+ *
+ *     * Neither the name of the copyright holder nor the names of its
+ *       contributors may be used to endorse or promote products derived
+ *       from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * func_queue.c -- the func queue of the librpma dispatcher
+ *
+ * The funcs go to a bounded lock-free ring of slots, each slot carries
+ * a sequence number telling whether it is free or published in the current
+ * lap of the ring. When the ring is full the funcs are kept in the overflow
+ * list until the consumer catches up.
+ */
+
+#include <errno.h>
+
+#include "alloc.h"
+#include "func_queue.h"
+#include "rpma_utils.h"
+
+int
+rpma_func_queue_init(struct rpma_dispatcher_func_queue *q)
+{
+	uint64_t size = RPMA_DISPATCHER_FUNC_QUEUE_SIZE;
+
+	q->slots = Malloc(size * sizeof(*q->slots));
+	if (!q->slots)
+		return RPMA_E_ERRNO;
+
+	for (uint64_t i = 0; i < size; ++i)
+		q->slots[i].seq = i;
+
+	q->mask = size - 1;
+	q->enqueue_pos = 0;
+	q->dequeue_pos = 0;
+
+	q->overflow_num = 0;
+	os_mutex_init(&q->overflow_mtx);
+	PMDK_TAILQ_INIT(&q->overflow);
+
+	return 0;
+}
+
+void
+rpma_func_queue_fini(struct rpma_dispatcher_func_queue *q)
+{
+	/* the overflow entries are released along with their pool */
+	os_mutex_destroy(&q->overflow_mtx);
+	Free(q->slots);
+}
+
+/*
+ * rpma_func_queue_push -- take the next slot of the ring, returns
+ * -EAGAIN if the ring is full
+ */
+int
+rpma_func_queue_push(struct rpma_dispatcher_func_queue *q,
+		     struct rpma_connection *conn, rpma_queue_func func,
+		     void *arg)
+{
+	struct rpma_dispatcher_func_slot *slot;
+	uint64_t pos;
+	uint64_t seq;
+
+	util_atomic_load_explicit64(&q->enqueue_pos, &pos,
+				    memory_order_relaxed);
+
+	while (1) {
+		slot = &q->slots[pos & q->mask];
+		util_atomic_load_explicit64(&slot->seq, &seq,
+					    memory_order_acquire);
+
+		int64_t diff = (int64_t)seq - (int64_t)pos;
+		if (diff == 0) {
+			/* the slot is free - try to claim it */
+			if (util_bool_compare_and_swap64(&q->enqueue_pos, pos,
+							 pos + 1))
+				break;
+		} else if (diff < 0) {
+			/* the slot has not been consumed yet */
+			return -EAGAIN;
+		}
+
+		/* another producer was faster */
+		util_atomic_load_explicit64(&q->enqueue_pos, &pos,
+					    memory_order_relaxed);
+	}
+
+	slot->conn = conn;
+	slot->func = func;
+	slot->arg = arg;
+
+	/* publish the slot to the consumer */
+	util_atomic_store_explicit64(&slot->seq, pos + 1,
+				     memory_order_release);
+
+	return 0;
+}
+
+/*
+ * rpma_func_queue_pop -- take the oldest func from the ring, returns
+ * -EAGAIN if the ring is empty (only the dispatcher thread pops)
+ */
+int
+rpma_func_queue_pop(struct rpma_dispatcher_func_queue *q,
+		    struct rpma_dispatcher_func_slot *out)
+{
+	uint64_t pos = q->dequeue_pos;
+	struct rpma_dispatcher_func_slot *slot = &q->slots[pos & q->mask];
+	uint64_t seq;
+
+	util_atomic_load_explicit64(&slot->seq, &seq, memory_order_acquire);
+	if (seq != pos + 1)
+		return -EAGAIN;
+
+	out->conn = slot->conn;
+	out->func = slot->func;
+	out->arg = slot->arg;
+
+	q->dequeue_pos = pos + 1;
+
+	/* the slot is free for the next lap of the producers */
+	util_atomic_store_explicit64(&slot->seq, pos + q->mask + 1,
+				     memory_order_release);
+
+	return 0;
+}
+
+/*
+ * rpma_func_queue_pop_shared -- take the oldest func from the ring
+ * shared by many consumers, returns -EAGAIN if the ring is empty
+ */
+int
+rpma_func_queue_pop_shared(struct rpma_dispatcher_func_queue *q,
+			   struct rpma_dispatcher_func_slot *out)
+{
+	struct rpma_dispatcher_func_slot *slot;
+	uint64_t pos;
+	uint64_t seq;
+
+	util_atomic_load_explicit64(&q->dequeue_pos, &pos,
+				    memory_order_relaxed);
+
+	while (1) {
+		slot = &q->slots[pos & q->mask];
+		util_atomic_load_explicit64(&slot->seq, &seq,
+					    memory_order_acquire);
+
+		int64_t diff = (int64_t)seq - (int64_t)(pos + 1);
+		if (diff == 0) {
+			/* the slot is published - try to claim it */
+			if (util_bool_compare_and_swap64(&q->dequeue_pos, pos,
+							 pos + 1))
+				break;
+		} else if (diff < 0) {
+			/* nothing published yet */
+			return -EAGAIN;
+		}
+
+		/* another consumer was faster */
+		util_atomic_load_explicit64(&q->dequeue_pos, &pos,
+					    memory_order_relaxed);
+	}
+
+	out->conn = slot->conn;
+	out->func = slot->func;
+	out->arg = slot->arg;
+
+	util_atomic_store_explicit64(&slot->seq, pos + q->mask + 1,
+				     memory_order_release);
+
+	return 0;
+}
+
+/*
+ * rpma_func_queue_enqueue -- push the func to the ring, if the ring is full
+ * the func goes to the overflow list in an entry taken from the pool
+ */
+int
+rpma_func_queue_enqueue(struct rpma_dispatcher_func_queue *q,
+			struct rpma_pool *pool, struct rpma_connection *conn,
+			rpma_queue_func func, void *arg)
+{
+	uint64_t overflow_num;
+
+	/* the funcs already in the overflow list have to be called first */
+	util_atomic_load_explicit64(&q->overflow_num, &overflow_num,
+				    memory_order_acquire);
+	if (overflow_num == 0 && rpma_func_queue_push(q, conn, func, arg) == 0)
+		return 0;
+
+	struct rpma_dispatcher_func_entry *entry = rpma_pool_get(pool);
+	if (!entry)
+		return RPMA_E_ERRNO;
+
+	entry->conn = conn;
+	entry->func = func;
+	entry->arg = arg;
+
+	os_mutex_lock(&q->overflow_mtx);
+	PMDK_TAILQ_INSERT_TAIL(&q->overflow, entry, next);
+	util_fetch_and_add64(&q->overflow_num, 1);
+	os_mutex_unlock(&q->overflow_mtx);
+
+	return 0;
+}
+
+/*
+ * rpma_func_queue_process -- call the enqueued funcs, the ring first since
+ * the overflow list is used only when the ring is full, stops at the first
+ * func which fails and returns its error
+ */
+int
+rpma_func_queue_process(struct rpma_dispatcher_func_queue *q,
+			struct rpma_pool *pool, uint64_t *nfuncs)
+{
+	struct rpma_dispatcher_func_slot f;
+	struct rpma_dispatcher_func_entry *funce;
+	uint64_t overflow_num;
+	uint64_t enqueue_pos;
+	int ret;
+
+	while (rpma_func_queue_pop(q, &f) == 0) {
+		ret = f.func(f.conn, f.arg);
+		if (ret)
+			return ret;
+		++*nfuncs;
+	}
+
+	util_atomic_load_explicit64(&q->overflow_num, &overflow_num,
+				    memory_order_acquire);
+	if (overflow_num == 0)
+		return 0;
+
+	while (1) {
+		os_mutex_lock(&q->overflow_mtx);
+
+		/*
+		 * the funcs which went to the ring before this entry went to
+		 * the overflow list, including a slot claimed but not
+		 * published yet, have to be called first
+		 */
+		util_atomic_load_explicit64(&q->enqueue_pos, &enqueue_pos,
+					    memory_order_acquire);
+		if (enqueue_pos != q->dequeue_pos) {
+			os_mutex_unlock(&q->overflow_mtx);
+			break;
+		}
+
+		funce = PMDK_TAILQ_FIRST(&q->overflow);
+		if (funce) {
+			PMDK_TAILQ_REMOVE(&q->overflow, funce, next);
+			util_fetch_and_sub64(&q->overflow_num, 1);
+		}
+		os_mutex_unlock(&q->overflow_mtx);
+
+		if (!funce)
+			break;
+
+		ret = funce->func(funce->conn, funce->arg);
+		rpma_pool_put(pool, funce);
+		if (ret)
+			return ret;
+		++*nfuncs;
+	}
+
+	return 0;
+}
@@ -0,0 +1,104 @@
+/*
+ * Copyright 2020, Intel Corporation
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in
+ *       the documentation and/or other materials provided with the
+ *       distribution.
+ *
+ *     * Neither the name of the copyright holder nor the names of its
+ *       contributors may be used to endorse or promote products derived
+ *       from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * func_queue.h -- internal definitions for the func queue of librpma
+ * dispatcher
+ */
+#ifndef RPMA_FUNC_QUEUE_H
+#define RPMA_FUNC_QUEUE_H
+
+#include <librpma.h>
+
+#include "os_thread.h"
+#include "pool.h"
+#include "sys/queue.h"
+#include "util.h"
+
+struct rpma_dispatcher_func_entry {
+	PMDK_TAILQ_ENTRY(rpma_dispatcher_func_entry) next;
+
+	struct rpma_connection *conn;
+	rpma_queue_func func;
+	void *arg;
+};
+
+/* a slot of the func queue, seq tells whose turn it is to use the slot */
+struct rpma_dispatcher_func_slot {
+	uint64_t seq;
+
+	struct rpma_connection *conn;
+	rpma_queue_func func;
+	void *arg;
+};
+
+#define RPMA_DISPATCHER_FUNC_QUEUE_SIZE 1024 /* has to be a power of 2 */
+
+/*
+ * bounded multi-producer single-consumer queue of the funcs, when it is full
+ * the funcs go to the overflow list until the dispatcher empties it
+ */
+struct rpma_dispatcher_func_queue {
+	struct rpma_dispatcher_func_slot *slots;
+	uint64_t mask;
+
+	/* the producers and the consumer do not share a cache line */
+	char pad0[CACHELINE_SIZE];
+	uint64_t enqueue_pos;
+	char pad1[CACHELINE_SIZE - sizeof(uint64_t)];
+	uint64_t dequeue_pos;
+	char pad2[CACHELINE_SIZE - sizeof(uint64_t)];
+
+	uint64_t overflow_num;
+	os_mutex_t overflow_mtx;
+	PMDK_TAILQ_HEAD(head_fq, rpma_dispatcher_func_entry) overflow;
+};
+
+int rpma_func_queue_init(struct rpma_dispatcher_func_queue *q);
+void rpma_func_queue_fini(struct rpma_dispatcher_func_queue *q);
+
+int rpma_func_queue_push(struct rpma_dispatcher_func_queue *q,
+			 struct rpma_connection *conn, rpma_queue_func func,
+			 void *arg);
+int rpma_func_queue_pop(struct rpma_dispatcher_func_queue *q,
+			struct rpma_dispatcher_func_slot *out);
+int rpma_func_queue_pop_shared(struct rpma_dispatcher_func_queue *q,
+			       struct rpma_dispatcher_func_slot *out);
+
+int rpma_func_queue_enqueue(struct rpma_dispatcher_func_queue *q,
+			    struct rpma_pool *pool,
+			    struct rpma_connection *conn, rpma_queue_func func,
+			    void *arg);
+int rpma_func_queue_process(struct rpma_dispatcher_func_queue *q,
+			    struct rpma_pool *pool, uint64_t *nfuncs);
+
+#endif /* func_queue.h */
@@ -58,6 +58,8 @@ extern "C" {
 #define RPMA_E_EC_EVENT_DATA (-100006)
 #define RPMA_E_UNHANDLED_EVENT (-100007)
 #define RPMA_E_UNKNOWN_CONNECTION (-100008)
+#define RPMA_E_OP_FAILED (-100009)
+#define RPMA_E_NO_COMPLETION (-100010)
 
 /* config setup */
 
@@ -77,6 +79,66 @@ int rpma_config_set_send_queue_length(struct rpma_config *cfg,
 int rpma_config_set_recv_queue_length(struct rpma_config *cfg,
 				      uint64_t queue_len);
 
+int rpma_config_set_rma_queue_length(struct rpma_config *cfg,
+				     uint64_t queue_len);
+
+int rpma_config_set_cq_size(struct rpma_config *cfg, uint64_t cq_size);
+
+int rpma_config_set_initiator_depth(struct rpma_config *cfg, uint64_t depth);
+
+int rpma_config_set_cq_batch_size(struct rpma_config *cfg,
+				  uint64_t batch_size);
+
+int rpma_config_set_send_signal_interval(struct rpma_config *cfg,
+					 uint64_t interval);
+
+/*
+ * the sends and RDMA writes up to the threshold are passed to the device
+ * inline, the threshold is limited to what the device supports, 0 disables
+ */
+int rpma_config_set_inline_threshold(struct rpma_config *cfg,
+				     uint32_t threshold);
+
+/* max # of the segments of a vectored RDMA read or write */
+int rpma_config_set_max_sge(struct rpma_config *cfg, uint64_t max_sge);
+
+int rpma_config_set_srq(struct rpma_config *cfg, uint64_t length,
+			uint64_t low_watermark);
+
+/*
+ * # of the lanes of each connection and # of WRs each lane may have in flight
+ * (at least 2), 0 lanes (the default) disables them
+ */
+int rpma_config_set_lanes(struct rpma_config *cfg, uint64_t nlanes,
+			  uint64_t lane_queue_length);
+
+/* the dispatcher polls all the time */
+#define RPMA_DISPATCH_POLL 0
+/*
+ * the dispatcher polls until it finds nothing to do for the poll budget
+ * (in microseconds) and then it sleeps until a completion, a queued func or
+ * a connection event arrives
+ */
+#define RPMA_DISPATCH_HYBRID 1
+/*
+ * the dispatcher keeps polling under a dense load, otherwise it polls only
+ * for about the expected time to the next completion and then it backs off
+ * (pause, yield) until the poll budget runs out and it sleeps
+ */
+#define RPMA_DISPATCH_ADAPTIVE 2
+
+int rpma_config_set_dispatch_mode(struct rpma_config *cfg, int mode,
+				  uint64_t poll_budget);
+
+/* length of the queue of the pending connection requests, 0 - the default */
+int rpma_config_set_listen_backlog(struct rpma_config *cfg, int backlog);
+
+/*
+ * # of the connections (with their buffers and CQs) created in advance when
+ * the zone has nothing else to do, rpma_connection_new() takes them first
+ */
+int rpma_config_set_conn_cache(struct rpma_config *cfg, uint64_t nconns);
+
 typedef void *(*rpma_malloc_func)(size_t size);
 
 typedef void (*rpma_free_func)(void *ptr);
@@ -86,6 +148,18 @@ int rpma_config_set_queue_alloc_funcs(struct rpma_config *cfg,
 				      rpma_free_func free_func);
 
 #define RPMA_CONFIG_IS_SERVER (1 << 0)
+/*
+ * all connections attached to a dispatcher before they are accepted or
+ * established share a single completion queue polled by the dispatcher
+ */
+#define RPMA_CONFIG_SHARED_CQ (1 << 1)
+/*
+ * all connections of the zone receive messages into a single pool of buffers
+ * (see rpma_config_set_srq()) instead of the per-connection receive queues
+ */
+#define RPMA_CONFIG_SHARED_RQ (1 << 2)
+/* zero the buffers returned by rpma_msg_get_ptr() */
+#define RPMA_CONFIG_MSG_ZERO (1 << 3)
 
 int rpma_config_set_flags(struct rpma_config *cfg, unsigned flags);
 
@@ -109,11 +183,40 @@ int rpma_dispatch(struct rpma_dispatcher *disp);
 
 int rpma_dispatcher_delete(struct rpma_dispatcher **disp);
 
+/* what the dispatcher does at the moment (RPMA_DISPATCH_ADAPTIVE) */
+#define RPMA_DISPATCHER_MODE_POLL 0
+#define RPMA_DISPATCHER_MODE_PAUSE 1
+#define RPMA_DISPATCHER_MODE_YIELD 2
+#define RPMA_DISPATCHER_MODE_SLEEP 3
+
+struct rpma_dispatcher_stats {
+	/* usage of the internal entry pools of the dispatcher */
+	uint64_t wc_entries_high_water; /* max # of the entries used at once */
+	uint64_t wc_entries_allocated;
+	uint64_t func_entries_high_water;
+	uint64_t func_entries_allocated;
+	uint64_t conn_entries_high_water;
+	uint64_t conn_entries_allocated;
+
+	/* RPMA_DISPATCH_ADAPTIVE only */
+	uint64_t mode; /* RPMA_DISPATCHER_MODE_* */
+	uint64_t arrival_rate; /* completions and funcs per second */
+	/* latency the backoff could have added to the work it delayed [usec] */
+	uint64_t backoff_cost_max;
+	uint64_t backoff_cost_avg;
+};
+
+int rpma_dispatcher_get_stats(struct rpma_dispatcher *disp,
+			      struct rpma_dispatcher_stats *stats);
+
 /* zone connection loop setup */
 
 #define RPMA_CONNECTION_EVENT_INCOMING 0
 #define RPMA_CONNECTION_EVENT_OUTGOING 1
 #define RPMA_CONNECTION_EVENT_DISCONNECT 2
+/* an asynchronous accept or establish has completed or failed */
+#define RPMA_CONNECTION_EVENT_ESTABLISHED 3
+#define RPMA_CONNECTION_EVENT_FAILED 4
 
 struct rpma_connection;
 
@@ -140,12 +243,26 @@ int rpma_zone_wait_break(struct rpma_zone *zone);
 
 int rpma_connection_new(struct rpma_zone *zone, struct rpma_connection **conn);
 
+/*
+ * the synchronous accept and establish do not call the callbacks of the zone,
+ * the events of the other connections coming meanwhile are reported by
+ * rpma_zone_wait_connections() afterwards
+ */
 int rpma_connection_accept(struct rpma_connection *conn);
 
+/*
+ * the asynchronous variants return as soon as the setup is started, the rest
+ * of it is driven by rpma_zone_wait_connections() which reports the result
+ * as RPMA_CONNECTION_EVENT_ESTABLISHED or RPMA_CONNECTION_EVENT_FAILED
+ */
+int rpma_connection_accept_async(struct rpma_connection *conn);
+
 int rpma_connection_reject(struct rpma_zone *zone);
 
 int rpma_connection_establish(struct rpma_connection *conn);
 
+int rpma_connection_establish_async(struct rpma_connection *conn);
+
 int rpma_connection_disconnect(struct rpma_connection *conn);
 
 int rpma_connection_delete(struct rpma_connection **conn);
@@ -169,6 +286,16 @@ typedef int (*rpma_queue_func)(struct rpma_connection *conn, void *arg);
 int rpma_connection_enqueue(struct rpma_connection *conn, rpma_queue_func func,
 			    void *arg);
 
+/*
+ * the func does not depend on the order of the connection funcs so it may be
+ * called by any idle dispatcher of the pool (see rpma_dispatcher_pool_new())
+ * concurrently with the dispatcher of the connection; conn is passed only to
+ * identify the connection, the func must not post anything on it nor touch its
+ * queues, buffers or CQ
+ */
+int rpma_connection_enqueue_stealable(struct rpma_connection *conn,
+				      rpma_queue_func func, void *arg);
+
 typedef int (*rpma_on_transmission_notify_func)(struct rpma_connection *conn,
 						void *addr, size_t len,
 						void *uarg);
@@ -199,6 +326,55 @@ int rpma_connection_group_enqueue(struct rpma_connection_group *group,
 
 int rpma_connection_group_delete(struct rpma_connection_group **group);
 
+/* connection pool */
+
+struct rpma_connection_pool;
+
+/*
+ * nconns connections to the peer of the zone, attached to the dispatcher
+ * (if not NULL) before they are established so they may share its CQ
+ */
+int rpma_connection_pool_new(struct rpma_zone *zone,
+			     struct rpma_dispatcher *disp, unsigned nconns,
+			     struct rpma_connection_pool **pool);
+
+/* set up all the connections concurrently and wait for all of them */
+int rpma_connection_pool_establish(struct rpma_connection_pool *pool);
+
+int rpma_connection_pool_size(struct rpma_connection_pool *pool,
+			      unsigned *nconns);
+
+int rpma_connection_pool_get(struct rpma_connection_pool *pool, unsigned i,
+			     struct rpma_connection **conn);
+
+/* the same key always selects the same connection */
+int rpma_connection_pool_hash(struct rpma_connection_pool *pool, uint64_t key,
+			      struct rpma_connection **conn);
+
+/* the connections in turns, for striping the ops across all of them */
+int rpma_connection_pool_next(struct rpma_connection_pool *pool,
+			      struct rpma_connection **conn);
+
+int rpma_connection_pool_delete(struct rpma_connection_pool **pool);
+
+/* dispatcher pool */
+
+struct rpma_dispatcher_pool;
+
+/*
+ * each of nthreads dispatchers is run by its own thread pinned to one of cpus
+ * in turns, if cpus is NULL the CPUs local to the RDMA device are used if known
+ */
+int rpma_dispatcher_pool_new(struct rpma_zone *zone, unsigned nthreads,
+			     const unsigned *cpus, unsigned ncpus,
+			     struct rpma_dispatcher_pool **pool);
+
+/* attach the connection to the dispatcher with the fewest connections */
+int rpma_dispatcher_pool_attach(struct rpma_dispatcher_pool *pool,
+				struct rpma_connection *conn);
+
+int rpma_dispatcher_pool_delete(struct rpma_dispatcher_pool **pool);
+
 /* error handling */
 
 const char *rpma_errormsg(void);
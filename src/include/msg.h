@@ -51,10 +51,35 @@ extern "C" {
 
 #include <base.h>
 
+/*
+ * returns -EAGAIN when all the send buffers are still in use, the buffers
+ * have to be sent in the order they were taken, the buffer is zeroed only
+ * if the zone is configured with RPMA_CONFIG_MSG_ZERO
+ */
 int rpma_msg_get_ptr(struct rpma_connection *conn, void **ptr);
 
+/*
+ * the send completes in the background, returns -EAGAIN when the peer has no
+ * receive buffer available for the message
+ */
 int rpma_connection_send(struct rpma_connection *conn, void *ptr);
 
+/*
+ * send only the first length bytes of the message, the on_recv callback of
+ * the peer gets the same length
+ */
+int rpma_connection_send_length(struct rpma_connection *conn, void *ptr,
+				size_t length);
+
+/*
+ * a received buffer is reposted as soon as the on_recv callback returns
+ * unless the callback returns RPMA_RECV_KEEP, in that case the buffer stays
+ * valid until it is released by rpma_connection_recv_release()
+ */
+#define RPMA_RECV_KEEP 1
+
+int rpma_connection_recv_release(struct rpma_connection *conn, void *ptr);
+
 #ifdef __cplusplus
 }
 #endif
@@ -59,6 +59,8 @@ struct rpma_memory_local;
 #define RPMA_MR_READ_DST (1 << 1)
 #define RPMA_MR_WRITE_SRC (1 << 2)
 #define RPMA_MR_WRITE_DST (1 << 3)
+/* the target of rpma_connection_compare_and_swap/fetch_and_add() */
+#define RPMA_MR_ATOMIC_DST (1 << 4)
 
 int rpma_memory_local_new(struct rpma_zone *zone, void *ptr, size_t size,
 			  int usage, struct rpma_memory_local **mem);
@@ -89,23 +91,196 @@ int rpma_memory_remote_delete(struct rpma_memory_remote **rmem);
 
 /* remote memory access commands */
 
+/*
+ * the blocking commands wait for the asynchronous ops in flight to make room
+ * in the RMA queue, -EAGAIN is returned only if the queue is taken by the ops
+ * completed but not reaped yet or the connection has been disconnected
+ */
 int rpma_connection_read(struct rpma_connection *conn,
 			 struct rpma_memory_local *dst, size_t dst_off,
 			 struct rpma_memory_remote *src, size_t src_off,
 			 size_t length);
 
+/*
+ * the write completes in the background, returns -EAGAIN when the writes and
+ * the ops posted so far fill up the RMA queue
+ */
 int rpma_connection_write(struct rpma_connection *conn,
 			  struct rpma_memory_remote *dst, size_t dst_off,
 			  struct rpma_memory_local *src, size_t src_off,
 			  size_t length);
 
+/*
+ * the remote 8 bytes are never observed partially written, dst_off has to be
+ * 8-byte aligned and length has to be 8, RPMA_E_NOSUPP if the device does not
+ * support the native atomic write
+ */
 int rpma_connection_atomic_write(struct rpma_connection *conn,
 				 struct rpma_memory_remote *dst, size_t dst_off,
 				 struct rpma_memory_local *src, size_t src_off,
 				 size_t length);
 
+/*
+ * remote atomic ops on the 8-byte aligned dst_off, the original remote value
+ * is stored in the 8 bytes of the result, RPMA_E_NOSUPP if the device does not
+ * support atomics
+ */
+int rpma_connection_compare_and_swap(struct rpma_connection *conn,
+				     struct rpma_memory_remote *dst,
+				     size_t dst_off, uint64_t compare,
+				     uint64_t swap,
+				     struct rpma_memory_local *result,
+				     size_t result_off);
+
+int rpma_connection_fetch_and_add(struct rpma_connection *conn,
+				  struct rpma_memory_remote *dst,
+				  size_t dst_off, uint64_t add,
+				  struct rpma_memory_local *result,
+				  size_t result_off);
+
+/*
+ * the peer is notified about the write so it consumes a receive buffer of
+ * the peer as a message does, dst_off cannot exceed UINT32_MAX
+ */
+int rpma_connection_write_notify(struct rpma_connection *conn,
+				 struct rpma_memory_remote *dst, size_t dst_off,
+				 struct rpma_memory_local *src, size_t src_off,
+				 size_t length);
+
+/*
+ * the regions written with rpma_connection_write_notify() by the peer are
+ * passed to the notify callback as a part of the memory
+ */
+int rpma_connection_set_notify_memory(struct rpma_connection *conn,
+				      struct rpma_memory_local *mem);
+
+/* a blocking flush of all the data written so far */
 int rpma_connection_commit(struct rpma_connection *conn);
 
+/* vectored remote memory access commands */
+
+/* a segment of a local memory region */
+struct rpma_sge {
+	struct rpma_memory_local *mem;
+	size_t offset;
+	size_t length;
+};
+
+/*
+ * the segments are gathered into (or scattered from) a single remote range,
+ * num_segs cannot exceed the value of rpma_config_set_max_sge()
+ */
+int rpma_connection_readv(struct rpma_connection *conn,
+			  const struct rpma_sge *dst, int num_segs,
+			  struct rpma_memory_remote *src, size_t src_off);
+
+int rpma_connection_writev(struct rpma_connection *conn,
+			   struct rpma_memory_remote *dst, size_t dst_off,
+			   const struct rpma_sge *src, int num_segs);
+
+/* asynchronous remote memory access commands */
+
+#define RPMA_OP_READ 0
+#define RPMA_OP_WRITE 1
+#define RPMA_OP_FLUSH 2
+#define RPMA_OP_ATOMIC 3
+
+struct rpma_completion {
+	void *op_context; /* as provided when the op was posted */
+	int op;
+	int status; /* 0 or RPMA_E_OP_FAILED */
+};
+
+int rpma_connection_read_async(struct rpma_connection *conn,
+			       struct rpma_memory_local *dst, size_t dst_off,
+			       struct rpma_memory_remote *src, size_t src_off,
+			       size_t length, void *op_context);
+
+int rpma_connection_write_async(struct rpma_connection *conn,
+				struct rpma_memory_remote *dst, size_t dst_off,
+				struct rpma_memory_local *src, size_t src_off,
+				size_t length, void *op_context);
+
+int rpma_connection_readv_async(struct rpma_connection *conn,
+				const struct rpma_sge *dst, int num_segs,
+				struct rpma_memory_remote *src, size_t src_off,
+				void *op_context);
+
+int rpma_connection_writev_async(struct rpma_connection *conn,
+				 struct rpma_memory_remote *dst, size_t dst_off,
+				 const struct rpma_sge *src, int num_segs,
+				 void *op_context);
+
+int rpma_connection_compare_and_swap_async(struct rpma_connection *conn,
+					   struct rpma_memory_remote *dst,
+					   size_t dst_off, uint64_t compare,
+					   uint64_t swap,
+					   struct rpma_memory_local *result,
+					   size_t result_off, void *op_context);
+
+int rpma_connection_fetch_and_add_async(struct rpma_connection *conn,
+					struct rpma_memory_remote *dst,
+					size_t dst_off, uint64_t add,
+					struct rpma_memory_local *result,
+					size_t result_off, void *op_context);
+
+/* a single RDMA write of the list */
+struct rpma_write_range {
+	struct rpma_memory_remote *dst;
+	size_t dst_off;
+	struct rpma_memory_local *src;
+	size_t src_off;
+	size_t length;
+};
+
+/* the list completes when all the data written so far is persistent */
+#define RPMA_WRITE_LIST_FLUSH (1 << 0)
+
+/*
+ * all the writes are posted at once and reported as a single RPMA_OP_WRITE
+ * completion, num cannot exceed the RMA queue length
+ */
+int rpma_connection_write_list(struct rpma_connection *conn,
+			       const struct rpma_write_range *ranges, int num,
+			       unsigned flags, void *op_context);
+
+/*
+ * make all the data written so far persistent, completes at once if nothing
+ * has been written since the last flush
+ */
+int rpma_connection_flush_async(struct rpma_connection *conn,
+				void *op_context);
+
+int rpma_connection_poll(struct rpma_connection *conn,
+			 struct rpma_completion *cmpls, size_t num,
+			 size_t *num_done);
+
+/*
+ * wait until at least one op completes, returns RPMA_E_NO_COMPLETION if no op
+ * is in flight or the connection has been disconnected
+ */
+int rpma_connection_wait(struct rpma_connection *conn,
+			 struct rpma_completion *cmpls, size_t num,
+			 size_t *num_done);
+
+/*
+ * lanes (see rpma_config_set_lanes()) - each lane may be used by a different
+ * thread concurrently, the data written to a lane is made persistent by
+ * draining the very same lane
+ */
+int rpma_connection_lane_flush(struct rpma_connection *conn, unsigned lane,
+			       struct rpma_memory_remote *dst, size_t dst_off,
+			       struct rpma_memory_local *src, size_t src_off,
+			       size_t length);
+
+int rpma_connection_lane_drain(struct rpma_connection *conn, unsigned lane);
+
+/* rpma_connection_lane_flush() followed by rpma_connection_lane_drain() */
+int rpma_connection_lane_persist(struct rpma_connection *conn, unsigned lane,
+				 struct rpma_memory_remote *dst,
+				 size_t dst_off, struct rpma_memory_local *src,
+				 size_t src_off, size_t length);
+
 #ifdef __cplusplus
 }
 #endif
@@ -53,7 +53,8 @@ usage_to_access(int usage)
 	}
 
 	if (usage & RPMA_MR_READ_DST) {
-		RPMA_FLAG_ON(access, 0); /* XXX */
+		/* RDMA read writes to the local memory */
+		RPMA_FLAG_ON(access, IBV_ACCESS_LOCAL_WRITE);
 		RPMA_FLAG_OFF(usage, RPMA_MR_READ_DST);
 	}
 
@@ -69,9 +70,18 @@ usage_to_access(int usage)
 		 */
 		RPMA_FLAG_ON(access,
 			     IBV_ACCESS_REMOTE_WRITE | IBV_ACCESS_LOCAL_WRITE);
+		/* the written data is flushed by RDMA read */
+		RPMA_FLAG_ON(access, IBV_ACCESS_REMOTE_READ);
 		RPMA_FLAG_OFF(usage, RPMA_MR_WRITE_DST);
 	}
 
+	if (usage & RPMA_MR_ATOMIC_DST) {
+		/* as for IBV_ACCESS_REMOTE_WRITE */
+		RPMA_FLAG_ON(access,
+			     IBV_ACCESS_REMOTE_ATOMIC | IBV_ACCESS_LOCAL_WRITE);
+		RPMA_FLAG_OFF(usage, RPMA_MR_ATOMIC_DST);
+	}
+
 	ASSERTeq(usage, 0);
 
 	return access;
@@ -112,6 +122,10 @@ rpma_memory_local_new(struct rpma_zone *zone, void *ptr, size_t size, int usage,
 		      struct rpma_memory_local **mem_ptr)
 {
 	int access = usage_to_access(usage);
+#ifdef NATIVE_FLUSH_SUPPORTED
+	if (zone->native_flush && (usage & RPMA_MR_WRITE_DST))
+		access |= IBV_ACCESS_FLUSH_PERSISTENT;
+#endif
 	return rpma_memory_local_new_internal(zone, ptr, size, access, mem_ptr);
 }
 
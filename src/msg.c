@@ -34,13 +34,16 @@
  * msg.c -- entry points for librpma MSG
  */
 
+#include <arpa/inet.h>
 #include <errno.h>
 
 #include "alloc.h"
 #include "connection.h"
 #include "memory.h"
 #include "rpma_utils.h"
+#include "srq.h"
 #include "util.h"
+#include "zone.h"
 
 static int
 msg_queue_init(struct rpma_connection *conn, size_t queue_length, int access,
@@ -99,8 +102,8 @@ msg_init(struct ibv_send_wr *send, struct ibv_recv_wr *recv,
 		send->next = NULL;
 		send->sg_list = sge;
 		send->num_sge = 1;
-		send->opcode = IBV_WR_SEND;
-		send->send_flags = IBV_SEND_SIGNALED;
+		send->opcode = IBV_WR_SEND_WITH_IMM;
+		send->send_flags = 0;
 	} else {
 		ASSERTne(recv, NULL);
 
@@ -116,6 +119,119 @@ msg_init(struct ibv_send_wr *send, struct ibv_recv_wr *recv,
 	sge->lkey = buff->mr->lkey;
 }
 
+/*
+ * recv_buffs_num -- (internal) # of the receive buffers of the connection
+ */
+static inline uint64_t
+recv_buffs_num(struct rpma_connection *conn)
+{
+	return conn->zone->recv_queue_length + RPMA_CREDITS_UPDATE_BUFFS;
+}
+
+/*
+ * recv_repost_init -- (internal) prepare the chain of receive work requests,
+ * one per receive buffer
+ */
+static int
+recv_repost_init(struct rpma_connection *conn)
+{
+	struct rpma_recv_repost *rr = &conn->recv_repost;
+	uint64_t length = recv_buffs_num(conn);
+
+	rr->free = Malloc(length * sizeof(*rr->free));
+	if (!rr->free)
+		return RPMA_E_ERRNO;
+
+	int ret;
+
+	rr->wrs = Malloc(length * sizeof(*rr->wrs));
+	if (!rr->wrs) {
+		ret = RPMA_E_ERRNO;
+		goto err_wrs;
+	}
+
+	rr->sges = Malloc(length * sizeof(*rr->sges));
+	if (!rr->sges) {
+		ret = RPMA_E_ERRNO;
+		goto err_sges;
+	}
+
+	for (uint64_t i = 0; i < length; ++i) {
+		msg_init(NULL, &rr->wrs[i], &rr->sges[i], conn->recv.buff,
+			 conn->zone->msg_size);
+		rr->free[i] = i;
+	}
+	rr->nfree = length;
+	rr->nfree_ctrl = 0;
+	rr->posted = 0;
+
+	/* repost when a half of the buffers is in use */
+	rr->low_watermark = length / 2;
+	if (rr->low_watermark == 0)
+		rr->low_watermark = 1;
+
+	return 0;
+
+err_sges:
+	Free(rr->wrs);
+err_wrs:
+	Free(rr->free);
+	return ret;
+}
+
+static void
+recv_repost_fini(struct rpma_connection *conn)
+{
+	Free(conn->recv_repost.sges);
+	Free(conn->recv_repost.wrs);
+	Free(conn->recv_repost.free);
+}
+
+static int
+send_flow_init(struct rpma_connection *conn)
+{
+	struct rpma_send_flow *sf = &conn->send_flow;
+	uint64_t length = conn->zone->send_queue_length;
+
+	sf->signaled = Malloc(length * sizeof(*sf->signaled));
+	if (!sf->signaled)
+		return RPMA_E_ERRNO;
+
+	sf->acquired = 0;
+	sf->posted = 0;
+	sf->completed = 0;
+	sf->signal_interval = conn->zone->send_signal_interval;
+
+	/* until the peer tells otherwise */
+	sf->credits_enabled = 0;
+	sf->credits = 0;
+
+	sf->credits_owed = 0;
+	sf->credits_update_threshold = conn->zone->recv_queue_length / 2;
+	if (sf->credits_update_threshold == 0)
+		sf->credits_update_threshold = 1;
+	sf->credits_update_pending = 0;
+	sf->ctrl_reposted = 0;
+
+	/* a zero-length message carrying only the immediate data */
+	struct ibv_send_wr *wr = &sf->credits_update;
+	memset(wr, 0, sizeof(*wr));
+	wr->wr_id = (uint64_t)wr;
+	wr->next = NULL;
+	wr->sg_list = NULL;
+	wr->num_sge = 0;
+	wr->opcode = IBV_WR_SEND_WITH_IMM;
+	wr->send_flags = IBV_SEND_SIGNALED;
+
+	return 0;
+}
+
+static void
+send_flow_fini(struct rpma_connection *conn)
+{
+	Free(conn->send_flow.signaled);
+}
+
 int
 rpma_connection_msg_init(struct rpma_connection *conn)
 {
@@ -124,28 +240,41 @@ rpma_connection_msg_init(struct rpma_connection *conn)
 
 	int ret;
 
-	conn->send_buff_id = 0;
-
 	int msg_access = IBV_ACCESS_LOCAL_WRITE; /* XXX ? */
 	ret = msg_queue_init(conn, conn->zone->send_queue_length, msg_access,
 			     &send->buff);
 	if (ret)
 		return ret;
 
-	ret = msg_queue_init(conn, conn->zone->recv_queue_length, msg_access,
-			     &recv->buff);
+	ret = send_flow_init(conn);
 	if (ret)
-		goto err_recv_queue_init;
+		goto err_send_flow_init;
 
 	/* initialize msgs */
 	msg_init(&send->send, NULL, &send->sge, send->buff,
 		 conn->zone->msg_size);
-	msg_init(NULL, &recv->recv, &recv->sge, recv->buff,
-		 conn->zone->msg_size);
+
+	/* with SRQ the messages are received into the zone's buffers */
+	recv->buff = NULL;
+	if (conn->zone->srq)
+		return 0;
+
+	ret = msg_queue_init(conn, recv_buffs_num(conn), msg_access,
+			     &recv->buff);
+	if (ret)
+		goto err_recv_queue_init;
+
+	ret = recv_repost_init(conn);
+	if (ret)
+		goto err_recv_repost_init;
 
 	return 0;
 
+err_recv_repost_init:
+	(void)msg_queue_fini(conn, &conn->recv.buff);
 err_recv_queue_init:
+	send_flow_fini(conn);
+err_send_flow_init:
 	(void)msg_queue_fini(conn, &conn->send.buff);
 	return ret;
 }
@@ -154,31 +283,134 @@ int
 rpma_connection_msg_fini(struct rpma_connection *conn)
 {
 	int ret;
-	ret = msg_queue_fini(conn, &conn->recv.buff);
-	if (ret)
-		return ret;
+	if (conn->recv.buff) {
+		ret = msg_queue_fini(conn, &conn->recv.buff);
+		if (ret)
+			return ret;
+
+		recv_repost_fini(conn);
+	}
 
 	ret = msg_queue_fini(conn, &conn->send.buff);
 	if (ret)
 		return ret;
 
+	send_flow_fini(conn);
+
 	return 0;
 }
 
+/*
+ * credits_take -- (internal) take the credits owed to the peer, they are sent
+ * along with the next message
+ */
+static inline uint32_t
+credits_take(struct rpma_connection *conn)
+{
+	struct rpma_send_flow *sf = &conn->send_flow;
+
+	uint64_t credits = sf->credits_owed;
+	if (credits > RPMA_IMM_CREDITS_MAX)
+		credits = RPMA_IMM_CREDITS_MAX;
+	sf->credits_owed -= credits;
+
+	uint32_t imm = (uint32_t)credits;
+	if (sf->ctrl_reposted) {
+		sf->ctrl_reposted = 0;
+		imm |= RPMA_IMM_CTRL_REPOSTED;
+	}
+
+	return imm;
+}
+
+/*
+ * credits_untake -- (internal) give back the credits of a message which has
+ * not been posted
+ */
+static inline void
+credits_untake(struct rpma_connection *conn, uint32_t imm)
+{
+	struct rpma_send_flow *sf = &conn->send_flow;
+
+	sf->credits_owed += imm & RPMA_IMM_CREDITS_MAX;
+	if (imm & RPMA_IMM_CTRL_REPOSTED)
+		sf->ctrl_reposted = 1;
+}
+
+/*
+ * credits_update_send -- (internal) post the credit update, it consumes the
+ * reserved receive buffer of the peer
+ */
+static int
+credits_update_send(struct rpma_connection *conn)
+{
+	struct rpma_send_flow *sf = &conn->send_flow;
+
+	struct ibv_send_wr *wr = &sf->credits_update;
+	uint32_t imm = credits_take(conn);
+	wr->imm_data = htonl(RPMA_IMM_CREDITS_ONLY | imm);
+
+	struct ibv_send_wr *bad_wr;
+	int ret = ibv_post_send(conn->id->qp, wr, &bad_wr);
+	if (ret) {
+		ERR_STR(ret, "ibv_post_send");
+		credits_untake(conn, imm);
+		return -ret; /* XXX macro? */
+	}
+
+	sf->credits_update_pending = 1;
+
+	return 0;
+}
+
+/*
+ * credits_update_post -- (internal) announce the reposted receive buffers to
+ * the peer if it has not happened along with a message for a while
+ */
+static int
+credits_update_post(struct rpma_connection *conn)
+{
+	struct rpma_send_flow *sf = &conn->send_flow;
+
+	/*
+	 * a single update consumes the reserved receive buffer, the next one
+	 * has to wait until the peer confirms the buffer is posted again
+	 */
+	if (sf->credits_update_pending ||
+	    sf->credits_owed < sf->credits_update_threshold)
+		return 0;
+
+	return credits_update_send(conn);
+}
+
 int
 rpma_msg_get_ptr(struct rpma_connection *conn, void **ptr)
 {
+	struct rpma_send_flow *sf = &conn->send_flow;
+	uint64_t length = conn->zone->send_queue_length;
+
+	/* the buffer may still be in use by a send posted before */
+	if (sf->acquired - sf->completed == length && conn->cq) {
+		int ret = rpma_connection_cq_drain(conn);
+		if (ret)
+			return ret;
+	}
+
+	if (sf->acquired - sf->completed == length)
+		return -EAGAIN;
+
 	void *buff;
 	int ret = rpma_memory_local_get_ptr(conn->send.buff, &buff);
 	if (ret)
 		return ret;
 
-	uint64_t buff_id = conn->send_buff_id;
-	conn->send_buff_id = (buff_id + 1) % conn->zone->send_queue_length;
+	uint64_t buff_id = sf->acquired % length;
+	++sf->acquired;
 
 	buff = (void *)((uintptr_t)buff + buff_id * conn->zone->msg_size);
 
-	memset(buff, 0, conn->zone->msg_size);
+	if (conn->zone->flags & RPMA_CONFIG_MSG_ZERO)
+		memset(buff, 0, conn->zone->msg_size);
 
 	*ptr = buff;
 
@@ -188,39 +420,310 @@ rpma_msg_get_ptr(struct rpma_connection *conn, void **ptr)
 int
 rpma_connection_send(struct rpma_connection *conn, void *ptr)
 {
-	struct ibv_send_wr *bad_wr;
+	return rpma_connection_send_length(conn, ptr, conn->zone->msg_size);
+}
+
+int
+rpma_connection_send_length(struct rpma_connection *conn, void *ptr,
+			    size_t length)
+{
+	if (length > conn->zone->msg_size)
+		return -EINVAL;
+
+	struct rpma_send_flow *sf = &conn->send_flow;
+	uint64_t queue_length = conn->zone->send_queue_length;
+
+	int ret = rpma_connection_credit_acquire(conn);
+	if (ret)
+		return ret;
+
+	ASSERT(sf->posted < sf->acquired);
+
 	uint64_t addr = (uint64_t)ptr;
+	uint64_t buff_id = sf->posted % queue_length;
+	ASSERTeq(addr, (uint64_t)conn->send.buff->ptr +
+			       buff_id * conn->zone->msg_size);
 
 	struct rpma_msg *msg = &conn->send;
 	msg->send.wr_id = addr;
+	msg->send.imm_data = htonl(credits_take(conn));
 	msg->sge.addr = addr;
+	msg->sge.length = (uint32_t)length;
+
+	/*
+	 * the last free buffer is always signaled so the buffers cannot run
+	 * out without a completion releasing them
+	 */
+	uint64_t posted = sf->posted + 1;
+	int signaled = (posted % sf->signal_interval == 0) ||
+		(posted - sf->completed == queue_length);
+	msg->send.send_flags = signaled ? IBV_SEND_SIGNALED : 0;
+	if (length <= conn->max_inline_data)
+		msg->send.send_flags |= IBV_SEND_INLINE;
 
-	int ret = ibv_post_send(conn->id->qp, &msg->send, &bad_wr);
+	struct ibv_send_wr *bad_wr;
+	ret = ibv_post_send(conn->id->qp, &msg->send, &bad_wr);
 	if (ret) {
 		ERR_STR(ret, "ibv_post_send");
-		return ret;
+		credits_untake(conn, ntohl(msg->send.imm_data));
+		rpma_connection_credit_release(conn);
+		return -ret; /* XXX macro? */
 	}
 
-	ret = rpma_connection_cq_wait(conn, IBV_WC_SEND, addr);
-	if (ret)
-		return ret;
+	if (signaled)
+		sf->signaled[buff_id] = posted;
+	sf->posted = posted;
 
 	return 0;
 }
 
+/*
+ * rpma_connection_credit_acquire -- take a credit for a message or any other
+ * WR consuming a receive buffer of the peer
+ */
 int
-rpma_connection_recv_post(struct rpma_connection *conn, void *ptr)
+rpma_connection_credit_acquire(struct rpma_connection *conn)
+{
+	struct rpma_send_flow *sf = &conn->send_flow;
+
+	if (!sf->credits_enabled)
+		return 0;
+
+	/* the credits come along with the messages from the peer */
+	if (sf->credits == 0) {
+		int ret = rpma_connection_cq_drain(conn);
+		if (ret)
+			return ret;
+
+		if (sf->credits == 0) {
+			/*
+			 * the peer might hold back its update until it learns
+			 * its reserved buffer is back and no message is going
+			 * to tell it
+			 */
+			if (sf->ctrl_reposted && !sf->credits_update_pending)
+				(void)credits_update_send(conn);
+			return -EAGAIN;
+		}
+	}
+
+	--sf->credits;
+
+	return 0;
+}
+
+/*
+ * rpma_connection_credit_release -- give back the credit of a WR which has
+ * not been posted
+ */
+void
+rpma_connection_credit_release(struct rpma_connection *conn)
+{
+	if (conn->send_flow.credits_enabled)
+		++conn->send_flow.credits;
+}
+
+int
+rpma_connection_is_send(struct rpma_connection *conn, uint64_t wr_id)
+{
+	if (wr_id == (uint64_t)&conn->send_flow.credits_update)
+		return 1;
+
+	uintptr_t begin = (uintptr_t)conn->send.buff->ptr;
+	uintptr_t end = begin +
+		conn->zone->send_queue_length * conn->zone->msg_size;
+
+	return wr_id >= begin && wr_id < end;
+}
+
+/*
+ * rpma_connection_send_complete -- release the buffers of all the sends posted
+ * up to the signaled one
+ */
+void
+rpma_connection_send_complete(struct rpma_connection *conn, struct ibv_wc *wc)
+{
+	struct rpma_send_flow *sf = &conn->send_flow;
+
+	if (wc->status != IBV_WC_SUCCESS)
+		ERR("send failed: %s", ibv_wc_status_str(wc->status));
+
+	/*
+	 * the completion of the update does not mean the peer has reposted
+	 * the reserved buffer, the next update waits for its confirmation
+	 */
+	if (wc->wr_id == (uint64_t)&sf->credits_update)
+		return;
+
+	uintptr_t off = wc->wr_id - (uintptr_t)conn->send.buff->ptr;
+	uint64_t buff_id = off / conn->zone->msg_size;
+
+	sf->completed = sf->signaled[buff_id];
+}
+
+/*
+ * rpma_connection_recv_credits -- take the credits granted by the peer,
+ * returns 1 if the message carries nothing else
+ */
+int
+rpma_connection_recv_credits(struct rpma_connection *conn, struct ibv_wc *wc)
+{
+	if (!(wc->wc_flags & IBV_WC_WITH_IMM))
+		return 0;
+
+	uint32_t imm = ntohl(wc->imm_data);
+	struct rpma_send_flow *sf = &conn->send_flow;
+
+	if (sf->credits_enabled)
+		sf->credits += imm & RPMA_IMM_CREDITS_MAX;
+
+	if (imm & RPMA_IMM_CTRL_REPOSTED) {
+		sf->credits_update_pending = 0;
+
+		/* more credits might have been owed in the meantime */
+		if (!conn->disconnected)
+			(void)credits_update_post(conn);
+	}
+
+	if (!(imm & RPMA_IMM_CREDITS_ONLY))
+		return 0;
+
+	/*
+	 * SRQ has no reserved buffer, the update took one of the shared ones
+	 * which is released right away
+	 */
+	if (conn->zone->srq)
+		sf->ctrl_reposted = 1;
+	else
+		conn->recv_repost.nfree_ctrl++;
+
+	return 1;
+}
+
+void
+rpma_connection_pdata_init(struct rpma_connection *conn,
+			   struct rpma_conn_pdata *pdata)
 {
+	/* the receive buffers of SRQ are not tracked per connection */
+	uint64_t credits = conn->zone->srq ? 0 : conn->zone->recv_queue_length;
+
+	pdata->credits = htonl((uint32_t)credits);
+}
+
+void
+rpma_connection_pdata_apply(struct rpma_connection *conn, const void *data,
+			    uint8_t len)
+{
+	struct rpma_send_flow *sf = &conn->send_flow;
+
+	/* no private data - a peer not limiting the messages */
+	if (data == NULL || len < sizeof(struct rpma_conn_pdata))
+		return;
+
+	const struct rpma_conn_pdata *pdata = data;
+	sf->credits = ntohl(pdata->credits);
+	sf->credits_enabled = (sf->credits != 0);
+}
+
+/*
+ * recv_post_free -- (internal) post all the released buffers at once
+ */
+static int
+recv_post_free(struct rpma_connection *conn)
+{
+	struct rpma_recv_repost *rr = &conn->recv_repost;
+	if (rr->nfree == 0)
+		return 0;
+
+	uintptr_t base = (uintptr_t)conn->recv.buff->ptr;
+
+	for (uint64_t i = 0; i < rr->nfree; ++i) {
+		uint64_t addr = base + rr->free[i] * conn->zone->msg_size;
+
+		rr->sges[i].addr = addr;
+		rr->wrs[i].wr_id = addr;
+		rr->wrs[i].next = &rr->wrs[i + 1];
+	}
+	rr->wrs[rr->nfree - 1].next = NULL;
+
 	struct ibv_recv_wr *bad_wr;
-	uint64_t addr = (uint64_t)ptr;
+	int ret = ibv_post_recv(conn->id->qp, rr->wrs, &bad_wr);
+	if (ret) {
+		ERR_STR(ret, "ibv_post_recv");
+		return -ret; /* XXX macro? */
+	}
 
-	struct rpma_msg *msg = &conn->recv;
-	msg->recv.wr_id = addr;
-	msg->sge.addr = addr;
+	rr->posted += rr->nfree;
+
+	/* the credit updates are not subject to the flow control */
+	conn->send_flow.credits_owed += rr->nfree - rr->nfree_ctrl;
+	if (rr->nfree_ctrl)
+		conn->send_flow.ctrl_reposted = 1;
+
+	rr->nfree = 0;
+	rr->nfree_ctrl = 0;
+
+	return 0;
+}
 
-	int ret = ibv_post_recv(conn->id->qp, &msg->recv, &bad_wr);
+int
+rpma_connection_recv_post_all(struct rpma_connection *conn)
+{
+	/* the receive buffers are posted to SRQ by the zone */
+	if (conn->zone->srq)
+		return 0;
+
+	int ret = recv_post_free(conn);
 	if (ret)
-		return -ret; /* XXX macro? */
+		return ret;
+
+	/* the peer learns about the initial buffers from the private data */
+	conn->send_flow.credits_owed = 0;
 
 	return 0;
 }
+
+/*
+ * rpma_connection_recv_consumed -- note a receive completion took a buffer
+ */
+void
+rpma_connection_recv_consumed(struct rpma_connection *conn)
+{
+	if (conn->zone->srq) {
+		rpma_srq_recv_consumed(conn->zone->srq);
+		return;
+	}
+
+	ASSERT(conn->recv_repost.posted > 0);
+	--conn->recv_repost.posted;
+}
+
+int
+rpma_connection_recv_release(struct rpma_connection *conn, void *ptr)
+{
+	if (conn->zone->srq)
+		return rpma_srq_recv_release(conn->zone->srq, ptr);
+
+	struct rpma_recv_repost *rr = &conn->recv_repost;
+	uintptr_t off = (uintptr_t)ptr - (uintptr_t)conn->recv.buff->ptr;
+	uint64_t id = off / conn->zone->msg_size;
+
+	ASSERT(id < recv_buffs_num(conn));
+	ASSERT(rr->nfree < recv_buffs_num(conn));
+
+	rr->free[rr->nfree++] = id;
+
+	/* the buffers are no longer needed after the disconnection */
+	if (conn->disconnected)
+		return 0;
+
+	/* the reserved buffer has to be back before the next update comes */
+	if (rr->posted >= rr->low_watermark && rr->nfree_ctrl == 0)
+		return 0;
+
+	int ret = recv_post_free(conn);
+	if (ret)
+		return ret;
+
+	return credits_update_post(conn);
+}
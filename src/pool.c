@@ -0,0 +1,224 @@
+/*
+ * Copyright 2020, Intel Corporation
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in
+ *       the documentation and/or other materials provided with the
+ *       distribution.
+ *
+ *     * Neither the name of the copyright holder nor the names of its
+ *       contributors may be used to endorse or promote products derived
+ *       from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * pool.c -- librpma object pool implementation
+ *
+ * The objects are allocated a slab at a time and never freed until the pool
+ * is destroyed. The owner is expected to call rpma_pool_refill() from
+ * a non-critical path so rpma_pool_get() does not have to allocate.
+ */
+
+#include "alloc.h"
+#include "pool.h"
+#include "rpma_utils.h"
+#include "util.h"
+
+/* the header of each slab, the objects follow it */
+struct rpma_pool_slab {
+	struct rpma_pool_slab *next;
+	uint64_t nobjs;
+};
+
+/* the objects are aligned at least as well as the slab header */
+#define POOL_OBJ_ALIGN sizeof(struct rpma_pool_slab)
+
+/*
+ * slab_new -- (internal) allocate a slab and chain its objects into a list
+ */
+static struct rpma_pool_slab *
+slab_new(size_t obj_size, uint64_t nobjs, void **first, void **last)
+{
+	struct rpma_pool_slab *slab = Malloc(sizeof(*slab) + nobjs * obj_size);
+	if (!slab)
+		return NULL;
+
+	slab->next = NULL;
+	slab->nobjs = nobjs;
+
+	char *objs = (char *)(slab + 1);
+	for (uint64_t i = 0; i < nobjs - 1; ++i)
+		*(void **)(objs + i * obj_size) = objs + (i + 1) * obj_size;
+	*(void **)(objs + (nobjs - 1) * obj_size) = NULL;
+
+	*first = objs;
+	*last = objs + (nobjs - 1) * obj_size;
+
+	return slab;
+}
+
+/*
+ * slab_link -- (internal) add the slab objects to the free list, the caller
+ * holds the lock
+ */
+static void
+slab_link(struct rpma_pool *pool, struct rpma_pool_slab *slab, void *first,
+	  void *last)
+{
+	slab->next = pool->slabs;
+	pool->slabs = slab;
+
+	*(void **)last = pool->free_list;
+	pool->free_list = first;
+	pool->nfree += slab->nobjs;
+	pool->nobjs += slab->nobjs;
+}
+
+/*
+ * pool_grow -- (internal) add a slab to the pool, the caller holds the lock
+ */
+static int
+pool_grow(struct rpma_pool *pool)
+{
+	void *first;
+	void *last;
+	struct rpma_pool_slab *slab =
+		slab_new(pool->obj_size, pool->slab_size, &first, &last);
+	if (!slab)
+		return RPMA_E_ERRNO;
+
+	slab_link(pool, slab, first, last);
+
+	return 0;
+}
+
+int
+rpma_pool_init(struct rpma_pool *pool, size_t obj_size, uint64_t slab_size)
+{
+	ASSERTne(slab_size, 0);
+
+	/* each free object keeps the pointer to the next one */
+	if (obj_size < sizeof(void *))
+		obj_size = sizeof(void *);
+
+	pool->obj_size = ALIGN_UP(obj_size, POOL_OBJ_ALIGN);
+	pool->slab_size = slab_size;
+	pool->low_watermark = slab_size / 4;
+	pool->free_list = NULL;
+	pool->nfree = 0;
+	pool->nused = 0;
+	pool->high_water = 0;
+	pool->nobjs = 0;
+	pool->slabs = NULL;
+
+	int ret = pool_grow(pool);
+	if (ret)
+		return ret;
+
+	os_mutex_init(&pool->lock);
+
+	return 0;
+}
+
+void
+rpma_pool_fini(struct rpma_pool *pool)
+{
+	while (pool->slabs) {
+		struct rpma_pool_slab *slab = pool->slabs;
+		pool->slabs = slab->next;
+		Free(slab);
+	}
+
+	os_mutex_destroy(&pool->lock);
+}
+
+void *
+rpma_pool_get(struct rpma_pool *pool)
+{
+	void *obj = NULL;
+
+	os_mutex_lock(&pool->lock);
+
+	/* refilling has not kept up - grow right away */
+	if (!pool->free_list && pool_grow(pool))
+		goto out_unlock;
+
+	obj = pool->free_list;
+	pool->free_list = *(void **)obj;
+	--pool->nfree;
+
+	if (++pool->nused > pool->high_water)
+		pool->high_water = pool->nused;
+
+out_unlock:
+	os_mutex_unlock(&pool->lock);
+	return obj;
+}
+
+void
+rpma_pool_put(struct rpma_pool *pool, void *obj)
+{
+	os_mutex_lock(&pool->lock);
+
+	*(void **)obj = pool->free_list;
+	pool->free_list = obj;
+	++pool->nfree;
+	--pool->nused;
+
+	os_mutex_unlock(&pool->lock);
+}
+
+/*
+ * rpma_pool_refill -- grow the pool if the free objects are about to run out
+ */
+int
+rpma_pool_refill(struct rpma_pool *pool)
+{
+	uint64_t nfree;
+	util_atomic_load_explicit64(&pool->nfree, &nfree, memory_order_relaxed);
+	if (nfree >= pool->low_watermark)
+		return 0;
+
+	/* the slab is allocated without holding the lock */
+	void *first;
+	void *last;
+	struct rpma_pool_slab *slab =
+		slab_new(pool->obj_size, pool->slab_size, &first, &last);
+	if (!slab)
+		return RPMA_E_ERRNO;
+
+	os_mutex_lock(&pool->lock);
+	slab_link(pool, slab, first, last);
+	os_mutex_unlock(&pool->lock);
+
+	return 0;
+}
+
+void
+rpma_pool_get_stats(struct rpma_pool *pool, uint64_t *high_water,
+		    uint64_t *nobjs)
+{
+	os_mutex_lock(&pool->lock);
+	*high_water = pool->high_water;
+	*nobjs = pool->nobjs;
+	os_mutex_unlock(&pool->lock);
+}
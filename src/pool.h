@@ -0,0 +1,73 @@
+/*
+ * Copyright 2020, Intel Corporation
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in
+ *       the documentation and/or other materials provided with the
+ *       distribution.
+ *
+ *     * Neither the name of the copyright holder nor the names of its
+ *       contributors may be used to endorse or promote products derived
+ *       from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * pool.h -- internal definitions for the librpma object pool
+ */
+#ifndef RPMA_POOL_H
+#define RPMA_POOL_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "os_thread.h"
+
+struct rpma_pool_slab;
+
+/* a free list of fixed-size objects carved out of slabs */
+struct rpma_pool {
+	size_t obj_size;
+	uint64_t slab_size;	/* # of objects per slab */
+	uint64_t low_watermark; /* the pool grows before it runs out */
+
+	os_mutex_t lock;
+	void *free_list;
+	uint64_t nfree;
+	uint64_t nused;
+	uint64_t high_water; /* max # of the objects used at once */
+	uint64_t nobjs;
+	struct rpma_pool_slab *slabs;
+};
+
+int rpma_pool_init(struct rpma_pool *pool, size_t obj_size,
+		   uint64_t slab_size);
+void rpma_pool_fini(struct rpma_pool *pool);
+
+void *rpma_pool_get(struct rpma_pool *pool);
+void rpma_pool_put(struct rpma_pool *pool, void *obj);
+
+int rpma_pool_refill(struct rpma_pool *pool);
+
+void rpma_pool_get_stats(struct rpma_pool *pool, uint64_t *high_water,
+			 uint64_t *nobjs);
+
+#endif /* pool.h */
@@ -34,9 +34,12 @@
  * rma.c -- entry points for librpma RMA
  */
 
+#include <arpa/inet.h>
 #include <errno.h>
+#include <sched.h>
 
 #include "alloc.h"
+#include "config.h"
 #include "connection.h"
 #include "memory.h"
 #include "rpma_utils.h"
@@ -44,6 +47,7 @@
 
 #define RAW_BUFF_SIZE 4096
 #define RAW_SIZE 8
+#define ATOMIC_SIZE 8
 
 static int
 raw_buffer_init(struct rpma_connection *conn)
@@ -84,127 +88,1542 @@ raw_buffer_fini(struct rpma_connection *conn)
 	return 0;
 }
 
+static int
+ops_init(struct rpma_connection *conn)
+{
+	struct rpma_rma *rma = &conn->rma;
+
+	rma->ops_size = conn->zone->rma_queue_length;
+	rma->ops = Malloc(rma->ops_size * sizeof(*rma->ops));
+	if (!rma->ops)
+		return RPMA_E_ERRNO;
+
+	int ret;
+
+	rma->ops_free = Malloc(rma->ops_size * sizeof(*rma->ops_free));
+	if (!rma->ops_free) {
+		ret = RPMA_E_ERRNO;
+		goto err_ops_free;
+	}
+
+	rma->done = Malloc(rma->ops_size * sizeof(*rma->done));
+	if (!rma->done) {
+		ret = RPMA_E_ERRNO;
+		goto err_done;
+	}
+
+	/* one more for the flushing read */
+	uint64_t chain_size = rma->ops_size + 1;
+
+	rma->chain_wrs = Malloc(chain_size * sizeof(*rma->chain_wrs));
+	if (!rma->chain_wrs) {
+		ret = RPMA_E_ERRNO;
+		goto err_chain_wrs;
+	}
+
+	rma->chain_sges = Malloc(chain_size * sizeof(*rma->chain_sges));
+	if (!rma->chain_sges) {
+		ret = RPMA_E_ERRNO;
+		goto err_chain_sges;
+	}
+
+	for (uint64_t i = 0; i < rma->ops_size; ++i)
+		rma->ops_free[i] = rma->ops_size - 1 - i;
+	rma->ops_nfree = rma->ops_size;
+	rma->wrs_avail = rma->ops_size;
+	rma->unsignaled_charged = 0;
+	rma->unsignaled_released = 0;
+	rma->release_pending = 0;
+
+	rma->done_head = 0;
+	rma->done_num = 0;
+
+	return 0;
+
+err_chain_sges:
+	Free(rma->chain_wrs);
+err_chain_wrs:
+	Free(rma->done);
+err_done:
+	Free(rma->ops_free);
+err_ops_free:
+	Free(rma->ops);
+	return ret;
+}
+
+static void
+ops_fini(struct rpma_connection *conn)
+{
+	Free(conn->rma.chain_sges);
+	Free(conn->rma.chain_wrs);
+	Free(conn->rma.done);
+	Free(conn->rma.ops_free);
+	Free(conn->rma.ops);
+}
+
+/*
+ * op_get_wrs -- (internal) take a free op slot completing nwr WRs, its address
+ * is used as wr_id of the last (signaled) one
+ */
+static int
+op_get_wrs(struct rpma_connection *conn, int op, void *op_context,
+	   uint64_t nwr, uint64_t *wr_id)
+{
+	struct rpma_rma *rma = &conn->rma;
+
+	if (rma->ops_nfree == 0 || rma->wrs_avail < nwr)
+		return -EAGAIN;
+
+	uint64_t id = rma->ops_free[--rma->ops_nfree];
+	struct rpma_op *rop = &rma->ops[id];
+	rop->op_context = op_context;
+	rop->op = op;
+	rop->status = 0;
+	rop->nwr = nwr;
+	rop->unsignaled = rma->unsignaled_charged;
+
+	rma->wrs_avail -= nwr;
+
+	*wr_id = (uint64_t)rop;
+
+	return 0;
+}
+
+/*
+ * op_get -- (internal) take a free op slot, its address is used as wr_id
+ */
+static inline int
+op_get(struct rpma_connection *conn, int op, void *op_context,
+       uint64_t *wr_id)
+{
+	return op_get_wrs(conn, op, op_context, 1, wr_id);
+}
+
+/*
+ * ops_in_flight -- (internal) whether any of the taken op slots is going to
+ * complete, the completed ones wait for the user to reap them
+ */
+static inline int
+ops_in_flight(struct rpma_connection *conn)
+{
+	struct rpma_rma *rma = &conn->rma;
+
+	return rma->ops_size - rma->ops_nfree > rma->done_num;
+}
+
+/*
+ * op_get_sync -- (internal) take a free op slot for a blocking op, wait for
+ * the ops in flight to make room for it
+ */
+static int
+op_get_sync(struct rpma_connection *conn, int op, uint64_t nwr,
+	    uint64_t *wr_id)
+{
+	int ret;
+
+	while (1) {
+		ret = op_get_wrs(conn, op, NULL, nwr, wr_id);
+		if (ret != -EAGAIN)
+			return ret;
+
+		/* nothing is going to give a slot back */
+		if (conn->disconnected ||
+		    !(ops_in_flight(conn) || conn->rma.release_pending))
+			return -EAGAIN;
+
+		ret = rpma_connection_cq_drain(conn);
+		if (ret)
+			return ret;
+	}
+}
+
+/*
+ * op_put -- (internal) give the op slot back
+ */
+static void
+op_put(struct rpma_connection *conn, uint64_t wr_id)
+{
+	struct rpma_rma *rma = &conn->rma;
+	struct rpma_op *rop = (struct rpma_op *)wr_id;
+
+	rma->ops_free[rma->ops_nfree++] = (uint64_t)(rop - rma->ops);
+	rma->wrs_avail += rop->nwr;
+}
+
+/*
+ * unsignaled_get -- (internal) charge an unsignaled WR against the RMA queue,
+ * the WR taking the last slot is signaled unless a release is in flight
+ * already, the completion of the release makes room for the next ones anyway
+ */
+static int
+unsignaled_get(struct rpma_connection *conn, uint64_t *wr_id, unsigned *flags)
+{
+	struct rpma_rma *rma = &conn->rma;
+
+	if (rma->wrs_avail == 0) {
+		/* the signaled WRs in flight are going to release some */
+		int ret = rpma_connection_cq_drain(conn);
+		if (ret)
+			return ret;
+
+		if (rma->wrs_avail == 0)
+			return -EAGAIN;
+	}
+
+	--rma->wrs_avail;
+	++rma->unsignaled_charged;
+
+	*wr_id = 0;
+	*flags = 0;
+
+	if (rma->wrs_avail == 0 && !rma->release_pending) {
+		rma->release.op_context = NULL;
+		rma->release.status = 0;
+		rma->release.nwr = 0;
+		rma->release.unsignaled = rma->unsignaled_charged;
+		rma->release_pending = 1;
+
+		*wr_id = (uint64_t)&rma->release;
+		*flags = IBV_SEND_SIGNALED;
+	}
+
+	return 0;
+}
+
+/*
+ * unsignaled_put -- (internal) give back the slot of a WR which has not been
+ * posted
+ */
+static void
+unsignaled_put(struct rpma_connection *conn, uint64_t wr_id)
+{
+	struct rpma_rma *rma = &conn->rma;
+
+	if (wr_id)
+		rma->release_pending = 0;
+
+	--rma->unsignaled_charged;
+	++rma->wrs_avail;
+}
+
+/*
+ * rpma_connection_rma_wrs_release -- give back the slots of all the
+ * unsignaled WRs posted before the completed op
+ */
+void
+rpma_connection_rma_wrs_release(struct rpma_connection *conn, uint64_t wr_id)
+{
+	struct rpma_rma *rma = &conn->rma;
+	struct rpma_op *rop = (struct rpma_op *)wr_id;
+
+	if (rop->unsignaled <= rma->unsignaled_released)
+		return;
+
+	rma->wrs_avail += rop->unsignaled - rma->unsignaled_released;
+	rma->unsignaled_released = rop->unsignaled;
+}
+
 int
-rpma_connection_rma_init(struct rpma_connection *conn)
+rpma_connection_rma_is_op(struct rpma_connection *conn, uint64_t wr_id)
 {
-	/* initialize RMA msg */
-	struct ibv_send_wr *wr = &conn->rma.wr;
-	struct ibv_sge *sge = &conn->rma.sge;
+	uintptr_t begin = (uintptr_t)conn->rma.ops;
+	uintptr_t end = (uintptr_t)(conn->rma.ops + conn->rma.ops_size);
+
+	if (wr_id == (uintptr_t)&conn->rma.release)
+		return 1;
+
+	return wr_id >= begin && wr_id < end;
+}
+
+/*
+ * op_done -- (internal) queue the op to be reaped by rpma_connection_poll()
+ */
+static void
+op_done(struct rpma_connection *conn, struct rpma_op *rop)
+{
+	struct rpma_rma *rma = &conn->rma;
+
+	/* an op slot is held until reaped so the ring cannot overflow */
+	ASSERT(rma->done_num < rma->ops_size);
+
+	uint64_t tail = (rma->done_head + rma->done_num) % rma->ops_size;
+	rma->done[tail] = (uint64_t)(rop - rma->ops);
+	++rma->done_num;
+}
+
+/*
+ * rpma_connection_rma_complete -- mark the op as completed so it can be
+ * reaped by rpma_connection_poll()
+ */
+void
+rpma_connection_rma_complete(struct rpma_connection *conn, struct ibv_wc *wc)
+{
+	struct rpma_rma *rma = &conn->rma;
+	struct rpma_op *rop = (struct rpma_op *)wc->wr_id;
+
+	if (wc->status != IBV_WC_SUCCESS) {
+		ERR("op failed: %s", ibv_wc_status_str(wc->status));
+		rop->status = RPMA_E_OP_FAILED;
+	}
+
+	rpma_connection_rma_wrs_release(conn, wc->wr_id);
+
+	/* the release is not reported, the writes have no op context */
+	if (rop == &rma->release) {
+		rma->release_pending = 0;
+		return;
+	}
+
+	op_done(conn, rop);
+}
+
+/*
+ * dirty_mark -- (internal) remember the remote region has to be flushed
+ */
+static int
+dirty_mark(struct rpma_dirty *dirty, struct rpma_memory_remote *remote)
+{
+	/* usually the same few regions are written over and over */
+	for (uint64_t i = dirty->num; i > 0; --i) {
+		if (dirty->regions[i - 1] == remote)
+			return 0;
+	}
+
+	if (dirty->num == dirty->size) {
+		uint64_t size = dirty->size ? 2 * dirty->size : 4;
+		void *regions =
+			Realloc(dirty->regions, size * sizeof(*dirty->regions));
+		if (!regions)
+			return RPMA_E_ERRNO;
+
+		dirty->regions = regions;
+		dirty->size = size;
+	}
 
+	dirty->regions[dirty->num++] = remote;
+
+	return 0;
+}
+
+static void
+dirty_init(struct rpma_dirty *dirty)
+{
+	dirty->regions = NULL;
+	dirty->num = 0;
+	dirty->size = 0;
+}
+
+static void
+dirty_fini(struct rpma_dirty *dirty)
+{
+	Free(dirty->regions);
+}
+
+/*
+ * wr_init -- (internal) initialize RMA WR using the single SGE
+ */
+static void
+wr_init(struct ibv_send_wr *wr, struct ibv_sge *sge)
+{
 	memset(wr, 0, sizeof(*wr));
 	wr->wr_id = 0;
 	wr->next = NULL;
 	wr->sg_list = sge;
 	wr->num_sge = 1;
+}
+
+/*
+ * lanes_init -- (internal) allocate the lanes of the connection
+ */
+static int
+lanes_init(struct rpma_connection *conn)
+{
+	conn->nlanes = conn->zone->nlanes;
+	conn->lanes = NULL;
+
+	if (conn->nlanes == 0)
+		return 0;
+
+	conn->lanes = Malloc(conn->nlanes * sizeof(*conn->lanes));
+	if (!conn->lanes)
+		return RPMA_E_ERRNO;
+
+	for (uint64_t i = 0; i < conn->nlanes; ++i) {
+		struct rpma_lane *lane = &conn->lanes[i];
+
+		wr_init(&lane->wr, &lane->sge);
+		dirty_init(&lane->dirty);
+		lane->nposted = 0;
+		lane->drained = 0;
+		lane->status = 0;
+	}
 
-	return raw_buffer_init(conn);
+	return 0;
 }
 
-int
-rpma_connection_rma_fini(struct rpma_connection *conn)
+static void
+lanes_fini(struct rpma_connection *conn)
 {
-	return raw_buffer_fini(conn);
+	if (conn->nlanes == 0)
+		return;
+
+	for (uint64_t i = 0; i < conn->nlanes; ++i)
+		dirty_fini(&conn->lanes[i].dirty);
+
+	Free(conn->lanes);
 }
 
 int
-rpma_connection_read(struct rpma_connection *conn,
-		     struct rpma_memory_local *dst, size_t dst_off,
-		     struct rpma_memory_remote *src, size_t src_off,
-		     size_t length)
+rpma_connection_rma_init(struct rpma_connection *conn)
 {
-	//	ASSERT(length < conn->zone->info->ep_attr->max_msg_size); /* XXX
-	//*/
-	ASSERT(length < UINT32_MAX);
+	/* initialize RMA msg */
+	wr_init(&conn->rma.wr, &conn->rma.sge);
+	dirty_init(&conn->rma.dirty);
 
-	/* XXX WQ flush */
+	int ret = ops_init(conn);
+	if (ret)
+		return ret;
 
-	uint64_t dst_addr = (uint64_t)((uintptr_t)dst->ptr + dst_off);
+	ret = raw_buffer_init(conn);
+	if (ret)
+		goto err_raw_buffer_init;
 
-	struct ibv_send_wr *wr = &conn->rma.wr;
-	struct ibv_sge *sge = &conn->rma.sge;
+	ret = lanes_init(conn);
+	if (ret)
+		goto err_lanes_init;
 
-	/* src */
-	wr->wr.rdma.remote_addr = src->raddr + src_off;
-	wr->wr.rdma.rkey = src->rkey;
+	return 0;
 
-	/* dst */
-	sge->addr = dst_addr;
-	sge->length = (uint32_t)length;
-	sge->lkey = dst->mr->lkey;
+err_lanes_init:
+	(void)raw_buffer_fini(conn);
+err_raw_buffer_init:
+	ops_fini(conn);
+	return ret;
+}
 
-	wr->wr_id = dst_addr;
-	wr->opcode = IBV_WR_RDMA_READ;
-	wr->send_flags = IBV_SEND_SIGNALED;
+int
+rpma_connection_rma_fini(struct rpma_connection *conn)
+{
+	int ret = raw_buffer_fini(conn);
+	if (ret)
+		return ret;
 
+	lanes_fini(conn);
+	ops_fini(conn);
+	dirty_fini(&conn->rma.dirty);
+
+	return 0;
+}
+
+/*
+ * chain_post -- (internal) post the chain of WRs at once
+ */
+static int
+chain_post(struct rpma_connection *conn, struct ibv_send_wr *wrs)
+{
 	struct ibv_send_wr *bad_wr;
-	int ret = ibv_post_send(conn->id->qp, wr, &bad_wr);
+	int ret = ibv_post_send(conn->id->qp, wrs, &bad_wr);
 	if (ret) {
 		ERR_STR(ret, "ibv_post_send");
-		return ret;
+		return -ret;
 	}
 
-	ret = rpma_connection_cq_wait(conn, IBV_WC_RDMA_READ, dst_addr);
-	if (ret)
-		return ret;
-
 	return 0;
 }
 
-int
-rpma_connection_write(struct rpma_connection *conn,
-		      struct rpma_memory_remote *dst, size_t dst_off,
-		      struct rpma_memory_local *src, size_t src_off,
-		      size_t length)
+/*
+ * wr_post -- (internal) post a single RDMA read or write using the WR provided
+ */
+static int
+wr_post(struct rpma_connection *conn, struct ibv_send_wr *wr,
+	enum ibv_wr_opcode opcode, struct ibv_sge *sgl, int num_sge,
+	struct rpma_memory_remote *remote, size_t remote_off, size_t length,
+	uint64_t wr_id, unsigned flags)
 {
 	//	ASSERT(length < conn->zone->info->ep_attr->max_msg_size); /* XXX
 	//*/
 	ASSERT(length < UINT32_MAX);
 
-	/* XXX WQ flush */
+	/* the WR may be a part of a chain posted before */
+	wr->next = NULL;
+
+	/* local */
+	wr->sg_list = sgl;
+	wr->num_sge = num_sge;
 
-	uint64_t src_addr = (uint64_t)((uintptr_t)src->ptr + src_off);
+	/* remote */
+	wr->wr.rdma.remote_addr = remote->raddr + remote_off;
+	wr->wr.rdma.rkey = remote->rkey;
 
-	struct ibv_send_wr *wr = &conn->rma.wr;
+	wr->wr_id = wr_id;
+	wr->opcode = opcode;
+	wr->send_flags = flags;
+
+	/* the data is copied so the local buffer may be reused at once */
+	if ((opcode == IBV_WR_RDMA_WRITE ||
+	     opcode == IBV_WR_RDMA_WRITE_WITH_IMM) &&
+	    length <= conn->max_inline_data)
+		wr->send_flags |= IBV_SEND_INLINE;
+
+	return chain_post(conn, wr);
+}
+
+/*
+ * rma_post_sgl -- (internal) post a single RDMA read or write scattering to
+ * or gathering from the list of local segments
+ */
+static int
+rma_post_sgl(struct rpma_connection *conn, enum ibv_wr_opcode opcode,
+	     struct ibv_sge *sgl, int num_sge,
+	     struct rpma_memory_remote *remote, size_t remote_off,
+	     size_t length, uint64_t wr_id, unsigned flags)
+{
+	if (opcode == IBV_WR_RDMA_WRITE) {
+		int ret = dirty_mark(&conn->rma.dirty, remote);
+		if (ret)
+			return ret;
+	}
+
+	return wr_post(conn, &conn->rma.wr, opcode, sgl, num_sge, remote,
+		       remote_off, length, wr_id, flags);
+}
+
+/*
+ * rma_post -- (internal) post a single RDMA read or write
+ */
+static int
+rma_post(struct rpma_connection *conn, enum ibv_wr_opcode opcode,
+	 struct rpma_memory_local *local, size_t local_off,
+	 struct rpma_memory_remote *remote, size_t remote_off, size_t length,
+	 uint64_t wr_id, unsigned flags)
+{
 	struct ibv_sge *sge = &conn->rma.sge;
 
-	/* src */
-	sge->addr = src_addr;
+	sge->addr = (uint64_t)((uintptr_t)local->ptr + local_off);
 	sge->length = (uint32_t)length;
-	sge->lkey = src->mr->lkey;
+	sge->lkey = local->mr->lkey;
 
-	/* dst */
-	wr->wr.rdma.remote_addr = dst->raddr + dst_off;
-	wr->wr.rdma.rkey = dst->rkey;
+	return rma_post_sgl(conn, opcode, sge, 1, remote, remote_off, length,
+			    wr_id, flags);
+}
 
-	wr->wr_id = 0;
-	wr->opcode = IBV_WR_RDMA_WRITE;
-	wr->send_flags = 0; /* !IBV_SEND_SIGNALED */
+/*
+ * sgl_init -- (internal) translate the segments into the scatter-gather list
+ */
+static int
+sgl_init(struct rpma_connection *conn, const struct rpma_sge *segs,
+	 int num_segs, struct ibv_sge *sgl, size_t *length)
+{
+	if (num_segs <= 0 || num_segs > conn->zone->max_sge)
+		return -EINVAL;
 
-	struct ibv_send_wr *bad_wr;
-	int ret = ibv_post_send(conn->id->qp, wr, &bad_wr);
-	if (ret) {
-		ERR_STR(ret, "ibv_post_send");
-		return ret;
+	size_t total = 0;
+
+	for (int i = 0; i < num_segs; ++i) {
+		struct rpma_memory_local *mem = segs[i].mem;
+
+		ASSERT(segs[i].length < UINT32_MAX);
+
+		sgl[i].addr = (uint64_t)((uintptr_t)mem->ptr + segs[i].offset);
+		sgl[i].length = (uint32_t)segs[i].length;
+		sgl[i].lkey = mem->mr->lkey;
+
+		total += segs[i].length;
 	}
 
-	conn->rma.raw_src = dst; /* XXX */
+	*length = total;
 
 	return 0;
 }
 
 int
-rpma_connection_atomic_write(struct rpma_connection *conn,
-			     struct rpma_memory_remote *dst, size_t dst_off,
-			     struct rpma_memory_local *src, size_t src_off,
-			     size_t length)
+rpma_connection_read(struct rpma_connection *conn,
+		     struct rpma_memory_local *dst, size_t dst_off,
+		     struct rpma_memory_remote *src, size_t src_off,
+		     size_t length)
 {
-	/* XXX */
-	return rpma_connection_write(conn, dst, dst_off, src, src_off, length);
+	uint64_t wr_id;
+	int ret = op_get_sync(conn, RPMA_OP_READ, 1, &wr_id);
+	if (ret)
+		return ret;
+
+	ret = rma_post(conn, IBV_WR_RDMA_READ, dst, dst_off, src, src_off,
+		       length, wr_id, IBV_SEND_SIGNALED);
+	if (ret)
+		goto err_op_put;
+
+	ret = rpma_connection_cq_wait(conn, IBV_WC_RDMA_READ, wr_id);
+
+err_op_put:
+	op_put(conn, wr_id);
+	return ret;
 }
 
 int
-rpma_connection_commit(struct rpma_connection *conn)
+rpma_connection_write(struct rpma_connection *conn,
+		      struct rpma_memory_remote *dst, size_t dst_off,
+		      struct rpma_memory_local *src, size_t src_off,
+		      size_t length)
+{
+	uint64_t wr_id;
+	unsigned flags;
+	int ret = unsignaled_get(conn, &wr_id, &flags);
+	if (ret)
+		return ret;
+
+	ret = rma_post(conn, IBV_WR_RDMA_WRITE, src, src_off, dst, dst_off,
+		       length, wr_id, flags);
+	if (ret)
+		unsignaled_put(conn, wr_id);
+
+	return ret;
+}
+
+int
+rpma_connection_write_notify(struct rpma_connection *conn,
+			     struct rpma_memory_remote *dst, size_t dst_off,
+			     struct rpma_memory_local *src, size_t src_off,
+			     size_t length)
+{
+	/* the offset is passed to the peer as the immediate data */
+	if (dst_off > UINT32_MAX)
+		return -EINVAL;
+
+	/* the write consumes a receive buffer of the peer */
+	int ret = rpma_connection_credit_acquire(conn);
+	if (ret)
+		return ret;
+
+	uint64_t wr_id;
+	unsigned flags;
+	ret = unsignaled_get(conn, &wr_id, &flags);
+	if (ret)
+		goto err_credit_release;
+
+	ret = dirty_mark(&conn->rma.dirty, dst);
+	if (ret)
+		goto err_unsignaled_put;
+
+	struct ibv_sge *sge = &conn->rma.sge;
+	sge->addr = (uint64_t)((uintptr_t)src->ptr + src_off);
+	sge->length = (uint32_t)length;
+	sge->lkey = src->mr->lkey;
+
+	conn->rma.wr.imm_data = htonl((uint32_t)dst_off);
+
+	ret = wr_post(conn, &conn->rma.wr, IBV_WR_RDMA_WRITE_WITH_IMM, sge, 1,
+		      dst, dst_off, length, wr_id, flags);
+	if (ret)
+		goto err_unsignaled_put;
+
+	return 0;
+
+err_unsignaled_put:
+	unsignaled_put(conn, wr_id);
+err_credit_release:
+	rpma_connection_credit_release(conn);
+	return ret;
+}
+
+/*
+ * rpma_connection_recv_notify -- pass the region written by the peer with
+ * immediate to the notify callback
+ */
+int
+rpma_connection_recv_notify(struct rpma_connection *conn, struct ibv_wc *wc)
+{
+	struct rpma_memory_local *mem = conn->notify_mem;
+	size_t off = ntohl(wc->imm_data);
+
+	if (!conn->on_transmission_notify_func)
+		return 0;
+
+	if (!mem || off + wc->byte_len > mem->size) {
+		ERR("write notification out of the notify memory");
+		return -EINVAL;
+	}
+
+	return conn->on_transmission_notify_func(conn, (char *)mem->ptr + off,
+						 wc->byte_len,
+						 conn->custom_data);
+}
+
+#ifdef NATIVE_ATOMIC_WRITE_SUPPORTED
+/*
+ * atomic_write_post_native -- (internal) post IBV_WR_ATOMIC_WRITE, the 8 bytes
+ * are copied to the WR so the source may be reused at once
+ */
+static int
+atomic_write_post_native(struct rpma_connection *conn,
+			 struct rpma_memory_remote *dst, size_t dst_off,
+			 const void *src)
+{
+	struct ibv_qp_ex *qpx = conn->qpx;
+
+	uint64_t wr_id;
+	unsigned flags;
+	int ret = unsignaled_get(conn, &wr_id, &flags);
+	if (ret)
+		return ret;
+
+	ret = dirty_mark(&conn->rma.dirty, dst);
+	if (ret)
+		goto err_unsignaled_put;
+
+	ibv_wr_start(qpx);
+
+	qpx->wr_id = wr_id;
+	qpx->wr_flags = flags;
+	ibv_wr_atomic_write(qpx, dst->rkey, dst->raddr + dst_off, src);
+
+	ret = ibv_wr_complete(qpx);
+	if (ret) {
+		ERR_STR(ret, "ibv_wr_complete");
+		ret = -ret;
+		goto err_unsignaled_put;
+	}
+
+	return 0;
+
+err_unsignaled_put:
+	unsignaled_put(conn, wr_id);
+	return ret;
+}
+#endif
+
+int
+rpma_connection_atomic_write(struct rpma_connection *conn,
+			     struct rpma_memory_remote *dst, size_t dst_off,
+			     struct rpma_memory_local *src, size_t src_off,
+			     size_t length)
+{
+	if (length != ATOMIC_SIZE || dst_off % ATOMIC_SIZE)
+		return -EINVAL;
+
+#ifdef NATIVE_ATOMIC_WRITE_SUPPORTED
+	if (conn->native_atomic_write)
+		return atomic_write_post_native(conn, dst, dst_off,
+						(char *)src->ptr + src_off);
+#endif
+
+	/*
+	 * nothing guarantees a plain RDMA write is placed in the remote memory
+	 * at once, it might be observed torn
+	 */
+	return RPMA_E_NOSUPP;
+}
+
+/*
+ * atomic_post -- (internal) post a signaled remote atomic op, the original
+ * value of the remote 8 bytes is stored in the result
+ */
+static int
+atomic_post(struct rpma_connection *conn, enum ibv_wr_opcode opcode,
+	    struct rpma_memory_remote *dst, size_t dst_off,
+	    uint64_t compare_add, uint64_t swap,
+	    struct rpma_memory_local *result, size_t result_off,
+	    uint64_t wr_id)
+{
+	struct ibv_sge *sge = &conn->rma.sge;
+	struct ibv_send_wr *wr = &conn->rma.wr;
+
+	sge->addr = (uint64_t)((uintptr_t)result->ptr + result_off);
+	sge->length = ATOMIC_SIZE;
+	sge->lkey = result->mr->lkey;
+
+	wr->sg_list = sge;
+	wr->num_sge = 1;
+
+	wr->wr.atomic.remote_addr = dst->raddr + dst_off;
+	wr->wr.atomic.compare_add = compare_add;
+	wr->wr.atomic.swap = swap;
+	wr->wr.atomic.rkey = dst->rkey;
+
+	wr->wr_id = wr_id;
+	wr->opcode = opcode;
+	wr->send_flags = IBV_SEND_SIGNALED;
+
+	struct ibv_send_wr *bad_wr;
+	int ret = ibv_post_send(conn->id->qp, wr, &bad_wr);
+	if (ret) {
+		ERR_STR(ret, "ibv_post_send");
+		return -ret;
+	}
+
+	return 0;
+}
+
+/*
+ * atomic_check -- (internal) validate the remote atomic op can be posted
+ */
+static int
+atomic_check(struct rpma_connection *conn, size_t dst_off)
+{
+	if (conn->zone->dev_attr.atomic_cap == IBV_ATOMIC_NONE)
+		return RPMA_E_NOSUPP;
+
+	if (dst_off % ATOMIC_SIZE)
+		return -EINVAL;
+
+	return 0;
+}
+
+/*
+ * atomic_sync -- (internal) post a remote atomic op and wait for it
+ */
+static int
+atomic_sync(struct rpma_connection *conn, enum ibv_wr_opcode opcode,
+	    enum ibv_wc_opcode wc_opcode, struct rpma_memory_remote *dst,
+	    size_t dst_off, uint64_t compare_add, uint64_t swap,
+	    struct rpma_memory_local *result, size_t result_off)
+{
+	int ret = atomic_check(conn, dst_off);
+	if (ret)
+		return ret;
+
+	uint64_t wr_id;
+	ret = op_get_sync(conn, RPMA_OP_ATOMIC, 1, &wr_id);
+	if (ret)
+		return ret;
+
+	ret = atomic_post(conn, opcode, dst, dst_off, compare_add, swap,
+			  result, result_off, wr_id);
+	if (ret)
+		goto err_op_put;
+
+	ret = rpma_connection_cq_wait(conn, wc_opcode, wr_id);
+
+err_op_put:
+	op_put(conn, wr_id);
+	return ret;
+}
+
+/*
+ * atomic_async -- (internal) post a remote atomic op reported by
+ * rpma_connection_poll()
+ */
+static int
+atomic_async(struct rpma_connection *conn, enum ibv_wr_opcode opcode,
+	     struct rpma_memory_remote *dst, size_t dst_off,
+	     uint64_t compare_add, uint64_t swap,
+	     struct rpma_memory_local *result, size_t result_off,
+	     void *op_context)
+{
+	int ret = atomic_check(conn, dst_off);
+	if (ret)
+		return ret;
+
+	uint64_t wr_id;
+	ret = op_get(conn, RPMA_OP_ATOMIC, op_context, &wr_id);
+	if (ret)
+		return ret;
+
+	ret = atomic_post(conn, opcode, dst, dst_off, compare_add, swap,
+			  result, result_off, wr_id);
+	if (ret)
+		op_put(conn, wr_id);
+
+	return ret;
+}
+
+int
+rpma_connection_compare_and_swap(struct rpma_connection *conn,
+				 struct rpma_memory_remote *dst,
+				 size_t dst_off, uint64_t compare,
+				 uint64_t swap,
+				 struct rpma_memory_local *result,
+				 size_t result_off)
+{
+	return atomic_sync(conn, IBV_WR_ATOMIC_CMP_AND_SWP, IBV_WC_COMP_SWAP,
+			   dst, dst_off, compare, swap, result, result_off);
+}
+
+int
+rpma_connection_fetch_and_add(struct rpma_connection *conn,
+			      struct rpma_memory_remote *dst, size_t dst_off,
+			      uint64_t add, struct rpma_memory_local *result,
+			      size_t result_off)
+{
+	return atomic_sync(conn, IBV_WR_ATOMIC_FETCH_AND_ADD,
+			   IBV_WC_FETCH_ADD, dst, dst_off, add, 0, result,
+			   result_off);
+}
+
+int
+rpma_connection_compare_and_swap_async(struct rpma_connection *conn,
+				       struct rpma_memory_remote *dst,
+				       size_t dst_off, uint64_t compare,
+				       uint64_t swap,
+				       struct rpma_memory_local *result,
+				       size_t result_off, void *op_context)
+{
+	return atomic_async(conn, IBV_WR_ATOMIC_CMP_AND_SWP, dst, dst_off,
+			    compare, swap, result, result_off, op_context);
+}
+
+int
+rpma_connection_fetch_and_add_async(struct rpma_connection *conn,
+				    struct rpma_memory_remote *dst,
+				    size_t dst_off, uint64_t add,
+				    struct rpma_memory_local *result,
+				    size_t result_off, void *op_context)
+{
+	return atomic_async(conn, IBV_WR_ATOMIC_FETCH_AND_ADD, dst, dst_off,
+			    add, 0, result, result_off, op_context);
+}
+
+#ifdef NATIVE_FLUSH_SUPPORTED
+/*
+ * flush_wr_native -- (internal) add the flushes of all the written regions to
+ * the WRs being built, only the last flush is signaled
+ */
+static void
+flush_wr_native(struct ibv_qp_ex *qpx, struct rpma_dirty *dirty,
+		uint64_t wr_id)
+{
+	for (uint64_t i = 0; i < dirty->num; ++i) {
+		struct rpma_memory_remote *remote = dirty->regions[i];
+		int last = (i == dirty->num - 1);
+
+		qpx->wr_id = last ? wr_id : 0;
+		qpx->wr_flags = last ? IBV_SEND_SIGNALED : 0;
+		ibv_wr_flush(qpx, remote->rkey, remote->raddr, remote->size,
+			     IBV_FLUSH_PERSISTENT, IBV_FLUSH_MR);
+	}
+}
+
+/*
+ * flush_post_native -- (internal) flush all the written regions to
+ * the persistence domain
+ */
+static int
+flush_post_native(struct rpma_connection *conn, struct rpma_dirty *dirty,
+		  uint64_t wr_id)
+{
+	struct ibv_qp_ex *qpx = conn->qpx;
+
+	ibv_wr_start(qpx);
+	flush_wr_native(qpx, dirty, wr_id);
+
+	int ret = ibv_wr_complete(qpx);
+	if (ret) {
+		ERR_STR(ret, "ibv_wr_complete");
+		return -ret;
+	}
+
+	return 0;
+}
+#endif
+
+/*
+ * flush_wrs -- (internal) # of WRs the flush of the dirty regions takes
+ */
+static inline uint64_t
+flush_wrs(struct rpma_connection *conn, struct rpma_dirty *dirty)
+{
+	return (conn->native_flush && dirty->num > 1) ? dirty->num : 1;
+}
+
+/*
+ * flush_wr_init -- (internal) prepare the read making all the dirty regions
+ * persistent, a read is not executed until all the previous writes on the QP
+ * are done so a single read of any of the written regions is enough
+ */
+static void
+flush_wr_init(struct rpma_connection *conn, struct rpma_dirty *dirty,
+	      struct ibv_send_wr *wr, struct ibv_sge *sge, uint64_t wr_id)
+{
+	struct rpma_memory_local *raw_dst = conn->rma.raw_dst;
+	struct rpma_memory_remote *remote = dirty->regions[dirty->num - 1];
+
+	sge->addr = (uint64_t)raw_dst->ptr;
+	sge->length = RAW_SIZE;
+	sge->lkey = raw_dst->mr->lkey;
+
+	wr->next = NULL;
+	wr->sg_list = sge;
+	wr->num_sge = 1;
+	wr->wr.rdma.remote_addr = remote->raddr;
+	wr->wr.rdma.rkey = remote->rkey;
+	wr->wr_id = wr_id;
+	wr->opcode = IBV_WR_RDMA_READ;
+	wr->send_flags = IBV_SEND_SIGNALED;
+}
+
+/*
+ * flush_post -- (internal) make all the dirty regions persistent using
+ * the WR provided, the completion of the signaled wr_id confirms it
+ */
+static int
+flush_post(struct rpma_connection *conn, struct rpma_dirty *dirty,
+	   struct ibv_send_wr *wr, struct ibv_sge *sge, uint64_t wr_id,
+	   enum ibv_wc_opcode *opcode)
+{
+	int ret;
+
+	ASSERT(dirty->num > 0);
+
+#ifdef NATIVE_FLUSH_SUPPORTED
+	if (conn->native_flush) {
+		ret = flush_post_native(conn, dirty, wr_id);
+		if (ret)
+			return ret;
+
+		dirty->num = 0;
+		*opcode = IBV_WC_FLUSH;
+		return 0;
+	}
+#endif
+
+	flush_wr_init(conn, dirty, wr, sge, wr_id);
+
+	ret = chain_post(conn, wr);
+	if (ret)
+		return ret;
+
+	dirty->num = 0;
+	*opcode = IBV_WC_RDMA_READ;
+
+	return 0;
+}
+
+int
+rpma_connection_commit(struct rpma_connection *conn)
+{
+	struct rpma_rma *rma = &conn->rma;
+
+	/* nothing written since the last flush */
+	if (rma->dirty.num == 0)
+		return 0;
+
+	uint64_t wr_id;
+	int ret = op_get_sync(conn, RPMA_OP_FLUSH, flush_wrs(conn, &rma->dirty),
+			      &wr_id);
+	if (ret)
+		return ret;
+
+	enum ibv_wc_opcode opcode;
+	ret = flush_post(conn, &rma->dirty, &rma->wr, &rma->sge, wr_id,
+			 &opcode);
+	if (ret)
+		goto err_op_put;
+
+	ret = rpma_connection_cq_wait(conn, opcode, wr_id);
+
+err_op_put:
+	op_put(conn, wr_id);
+	return ret;
+}
+
+int
+rpma_connection_flush_async(struct rpma_connection *conn, void *op_context)
+{
+	struct rpma_rma *rma = &conn->rma;
+
+	uint64_t wr_id;
+	int ret = op_get_wrs(conn, RPMA_OP_FLUSH, op_context,
+			     flush_wrs(conn, &rma->dirty), &wr_id);
+	if (ret)
+		return ret;
+
+	/* nothing written since the last flush - completed at once */
+	if (rma->dirty.num == 0) {
+		op_done(conn, (struct rpma_op *)wr_id);
+		return 0;
+	}
+
+	enum ibv_wc_opcode opcode;
+	ret = flush_post(conn, &rma->dirty, &rma->wr, &rma->sge, wr_id,
+			 &opcode);
+	if (ret)
+		op_put(conn, wr_id);
+
+	return ret;
+}
+
+int
+rpma_connection_read_async(struct rpma_connection *conn,
+			   struct rpma_memory_local *dst, size_t dst_off,
+			   struct rpma_memory_remote *src, size_t src_off,
+			   size_t length, void *op_context)
+{
+	uint64_t wr_id;
+	int ret = op_get(conn, RPMA_OP_READ, op_context, &wr_id);
+	if (ret)
+		return ret;
+
+	ret = rma_post(conn, IBV_WR_RDMA_READ, dst, dst_off, src, src_off,
+		       length, wr_id, IBV_SEND_SIGNALED);
+	if (ret)
+		op_put(conn, wr_id);
+
+	return ret;
+}
+
+int
+rpma_connection_write_async(struct rpma_connection *conn,
+			    struct rpma_memory_remote *dst, size_t dst_off,
+			    struct rpma_memory_local *src, size_t src_off,
+			    size_t length, void *op_context)
+{
+	uint64_t wr_id;
+	int ret = op_get(conn, RPMA_OP_WRITE, op_context, &wr_id);
+	if (ret)
+		return ret;
+
+	ret = rma_post(conn, IBV_WR_RDMA_WRITE, src, src_off, dst, dst_off,
+		       length, wr_id, IBV_SEND_SIGNALED);
+	if (ret)
+		op_put(conn, wr_id);
+
+	return ret;
+}
+
+int
+rpma_connection_readv(struct rpma_connection *conn,
+		      const struct rpma_sge *dst, int num_segs,
+		      struct rpma_memory_remote *src, size_t src_off)
+{
+	struct ibv_sge sgl[RPMA_MAX_SGE];
+	size_t length;
+	int ret = sgl_init(conn, dst, num_segs, sgl, &length);
+	if (ret)
+		return ret;
+
+	uint64_t wr_id;
+	ret = op_get_sync(conn, RPMA_OP_READ, 1, &wr_id);
+	if (ret)
+		return ret;
+
+	ret = rma_post_sgl(conn, IBV_WR_RDMA_READ, sgl, num_segs, src,
+			   src_off, length, wr_id, IBV_SEND_SIGNALED);
+	if (ret)
+		goto err_op_put;
+
+	ret = rpma_connection_cq_wait(conn, IBV_WC_RDMA_READ, wr_id);
+
+err_op_put:
+	op_put(conn, wr_id);
+	return ret;
+}
+
+int
+rpma_connection_writev(struct rpma_connection *conn,
+		       struct rpma_memory_remote *dst, size_t dst_off,
+		       const struct rpma_sge *src, int num_segs)
+{
+	struct ibv_sge sgl[RPMA_MAX_SGE];
+	size_t length;
+	int ret = sgl_init(conn, src, num_segs, sgl, &length);
+	if (ret)
+		return ret;
+
+	uint64_t wr_id;
+	unsigned flags;
+	ret = unsignaled_get(conn, &wr_id, &flags);
+	if (ret)
+		return ret;
+
+	ret = rma_post_sgl(conn, IBV_WR_RDMA_WRITE, sgl, num_segs, dst,
+			   dst_off, length, wr_id, flags);
+	if (ret)
+		unsignaled_put(conn, wr_id);
+
+	return ret;
+}
+
+int
+rpma_connection_readv_async(struct rpma_connection *conn,
+			    const struct rpma_sge *dst, int num_segs,
+			    struct rpma_memory_remote *src, size_t src_off,
+			    void *op_context)
+{
+	struct ibv_sge sgl[RPMA_MAX_SGE];
+	size_t length;
+	int ret = sgl_init(conn, dst, num_segs, sgl, &length);
+	if (ret)
+		return ret;
+
+	uint64_t wr_id;
+	ret = op_get(conn, RPMA_OP_READ, op_context, &wr_id);
+	if (ret)
+		return ret;
+
+	ret = rma_post_sgl(conn, IBV_WR_RDMA_READ, sgl, num_segs, src,
+			   src_off, length, wr_id, IBV_SEND_SIGNALED);
+	if (ret)
+		op_put(conn, wr_id);
+
+	return ret;
+}
+
+int
+rpma_connection_writev_async(struct rpma_connection *conn,
+			     struct rpma_memory_remote *dst, size_t dst_off,
+			     const struct rpma_sge *src, int num_segs,
+			     void *op_context)
 {
-	return rpma_connection_read(conn, conn->rma.raw_dst, 0,
-				    conn->rma.raw_src, 0, RAW_SIZE);
+	struct ibv_sge sgl[RPMA_MAX_SGE];
+	size_t length;
+	int ret = sgl_init(conn, src, num_segs, sgl, &length);
+	if (ret)
+		return ret;
+
+	uint64_t wr_id;
+	ret = op_get(conn, RPMA_OP_WRITE, op_context, &wr_id);
+	if (ret)
+		return ret;
+
+	ret = rma_post_sgl(conn, IBV_WR_RDMA_WRITE, sgl, num_segs, dst,
+			   dst_off, length, wr_id, IBV_SEND_SIGNALED);
+	if (ret)
+		op_put(conn, wr_id);
+
+	return ret;
+}
+
+#ifdef NATIVE_FLUSH_SUPPORTED
+/*
+ * write_list_post_native -- (internal) post the writes of the list followed by
+ * the flushes of all the dirty regions at once
+ */
+static int
+write_list_post_native(struct rpma_connection *conn,
+		       const struct rpma_write_range *ranges, int num,
+		       uint64_t wr_id)
+{
+	struct ibv_qp_ex *qpx = conn->qpx;
+
+	ibv_wr_start(qpx);
+
+	for (int i = 0; i < num; ++i) {
+		const struct rpma_write_range *r = &ranges[i];
+		void *src = (char *)r->src->ptr + r->src_off;
+
+		ASSERT(r->length < UINT32_MAX);
+
+		qpx->wr_id = 0;
+		qpx->wr_flags = 0;
+		if (r->length <= conn->max_inline_data)
+			qpx->wr_flags |= IBV_SEND_INLINE;
+
+		ibv_wr_rdma_write(qpx, r->dst->rkey, r->dst->raddr + r->dst_off);
+		if (qpx->wr_flags & IBV_SEND_INLINE)
+			ibv_wr_set_inline_data(qpx, src, r->length);
+		else
+			ibv_wr_set_sge(qpx, r->src->mr->lkey, (uint64_t)src,
+				       (uint32_t)r->length);
+	}
+
+	flush_wr_native(qpx, &conn->rma.dirty, wr_id);
+
+	int ret = ibv_wr_complete(qpx);
+	if (ret) {
+		ERR_STR(ret, "ibv_wr_complete");
+		return -ret;
+	}
+
+	return 0;
+}
+#endif
+
+int
+rpma_connection_write_list(struct rpma_connection *conn,
+			   const struct rpma_write_range *ranges, int num,
+			   unsigned flags, void *op_context)
+{
+	struct rpma_rma *rma = &conn->rma;
+	int flush = (flags & RPMA_WRITE_LIST_FLUSH) ? 1 : 0;
+	int ret;
+
+	if (num <= 0 || (uint64_t)num > rma->ops_size)
+		return -EINVAL;
+
+	/* the flush has to know all the regions the list writes to */
+	for (int i = 0; i < num; ++i) {
+		ret = dirty_mark(&rma->dirty, ranges[i].dst);
+		if (ret)
+			return ret;
+	}
+
+	uint64_t nwr = (uint64_t)num;
+	if (flush)
+		nwr += flush_wrs(conn, &rma->dirty);
+	if (nwr > rma->ops_size)
+		return -EINVAL;
+
+	uint64_t wr_id;
+	ret = op_get_wrs(conn, RPMA_OP_WRITE, op_context, nwr, &wr_id);
+	if (ret)
+		return ret;
+
+#ifdef NATIVE_FLUSH_SUPPORTED
+	if (flush && conn->native_flush) {
+		ret = write_list_post_native(conn, ranges, num, wr_id);
+		if (ret)
+			goto err_op_put;
+
+		rma->dirty.num = 0;
+		return 0;
+	}
+#endif
+
+	for (int i = 0; i < num; ++i) {
+		const struct rpma_write_range *r = &ranges[i];
+		struct ibv_send_wr *wr = &rma->chain_wrs[i];
+		struct ibv_sge *sge = &rma->chain_sges[i];
+
+		ASSERT(r->length < UINT32_MAX);
+
+		sge->addr = (uint64_t)((uintptr_t)r->src->ptr + r->src_off);
+		sge->length = (uint32_t)r->length;
+		sge->lkey = r->src->mr->lkey;
+
+		memset(wr, 0, sizeof(*wr));
+		wr->next = &rma->chain_wrs[i + 1];
+		wr->sg_list = sge;
+		wr->num_sge = 1;
+		wr->opcode = IBV_WR_RDMA_WRITE;
+		if (r->length <= conn->max_inline_data)
+			wr->send_flags |= IBV_SEND_INLINE;
+		wr->wr.rdma.remote_addr = r->dst->raddr + r->dst_off;
+		wr->wr.rdma.rkey = r->dst->rkey;
+	}
+
+	/*
+	 * the writes are followed by the flushing read in the same chain,
+	 * without it the completion of the last write covers the list
+	 */
+	if (flush) {
+		flush_wr_init(conn, &rma->dirty, &rma->chain_wrs[num],
+			      &rma->chain_sges[num], wr_id);
+	} else {
+		struct ibv_send_wr *last = &rma->chain_wrs[num - 1];
+		last->next = NULL;
+		last->wr_id = wr_id;
+		last->send_flags |= IBV_SEND_SIGNALED;
+	}
+
+	ret = chain_post(conn, rma->chain_wrs);
+	if (ret)
+		goto err_op_put;
+
+	if (flush)
+		rma->dirty.num = 0;
+
+	return 0;
+
+err_op_put:
+	op_put(conn, wr_id);
+	return ret;
+}
+
+/*
+ * done_reap -- (internal) move up to num completed ops to the user array
+ */
+static size_t
+done_reap(struct rpma_connection *conn, struct rpma_completion *cmpls,
+	  size_t num)
+{
+	struct rpma_rma *rma = &conn->rma;
+	size_t n = 0;
+
+	while (n < num && rma->done_num > 0) {
+		struct rpma_op *rop = &rma->ops[rma->done[rma->done_head]];
+		rma->done_head = (rma->done_head + 1) % rma->ops_size;
+		--rma->done_num;
+
+		cmpls[n].op_context = rop->op_context;
+		cmpls[n].op = rop->op;
+		cmpls[n].status = rop->status;
+		++n;
+
+		op_put(conn, (uint64_t)rop);
+	}
+
+	return n;
+}
+
+int
+rpma_connection_poll(struct rpma_connection *conn,
+		     struct rpma_completion *cmpls, size_t num,
+		     size_t *num_done)
+{
+	int ret = rpma_connection_cq_drain(conn);
+	if (ret)
+		return ret;
+
+	*num_done = done_reap(conn, cmpls, num);
+
+	return 0;
+}
+
+int
+rpma_connection_wait(struct rpma_connection *conn,
+		     struct rpma_completion *cmpls, size_t num,
+		     size_t *num_done)
+{
+	int ret;
+
+	while (1) {
+		ret = rpma_connection_poll(conn, cmpls, num, num_done);
+		if (ret || *num_done > 0)
+			return ret;
+
+		/* nothing posted or the connection is going away */
+		if (conn->disconnected || !ops_in_flight(conn))
+			return RPMA_E_NO_COMPLETION;
+	}
+}
+
+int
+rpma_connection_is_lane(struct rpma_connection *conn, uint64_t wr_id)
+{
+	uintptr_t begin = (uintptr_t)conn->lanes;
+	uintptr_t end = (uintptr_t)(conn->lanes + conn->nlanes);
+
+	return wr_id >= begin && wr_id < end;
+}
+
+/*
+ * rpma_connection_lane_complete -- mark the flush of the lane as completed,
+ * the lane may be drained by another thread than the one polling the CQ
+ */
+void
+rpma_connection_lane_complete(struct rpma_connection *conn, struct ibv_wc *wc)
+{
+	struct rpma_lane *lane = (struct rpma_lane *)wc->wr_id;
+
+	if (wc->status != IBV_WC_SUCCESS) {
+		ERR("lane flush failed: %s", ibv_wc_status_str(wc->status));
+		lane->status = RPMA_E_OP_FAILED;
+	}
+
+	util_atomic_store_explicit32(&lane->drained, 1, memory_order_release);
+}
+
+/*
+ * lane_wait -- (internal) wait for the flush of the lane to complete
+ */
+static int
+lane_wait(struct rpma_connection *conn, struct rpma_lane *lane)
+{
+	int drained;
+	int ret = 0;
+
+	while (1) {
+		util_atomic_load_explicit32(&lane->drained, &drained,
+					    memory_order_acquire);
+		if (drained)
+			break;
+
+		/*
+		 * the dispatcher polls the CQ on its own, its thread may share
+		 * the CPU with the waiting one
+		 */
+		if (conn->disp) {
+			sched_yield();
+			continue;
+		}
+
+		ret = rpma_connection_lane_cq_poll(conn);
+		if (ret)
+			return ret;
+	}
+
+	ret = lane->status;
+	lane->status = 0;
+
+	return ret;
+}
+
+int
+rpma_connection_lane_drain(struct rpma_connection *conn, unsigned lane_id)
+{
+	if (lane_id >= conn->nlanes)
+		return -EINVAL;
+
+	struct rpma_lane *lane = &conn->lanes[lane_id];
+
+	/* nothing written since the last drain */
+	if (lane->dirty.num == 0)
+		return 0;
+
+	util_atomic_store_explicit32(&lane->drained, 0, memory_order_relaxed);
+
+	enum ibv_wc_opcode opcode;
+	int ret = flush_post(conn, &lane->dirty, &lane->wr, &lane->sge,
+			     (uint64_t)lane, &opcode);
+	if (ret)
+		return ret;
+
+	ret = lane_wait(conn, lane);
+
+	/* the completion of the flush releases all the WRs of the lane */
+	lane->nposted = 0;
+
+	return ret;
+}
+
+/*
+ * lane_flush_wrs -- (internal) # of WRs the flush of the lane would take if
+ * one more region was written
+ */
+static inline uint64_t
+lane_flush_wrs(struct rpma_connection *conn, struct rpma_lane *lane)
+{
+	return conn->native_flush ? lane->dirty.num + 1 : 1;
+}
+
+int
+rpma_connection_lane_flush(struct rpma_connection *conn, unsigned lane_id,
+			   struct rpma_memory_remote *dst, size_t dst_off,
+			   struct rpma_memory_local *src, size_t src_off,
+			   size_t length)
+{
+	if (lane_id >= conn->nlanes)
+		return -EINVAL;
+
+	struct rpma_lane *lane = &conn->lanes[lane_id];
+	int ret;
+
+	/* the lane has to leave room in its part of SQ for the flush */
+	if (lane->nposted + 1 + lane_flush_wrs(conn, lane) >
+	    conn->zone->lane_queue_length) {
+		ret = rpma_connection_lane_drain(conn, lane_id);
+		if (ret)
+			return ret;
+	}
+
+	ret = dirty_mark(&lane->dirty, dst);
+	if (ret)
+		return ret;
+
+	struct ibv_sge *sge = &lane->sge;
+	sge->addr = (uint64_t)((uintptr_t)src->ptr + src_off);
+	sge->length = (uint32_t)length;
+	sge->lkey = src->mr->lkey;
+
+	ret = wr_post(conn, &lane->wr, IBV_WR_RDMA_WRITE, sge, 1, dst, dst_off,
+		      length, 0, 0 /* !IBV_SEND_SIGNALED */);
+	if (ret)
+		return ret;
+
+	++lane->nposted;
+
+	return 0;
+}
+
+int
+rpma_connection_lane_persist(struct rpma_connection *conn, unsigned lane_id,
+			     struct rpma_memory_remote *dst, size_t dst_off,
+			     struct rpma_memory_local *src, size_t src_off,
+			     size_t length)
+{
+	int ret = rpma_connection_lane_flush(conn, lane_id, dst, dst_off, src,
+					     src_off, length);
+	if (ret)
+		return ret;
+
+	return rpma_connection_lane_drain(conn, lane_id);
 }
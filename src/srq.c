@@ -0,0 +1,280 @@
+/*
+ * Copyright 2020, Intel Corporation
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in
+ *       the documentation and/or other materials provided with the
+ *       distribution.
+ *
+ *     * Neither the name of the copyright holder nor the names of its
+ *       contributors may be used to endorse or promote products derived
+ *       from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * srq.c -- librpma shared receive queue implementation
+ *
+ * All connections of a zone receive into a single pool of registered buffers.
+ * The buffers released by the consumers are not reposted one by one but
+ * collected and reposted with a single ibv_post_srq_recv() call when the
+ * number of posted buffers drops below the low watermark.
+ */
+
+#include <errno.h>
+
+#include "alloc.h"
+#include "memory.h"
+#include "rpma_utils.h"
+#include "srq.h"
+#include "util.h"
+#include "zone.h"
+
+static int
+srq_buff_init(struct rpma_zone *zone, struct rpma_srq *srq)
+{
+	size_t buff_size = ALIGN_UP(srq->msg_size * srq->length, Pagesize);
+
+	void *ptr;
+	errno = posix_memalign((void **)&ptr, Pagesize, buff_size);
+	if (errno)
+		return RPMA_E_ERRNO;
+
+	int ret = rpma_memory_local_new_internal(zone, ptr, buff_size,
+						 IBV_ACCESS_LOCAL_WRITE,
+						 &srq->buff);
+	if (ret)
+		goto err_mem_local_new;
+
+	return 0;
+
+err_mem_local_new:
+	Free(ptr);
+	return ret;
+}
+
+static int
+srq_buff_fini(struct rpma_srq *srq)
+{
+	void *ptr;
+	int ret = rpma_memory_local_get_ptr(srq->buff, &ptr);
+	if (ret)
+		return ret;
+
+	ret = rpma_memory_local_delete(&srq->buff);
+	if (ret)
+		return ret;
+
+	Free(ptr);
+
+	return 0;
+}
+
+/*
+ * srq_post_free -- (internal) post all the released buffers as a single
+ * chain of work requests, has to be called with the lock held
+ */
+static int
+srq_post_free(struct rpma_srq *srq)
+{
+	if (srq->nfree == 0)
+		return 0;
+
+	uintptr_t base = (uintptr_t)srq->buff->ptr;
+
+	for (uint64_t i = 0; i < srq->nfree; ++i) {
+		uint64_t addr = base + srq->free[i] * srq->msg_size;
+
+		srq->sges[i].addr = addr;
+		srq->wrs[i].wr_id = addr;
+		srq->wrs[i].next = &srq->wrs[i + 1];
+	}
+	srq->wrs[srq->nfree - 1].next = NULL;
+
+	struct ibv_recv_wr *bad_wr;
+	int ret = ibv_post_srq_recv(srq->srq, srq->wrs, &bad_wr);
+	if (ret) {
+		ERR_STR(ret, "ibv_post_srq_recv");
+		return -ret; /* XXX macro? */
+	}
+
+	srq->posted += srq->nfree;
+	srq->nfree = 0;
+
+	return 0;
+}
+
+int
+rpma_srq_new(struct rpma_zone *zone, uint64_t length, uint64_t low_watermark,
+	     struct rpma_srq **srq)
+{
+	ASSERT(length > 0);
+	ASSERT(low_watermark <= length);
+
+	struct rpma_srq *ptr = Malloc(sizeof(*ptr));
+	if (!ptr)
+		return RPMA_E_ERRNO;
+
+	int ret;
+
+	ptr->msg_size = zone->msg_size;
+	ptr->length = length;
+	ptr->low_watermark = low_watermark;
+	ptr->posted = 0;
+
+	ptr->free = Malloc(length * sizeof(*ptr->free));
+	if (!ptr->free) {
+		ret = RPMA_E_ERRNO;
+		goto err_free;
+	}
+
+	ptr->wrs = Malloc(length * sizeof(*ptr->wrs));
+	if (!ptr->wrs) {
+		ret = RPMA_E_ERRNO;
+		goto err_wrs;
+	}
+
+	ptr->sges = Malloc(length * sizeof(*ptr->sges));
+	if (!ptr->sges) {
+		ret = RPMA_E_ERRNO;
+		goto err_sges;
+	}
+
+	ret = srq_buff_init(zone, ptr);
+	if (ret)
+		goto err_buff_init;
+
+	for (uint64_t i = 0; i < length; ++i) {
+		memset(&ptr->wrs[i], 0, sizeof(ptr->wrs[i]));
+		ptr->wrs[i].sg_list = &ptr->sges[i];
+		ptr->wrs[i].num_sge = 1;
+
+		ptr->sges[i].length = (uint32_t)ptr->msg_size;
+		ptr->sges[i].lkey = ptr->buff->mr->lkey;
+
+		ptr->free[i] = i;
+	}
+	ptr->nfree = length;
+
+	struct ibv_srq_init_attr srq_attr;
+	memset(&srq_attr, 0, sizeof(srq_attr));
+	srq_attr.srq_context = ptr;
+	srq_attr.attr.max_wr = (uint32_t)length;
+	srq_attr.attr.max_sge = 1;
+
+	ptr->srq = ibv_create_srq(zone->pd, &srq_attr);
+	if (!ptr->srq) {
+		ret = RPMA_E_ERRNO;
+		goto err_create_srq;
+	}
+
+	/* the whole pool is posted up front */
+	ret = srq_post_free(ptr);
+	if (ret)
+		goto err_post;
+
+	os_mutex_init(&ptr->lock);
+
+	*srq = ptr;
+
+	return 0;
+
+err_post:
+	(void)ibv_destroy_srq(ptr->srq);
+err_create_srq:
+	(void)srq_buff_fini(ptr);
+err_buff_init:
+	Free(ptr->sges);
+err_sges:
+	Free(ptr->wrs);
+err_wrs:
+	Free(ptr->free);
+err_free:
+	Free(ptr);
+	return ret;
+}
+
+int
+rpma_srq_delete(struct rpma_srq **srq)
+{
+	struct rpma_srq *ptr = *srq;
+	if (!ptr)
+		return 0;
+
+	int ret = ibv_destroy_srq(ptr->srq);
+	if (ret) {
+		ERR_STR(ret, "ibv_destroy_srq");
+		return -ret; /* XXX macro? */
+	}
+
+	ret = srq_buff_fini(ptr);
+	if (ret)
+		return ret;
+
+	os_mutex_destroy(&ptr->lock);
+
+	Free(ptr->sges);
+	Free(ptr->wrs);
+	Free(ptr->free);
+	Free(ptr);
+
+	*srq = NULL;
+
+	return 0;
+}
+
+/*
+ * rpma_srq_recv_consumed -- note a receive completion took a buffer from SRQ
+ */
+void
+rpma_srq_recv_consumed(struct rpma_srq *srq)
+{
+	os_mutex_lock(&srq->lock);
+	ASSERT(srq->posted > 0);
+	--srq->posted;
+	os_mutex_unlock(&srq->lock);
+}
+
+/*
+ * rpma_srq_recv_release -- give the buffer back to the pool, the released
+ * buffers are reposted in a batch when the SRQ runs low
+ */
+int
+rpma_srq_recv_release(struct rpma_srq *srq, void *ptr)
+{
+	uintptr_t off = (uintptr_t)ptr - (uintptr_t)srq->buff->ptr;
+	uint64_t id = off / srq->msg_size;
+	int ret = 0;
+
+	ASSERT(id < srq->length);
+
+	os_mutex_lock(&srq->lock);
+
+	ASSERT(srq->nfree < srq->length);
+	srq->free[srq->nfree++] = id;
+
+	if (srq->posted < srq->low_watermark)
+		ret = srq_post_free(srq);
+
+	os_mutex_unlock(&srq->lock);
+
+	return ret;
+}
@@ -0,0 +1,71 @@
+/*
+ * Copyright 2020, Intel Corporation
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in
+ *       the documentation and/or other materials provided with the
+ *       distribution.
+ *
+ *     * Neither the name of the copyright holder nor the names of its
+ *       contributors may be used to endorse or promote products derived
+ *       from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * srq.h -- internal definitions for the librpma shared receive queue
+ */
+#ifndef RPMA_SRQ_H
+#define RPMA_SRQ_H
+
+#include <infiniband/verbs.h>
+
+#include <librpma.h>
+
+#include "os_thread.h"
+
+struct rpma_srq {
+	struct ibv_srq *srq;
+	struct rpma_memory_local *buff;
+	size_t msg_size;
+
+	uint64_t length;	/* # of receive buffers in the pool */
+	uint64_t low_watermark; /* repost when fewer buffers are posted */
+	uint64_t posted;
+
+	/* released buffers waiting to be reposted */
+	uint64_t *free;
+	uint64_t nfree;
+
+	struct ibv_recv_wr *wrs;
+	struct ibv_sge *sges;
+
+	os_mutex_t lock;
+};
+
+int rpma_srq_new(struct rpma_zone *zone, uint64_t length,
+		 uint64_t low_watermark, struct rpma_srq **srq);
+int rpma_srq_delete(struct rpma_srq **srq);
+
+void rpma_srq_recv_consumed(struct rpma_srq *srq);
+int rpma_srq_recv_release(struct rpma_srq *srq, void *ptr);
+
+#endif /* srq.h */
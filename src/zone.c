@@ -47,8 +47,8 @@
 #include "alloc.h"
 #include "config.h"
 #include "connection.h"
-#include "ravl.h"
 #include "rpma_utils.h"
+#include "srq.h"
 #include "valgrind_internal.h"
 #include "zone.h"
 
@@ -111,6 +111,118 @@ err_resolve_addr:
 	return ret;
 }
 
+static inline uint64_t
+min_u64(uint64_t a, uint64_t b)
+{
+	return a < b ? a : b;
+}
+
+/*
+ * queues_init -- (internal) size QP, CQ and RDMA read depths from the config
+ * and clamp them to the device limits
+ */
+static int
+queues_init(struct rpma_config *cfg, struct rpma_zone *zone)
+{
+	struct ibv_device_attr *attr = &zone->dev_attr;
+
+	int ret = ibv_query_device(zone->device, attr);
+	if (ret) {
+		ERR_STR(ret, "ibv_query_device");
+		return -ret;
+	}
+
+	uint64_t max_qp_wr = (uint64_t)attr->max_qp_wr;
+
+	/* one WR of each queue is reserved for the credit updates */
+	uint64_t max_wr = max_qp_wr - 1;
+
+	zone->recv_queue_length = min_u64(cfg->recv_queue_length, max_wr);
+
+	/* the send queue is shared by the messages and the RMA ops */
+	zone->send_queue_length = min_u64(cfg->send_queue_length, max_wr);
+	zone->rma_queue_length = min_u64(cfg->rma_queue_length,
+					 max_wr - zone->send_queue_length);
+	if (zone->rma_queue_length == 0) {
+		ERR("send queue length exceeds the device limit (%d)",
+		    attr->max_qp_wr);
+		return RPMA_E_NOSUPP;
+	}
+
+	/* each lane has its own part of the send queue */
+	zone->nlanes = cfg->nlanes;
+	zone->lane_queue_length = 0;
+	if (zone->nlanes) {
+		uint64_t avail = max_wr - zone->send_queue_length -
+			zone->rma_queue_length;
+		zone->lane_queue_length = min_u64(cfg->lane_queue_length,
+						  avail / zone->nlanes);
+		if (zone->lane_queue_length < 2) {
+			ERR("too many lanes for the device limit (%d)",
+			    attr->max_qp_wr);
+			return RPMA_E_NOSUPP;
+		}
+	}
+
+	zone->max_send_wr = (uint32_t)(zone->send_queue_length +
+				       zone->rma_queue_length +
+				       zone->nlanes * zone->lane_queue_length +
+				       1);
+	zone->max_recv_wr =
+		(uint32_t)(zone->recv_queue_length + RPMA_CREDITS_UPDATE_BUFFS);
+
+	zone->max_sge = (int)min_u64(cfg->max_sge, (uint64_t)attr->max_sge);
+
+	zone->native_flush = 0;
+#ifdef NATIVE_FLUSH_SUPPORTED
+	/* the flush capabilities are reported along with the extended ones */
+	struct ibv_device_attr_ex attr_ex;
+	if (!ibv_query_device_ex(zone->device, NULL, &attr_ex))
+		zone->native_flush = !!(attr_ex.device_cap_flags_ex &
+					IB_UVERBS_DEVICE_FLUSH_PERSISTENT);
+#endif
+
+	/* a send has to be signaled before the send buffers run out */
+	zone->send_signal_interval = min_u64(cfg->send_signal_interval,
+					     zone->send_queue_length);
+	if (zone->send_signal_interval == 0)
+		zone->send_signal_interval = 1;
+
+	uint64_t cq_size = cfg->cq_size;
+	if (cq_size == 0)
+		cq_size = (uint64_t)zone->max_send_wr + zone->max_recv_wr;
+	zone->cq_size = (int)min_u64(cq_size, (uint64_t)attr->max_cqe);
+
+	zone->srq_length = min_u64(cfg->srq_length, (uint64_t)attr->max_srq_wr);
+	zone->srq_low_watermark =
+		min_u64(cfg->srq_low_watermark, zone->srq_length);
+	if ((zone->flags & RPMA_CONFIG_SHARED_RQ) && zone->srq_length == 0) {
+		ERR("the device does not support shared receive queues");
+		return RPMA_E_NOSUPP;
+	}
+
+	/* the connection parameters are 8-bit values */
+	zone->initiator_depth = (uint8_t)min_u64(
+		min_u64(cfg->initiator_depth,
+			(uint64_t)attr->max_qp_init_rd_atom),
+		RDMA_MAX_INIT_DEPTH);
+	zone->responder_resources = (uint8_t)min_u64(
+		(uint64_t)attr->max_qp_rd_atom, RDMA_MAX_RESP_RES);
+
+	if (zone->recv_queue_length != cfg->recv_queue_length ||
+	    zone->send_queue_length != cfg->send_queue_length ||
+	    zone->rma_queue_length != cfg->rma_queue_length ||
+	    (zone->nlanes &&
+	     zone->lane_queue_length != cfg->lane_queue_length) ||
+	    (cfg->cq_size && (uint64_t)zone->cq_size != cfg->cq_size) ||
+	    zone->initiator_depth != cfg->initiator_depth ||
+	    ((zone->flags & RPMA_CONFIG_SHARED_RQ) &&
+	     zone->srq_length != cfg->srq_length))
+		LOG(3, "queue lengths clamped to the device limits");
+
+	return 0;
+}
+
 static int
 epoll_init(struct rpma_zone *zone)
 {
@@ -169,6 +281,10 @@ zone_init(struct rpma_config *cfg, struct rpma_zone *zone)
 	if (ret)
 		goto err_device_get;
 
+	ret = queues_init(cfg, zone);
+	if (ret)
+		goto err_queues_init;
+
 	/* protection domain */
 	zone->pd = ibv_alloc_pd(zone->device);
 	if (!zone->pd) {
@@ -187,14 +303,24 @@ zone_init(struct rpma_config *cfg, struct rpma_zone *zone)
 	if (ret)
 		goto err_epoll_init;
 
+	if (zone->flags & RPMA_CONFIG_SHARED_RQ) {
+		ret = rpma_srq_new(zone, zone->srq_length,
+				   zone->srq_low_watermark, &zone->srq);
+		if (ret)
+			goto err_srq_new;
+	}
+
 	return 0;
 
+err_srq_new:
+	(void)epoll_fini(zone);
 err_epoll_init:
 	(void)rdma_destroy_event_channel(zone->ec);
 	zone->ec = NULL;
 err_create_event_channel:
 	(void)ibv_dealloc_pd(zone->pd);
 err_alloc_pd:
+err_queues_init:
 err_device_get:
 	info_delete(&zone->rai);
 	return ret;
@@ -203,6 +329,18 @@ err_device_get:
 static void
 zone_fini(struct rpma_zone *zone)
 {
+	struct rpma_zone_event *ze;
+
+	/* the ids cannot be destroyed until all their events are acknowledged */
+	while ((ze = PMDK_TAILQ_FIRST(&zone->deferred)) != NULL) {
+		PMDK_TAILQ_REMOVE(&zone->deferred, ze, next);
+		(void)rdma_ack_cm_event(ze->edata);
+		Free(ze);
+	}
+
+	rpma_connection_cache_fini(zone);
+	if (zone->srq)
+		(void)rpma_srq_delete(&zone->srq);
 	if (zone->ec_epoll != RPMA_FD_INVALID)
 		epoll_fini(zone);
 	if (zone->listen_id)
@@ -213,24 +351,6 @@ zone_fini(struct rpma_zone *zone)
 		ibv_dealloc_pd(zone->pd);
 }
 
-struct id_conn_pair {
-	struct rdma_cm_id *id;
-	struct rpma_connection *conn;
-};
-
-static int
-id_conn_pair_compare(const void *lhs, const void *rhs)
-{
-	const struct id_conn_pair *l = lhs;
-	const struct id_conn_pair *r = rhs;
-
-	intptr_t diff = (intptr_t)l->id - (intptr_t)r->id;
-	if (diff != 0)
-		return diff > 0 ? 1 : -1;
-
-	return 0;
-}
-
 int
 rpma_zone_new(struct rpma_config *cfg, struct rpma_zone **zone)
 {
@@ -242,10 +362,13 @@ rpma_zone_new(struct rpma_config *cfg, struct rpma_zone **zone)
 	ptr->ec_epoll = RPMA_FD_INVALID;
 	ptr->device = NULL;
 	ptr->pd = NULL;
+	ptr->srq = NULL;
 	ptr->listen_id = NULL;
+	ptr->edata = NULL;
+	PMDK_TAILQ_INIT(&ptr->deferred);
 	ptr->uarg = NULL;
+	ptr->listen_backlog = cfg->listen_backlog;
 	ptr->active_connections = 0;
-	ptr->connections = ravl_new(id_conn_pair_compare);
 
 	ptr->waiting = 0;
 
@@ -256,18 +379,41 @@ rpma_zone_new(struct rpma_config *cfg, struct rpma_zone **zone)
 	ptr->msg_size = cfg->msg_size;
 	ptr->send_queue_length = cfg->send_queue_length;
 	ptr->recv_queue_length = cfg->recv_queue_length;
+	ptr->cq_batch_size = (int)cfg->cq_batch_size;
+	ptr->inline_threshold = cfg->inline_threshold;
+	ptr->dispatch_mode = cfg->dispatch_mode;
+	ptr->poll_budget = cfg->poll_budget;
 	ptr->flags = cfg->flags;
 
-	int ret = zone_init(cfg, ptr);
+	int ret;
+
+	os_mutex_init(&ptr->conn_cache_lock);
+	ptr->conn_cache = NULL;
+	ptr->conn_cache_size = cfg->conn_cache;
+	ptr->conn_cache_num = 0;
+	ptr->conn_cache_low_watermark = (ptr->conn_cache_size + 1) / 2;
+	if (ptr->conn_cache_size) {
+		ptr->conn_cache = Malloc(ptr->conn_cache_size *
+					 sizeof(*ptr->conn_cache));
+		if (!ptr->conn_cache) {
+			ret = RPMA_E_ERRNO;
+			goto err_free;
+		}
+	}
+
+	ret = zone_init(cfg, ptr);
 
 	if (ret)
-		goto err_free;
+		goto err_free_cache;
 
 	*zone = ptr;
 
 	return ret;
 
+err_free_cache:
+	Free(ptr->conn_cache);
 err_free:
+	os_mutex_destroy(&ptr->conn_cache_lock);
 	Free(ptr);
 	return ret;
 }
@@ -311,7 +457,7 @@ zone_listen(struct rpma_zone *zone)
 		goto err_bind_addr;
 	}
 
-	ret = rdma_listen(zone->listen_id, 0 /* backlog */);
+	ret = rdma_listen(zone->listen_id, zone->listen_backlog);
 	if (ret) {
 		ret = RPMA_E_ERRNO;
 		goto err_listen;
@@ -337,6 +483,8 @@ rpma_zone_delete(struct rpma_zone **zone)
 
 	zone_fini(ptr);
 
+	Free(ptr->conn_cache);
+	os_mutex_destroy(&ptr->conn_cache_lock);
 	Free(ptr);
 	*zone = NULL;
 
@@ -376,8 +524,13 @@ rpma_zone_unregister_on_timeout(struct rpma_zone *zone)
 
 #define MAX_EVENTS 2
 
+/*
+ * event_read -- (internal) read the next CM event, wait for it up to timeout,
+ * the connection cache is refilled meanwhile if idle_refill is set
+ */
 static int
-event_read(struct rpma_zone *zone, enum rdma_cm_event_type *event, int timeout)
+event_read(struct rpma_zone *zone, enum rdma_cm_event_type *event, int timeout,
+	   int idle_refill)
 {
 	struct epoll_event events[MAX_EVENTS];
 	int ret;
@@ -401,6 +554,18 @@ event_read(struct rpma_zone *zone, enum rdma_cm_event_type *event, int timeout)
 		if (ret != -EAGAIN)
 			return ret;
 
+		/*
+		 * all the pending events are handled - a good moment to prepare
+		 * for the next burst of the connection requests; without the
+		 * cache the connections are just allocated on demand
+		 */
+		if (idle_refill) {
+			ret = rpma_connection_cache_refill(zone);
+			if (ret)
+				LOG(1, "connection cache not refilled: %d",
+				    ret);
+		}
+
 		/* wait for incoming events */
 		ret = epoll_wait(zone->ec_epoll, events, MAX_EVENTS, timeout);
 		if (ret == 0)
@@ -414,6 +579,46 @@ event_read(struct rpma_zone *zone, enum rdma_cm_event_type *event, int timeout)
 	return 0;
 }
 
+/*
+ * event_defer -- (internal) put the current event aside for the zone loop,
+ * a synchronous setup does not call the callbacks of the other connections
+ */
+static int
+event_defer(struct rpma_zone *zone)
+{
+	struct rpma_zone_event *ze = Malloc(sizeof(*ze));
+	if (!ze) {
+		int ret = RPMA_E_ERRNO;
+		ERR("event dropped (%u)", zone->edata->event);
+		(void)rpma_zone_event_ack(zone);
+		return ret;
+	}
+
+	ze->edata = zone->edata;
+	zone->edata = NULL;
+	PMDK_TAILQ_INSERT_TAIL(&zone->deferred, ze, next);
+
+	return 0;
+}
+
+/*
+ * event_next -- (internal) take the deferred events before reading new ones
+ */
+static int
+event_next(struct rpma_zone *zone, enum rdma_cm_event_type *event, int timeout)
+{
+	struct rpma_zone_event *ze = PMDK_TAILQ_FIRST(&zone->deferred);
+	if (!ze)
+		return event_read(zone, event, timeout, 1);
+
+	PMDK_TAILQ_REMOVE(&zone->deferred, ze, next);
+	zone->edata = ze->edata;
+	*event = ze->edata->event;
+	Free(ze);
+
+	return 0;
+}
+
 int
 rpma_zone_event_ack(struct rpma_zone *zone)
 {
@@ -443,37 +648,97 @@ zone_on_timeout(struct rpma_zone *zone, void *uarg)
 	return func(zone, uarg);
 }
 
-static void
-conn_store(struct ravl *store, struct rpma_connection *conn)
+static inline struct rpma_connection *
+conn_restore(struct rdma_cm_id *id)
 {
-	struct id_conn_pair *pair = Malloc(sizeof(*pair));
-	pair->id = conn->id;
-	pair->conn = conn;
+	struct rpma_connection *conn = id->context;
+	id->context = NULL;
 
-	ravl_insert(store, pair);
+	return conn;
 }
 
-static struct rpma_connection *
-conn_restore(struct ravl *store, struct rdma_cm_id *id)
+/*
+ * zone_setup_event -- (internal) pass the CM event to the connection being
+ * set up, the result of an asynchronous setup is reported to the user
+ */
+static int
+zone_setup_event(struct rpma_zone *zone, void *uarg)
 {
-	struct id_conn_pair to_find;
-	to_find.id = id;
-	to_find.conn = NULL;
+	struct rpma_connection *conn = zone->edata->id->context;
+	uint64_t event;
+
+	if (!conn) {
+		ERR("unexpected event received (%u)", zone->edata->event);
+		(void)rpma_zone_event_ack(zone);
+		return RPMA_E_EC_EVENT_DATA;
+	}
+
+	(void)rpma_connection_setup_event(conn, zone->edata);
 
-	struct ravl_node *node =
-		ravl_find(store, &to_find, RAVL_PREDICATE_EQUAL);
-	if (!node)
-		return NULL;
+	int ret = rpma_zone_event_ack(zone);
+	if (ret)
+		return ret;
+
+	if (conn->state == RPMA_CONN_STATE_ESTABLISHED) {
+		/* balanced by the DISCONNECTED event */
+		++zone->active_connections;
+		event = RPMA_CONNECTION_EVENT_ESTABLISHED;
+	} else if (conn->state == RPMA_CONN_STATE_FAILED) {
+		event = RPMA_CONNECTION_EVENT_FAILED;
+	} else {
+		return 0;
+	}
 
-	struct id_conn_pair *found = ravl_data(node);
-	if (!found)
-		return NULL;
+	/* the synchronous accept or establish returns the result instead */
+	if (conn->setup_sync)
+		return 0;
 
-	struct rpma_connection *ret = found->conn;
-	Free(found);
-	ravl_remove(store, node);
+	/* the id is not going to report anything of interest anymore */
+	if (event == RPMA_CONNECTION_EVENT_FAILED)
+		conn->id->context = NULL;
 
-	return ret;
+	return zone->on_connection_event_func(zone, event, conn, uarg);
+}
+
+/*
+ * zone_event_process -- (internal) handle a CM event read by the zone
+ */
+static int
+zone_event_process(struct rpma_zone *zone, enum rdma_cm_event_type event,
+		   void *uarg)
+{
+	struct rpma_connection *conn;
+	int ret;
+
+	switch (event) {
+		case RDMA_CM_EVENT_CONNECT_REQUEST:
+			/* acknowledged by the accept or the reject */
+			return zone->on_connection_event_func(
+				zone, RPMA_CONNECTION_EVENT_INCOMING, NULL,
+				uarg);
+		case RDMA_CM_EVENT_DISCONNECTED:
+			conn = conn_restore(zone->edata->id);
+			ret = rpma_zone_event_ack(zone);
+			if (ret)
+				return ret;
+			--zone->active_connections;
+			return zone->on_connection_event_func(
+				zone, RPMA_CONNECTION_EVENT_DISCONNECT, conn,
+				uarg);
+		case RDMA_CM_EVENT_ADDR_RESOLVED:
+		case RDMA_CM_EVENT_ADDR_ERROR:
+		case RDMA_CM_EVENT_ROUTE_RESOLVED:
+		case RDMA_CM_EVENT_ROUTE_ERROR:
+		case RDMA_CM_EVENT_CONNECT_ERROR:
+		case RDMA_CM_EVENT_UNREACHABLE:
+		case RDMA_CM_EVENT_REJECTED:
+		case RDMA_CM_EVENT_ESTABLISHED:
+			return zone_setup_event(zone, uarg);
+		default:
+			ERR("unexpected event received (%u)", event);
+			(void)rpma_zone_event_ack(zone);
+			return RPMA_E_EC_EVENT;
+	}
 }
 
 int
@@ -481,8 +746,6 @@ rpma_zone_wait_connections(struct rpma_zone *zone, void *uarg)
 {
 	zone->uarg = uarg;
 
-	struct rpma_connection *conn;
-
 	enum rdma_cm_event_type event = RPMA_CM_EVENT_TYPE_INVALID;
 	int ret;
 
@@ -500,7 +763,7 @@ rpma_zone_wait_connections(struct rpma_zone *zone, void *uarg)
 	}
 
 	while (rpma_utils_is_waiting(waiting)) {
-		ret = event_read(zone, &event, zone->timeout);
+		ret = event_next(zone, &event, zone->timeout);
 		if (ret == EC_TIMEOUT) {
 			if (zone_on_timeout(zone, uarg))
 				break;
@@ -510,68 +773,73 @@ rpma_zone_wait_connections(struct rpma_zone *zone, void *uarg)
 			break;
 		}
 
-		switch (event) {
-			case RDMA_CM_EVENT_CONNECT_REQUEST:
-				ret = zone->on_connection_event_func(
-					zone, RPMA_CONNECTION_EVENT_INCOMING,
-					NULL, uarg);
-				if (ret)
-					return ret;
-				++zone->active_connections;
-				break;
-			case RDMA_CM_EVENT_DISCONNECTED:
-				conn = conn_restore(zone->connections,
-						    zone->edata->id);
-				ret = zone->on_connection_event_func(
-					zone, RPMA_CONNECTION_EVENT_DISCONNECT,
-					conn, uarg);
-				if (ret)
-					return ret;
-				--zone->active_connections;
-				break;
-			default:
-				ERR("unexpected event received (%u)", event);
-				ret = RPMA_E_EC_EVENT;
-				break;
-		}
+		ret = zone_event_process(zone, event, uarg);
+		if (ret == RPMA_E_EC_EVENT || ret == RPMA_E_EC_EVENT_DATA)
+			continue; /* an unexpected event is dropped */
+		if (ret)
+			return ret;
 	}
 
 	return 0;
 }
 
+/*
+ * rpma_zone_wait_connected -- drive the setup of the connection until it
+ * completes, the events of the other connections are handled meanwhile
+ *
+ * The CM always ends the setup with either ESTABLISHED or an error event so
+ * the wait does not depend on rpma_zone_wait_connections() being in progress.
+ * The wait may be called from a callback of the zone loop so the events of
+ * the other ids are deferred to the loop instead of calling the callbacks
+ * from within the wait.
+ */
 int
 rpma_zone_wait_connected(struct rpma_zone *zone, struct rpma_connection *conn)
 {
 	enum rdma_cm_event_type event = RPMA_CM_EVENT_TYPE_INVALID;
 	int ret = 0;
 
-	while (rpma_utils_is_waiting(&zone->waiting)) {
-		ret = event_read(zone, &event, zone->timeout);
+	while (conn->state != RPMA_CONN_STATE_ESTABLISHED &&
+	       conn->state != RPMA_CONN_STATE_FAILED) {
+		/* the setup steps do not wait for the cache refill */
+		ret = event_read(zone, &event, zone->timeout, 0);
 		if (ret == EC_TIMEOUT) {
-			if (zone_on_timeout(zone, zone->uarg))
-				break;
+			if (zone_on_timeout(zone, zone->uarg)) {
+				ret = RPMA_E_EC_EVENT;
+				goto err_setup;
+			}
 			continue;
 		} else if (ret == EC_ERR) {
 			ret = RPMA_E_EC_READ;
-			break;
+			goto err_setup;
+		} else if (ret) {
+			goto err_setup;
 		}
 
-		if (event == RDMA_CM_EVENT_ESTABLISHED) {
-			if (zone->edata->id != conn->id) {
-				ERR("unexpected id received (%p)",
-				    zone->edata->id);
-				ret = RPMA_E_EC_EVENT_DATA;
-			}
-			conn_store(zone->connections, conn);
-			ret = rpma_zone_event_ack(zone);
-			break;
-		} else {
-			ERR("unexpected event received (%u)", event);
-			ret = RPMA_E_EC_EVENT;
-			break;
+		if (zone->edata->id->context != conn) {
+			ret = event_defer(zone);
+			if (ret)
+				goto err_setup;
+			continue;
 		}
+
+		ret = zone_event_process(zone, event, zone->uarg);
+		if (ret && ret != RPMA_E_EC_EVENT &&
+		    ret != RPMA_E_EC_EVENT_DATA)
+			goto err_setup;
 	}
 
+	if (conn->state == RPMA_CONN_STATE_FAILED) {
+		ret = conn->setup_status;
+		goto err_setup;
+	}
+
+	return 0;
+
+err_setup:
+	/* the further events of the id are dropped */
+	conn->id->context = NULL;
+	conn->state = RPMA_CONN_STATE_FAILED;
 	return ret;
 }
 
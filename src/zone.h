@@ -39,6 +39,16 @@
 #include <infiniband/verbs.h>
 #include <librpma.h>
 
+#include "os_thread.h"
+#include "sys/queue.h"
+
+/* a CM event put aside until the zone loop is back */
+struct rpma_zone_event {
+	PMDK_TAILQ_ENTRY(rpma_zone_event) next;
+
+	struct rdma_cm_event *edata;
+};
+
 struct rpma_zone {
 	struct rdma_addrinfo *rai;
 
@@ -46,14 +56,25 @@ struct rpma_zone {
 	int ec_epoll;
 
 	struct ibv_context *device;
+	struct ibv_device_attr dev_attr;
 	struct ibv_pd *pd;
 
 	struct rdma_cm_id *listen_id;
+	int listen_backlog;
 	struct rdma_cm_event *edata;
 
+	/* events of the other ids read by a synchronous accept or establish */
+	PMDK_TAILQ_HEAD(head_ze, rpma_zone_event) deferred;
+
 	void *uarg;
 	uint64_t active_connections;
-	struct ravl *connections;
+
+	/* connections created in advance, see rpma_connection_cache_refill() */
+	os_mutex_t conn_cache_lock;
+	struct rpma_connection **conn_cache;
+	uint64_t conn_cache_size;
+	uint64_t conn_cache_num;
+	uint64_t conn_cache_low_watermark; /* refilled only below it */
 
 	uint64_t waiting;
 
@@ -66,6 +87,29 @@ struct rpma_zone {
 	uint64_t send_queue_length;
 	uint64_t recv_queue_length;
 
+	/* queue capacities clamped to the device limits */
+	uint64_t rma_queue_length;
+	uint64_t nlanes;
+	uint64_t lane_queue_length;
+	uint32_t max_send_wr;
+	uint32_t max_recv_wr;
+	int cq_size;
+	uint8_t initiator_depth;
+	uint8_t responder_resources;
+
+	int cq_batch_size; /* max # of CQ entries polled at once */
+	uint64_t send_signal_interval; /* every n-th send is signaled */
+	uint32_t inline_threshold;
+	int max_sge; /* max # of the local segments of an RMA op */
+	int native_flush; /* the device supports IBV_WR_FLUSH */
+
+	int dispatch_mode;
+	uint64_t poll_budget; /* usec */
+
+	struct rpma_srq *srq; /* RPMA_CONFIG_SHARED_RQ */
+	uint64_t srq_length;
+	uint64_t srq_low_watermark;
+
 	unsigned flags;
 };
 
@@ -47,6 +47,19 @@
 #define RPMA_MSG_SIZE 50
 #define RPMA_QUEUE_LENGTH 5
 #define RPMA_VALID_FLAGS 1
+#define RPMA_CQ_BATCH_SIZE 32
+#define RPMA_CQ_SIZE 64
+#define RPMA_INITIATOR_DEPTH 8
+#define RPMA_SEND_SIGNAL_INTERVAL 4
+#define RPMA_INLINE_THRESHOLD 128
+#define RPMA_MAX_SGE_VALUE 8
+#define RPMA_SRQ_LENGTH 1024
+#define RPMA_SRQ_LOW_WATERMARK 768
+#define RPMA_NLANES 4
+#define RPMA_LANE_QUEUE_LENGTH 16
+#define RPMA_POLL_BUDGET 200
+#define RPMA_LISTEN_BACKLOG 1024
+#define RPMA_CONN_CACHE 32
 
 /*
  * rpma_cfg_create_and_delete_valid - test rpma_config allocation
@@ -182,6 +195,238 @@ test_config_set_recv_queue_length()
 	assert(cfg->recv_queue_length == RPMA_QUEUE_LENGTH);
 }
 
+/*
+ * test_config_set_rma_queue_length - test setting RMA queue length
+ */
+static void
+test_config_set_rma_queue_length()
+{
+	struct rpma_config *cfg;
+	rpma_config_new(&cfg);
+
+	int ret = rpma_config_set_rma_queue_length(cfg, RPMA_QUEUE_LENGTH);
+	assert(ret == 0);
+	assert(cfg->rma_queue_length == RPMA_QUEUE_LENGTH);
+
+	ret = rpma_config_set_rma_queue_length(cfg, 0);
+	assert(ret == -1);
+}
+
+/*
+ * test_config_set_cq_size - test setting CQ size
+ */
+static void
+test_config_set_cq_size()
+{
+	struct rpma_config *cfg;
+	rpma_config_new(&cfg);
+
+	assert(cfg->cq_size == 0);
+
+	int ret = rpma_config_set_cq_size(cfg, RPMA_CQ_SIZE);
+	assert(ret == 0);
+	assert(cfg->cq_size == RPMA_CQ_SIZE);
+}
+
+/*
+ * test_config_set_initiator_depth - test setting # of outstanding RDMA reads
+ */
+static void
+test_config_set_initiator_depth()
+{
+	struct rpma_config *cfg;
+	rpma_config_new(&cfg);
+
+	int ret = rpma_config_set_initiator_depth(cfg, RPMA_INITIATOR_DEPTH);
+	assert(ret == 0);
+	assert(cfg->initiator_depth == RPMA_INITIATOR_DEPTH);
+}
+
+/*
+ * test_config_set_cq_batch_size - test setting CQ batch size
+ */
+static void
+test_config_set_cq_batch_size()
+{
+	struct rpma_config *cfg;
+	rpma_config_new(&cfg);
+
+	int ret = rpma_config_set_cq_batch_size(cfg, RPMA_CQ_BATCH_SIZE);
+	assert(ret == 0);
+	assert(cfg->cq_batch_size == RPMA_CQ_BATCH_SIZE);
+}
+
+/*
+ * test_config_set_invalid_cq_batch_size - test setting invalid CQ batch size
+ */
+static void
+test_config_set_invalid_cq_batch_size()
+{
+	struct rpma_config *cfg;
+	rpma_config_new(&cfg);
+
+	int ret = rpma_config_set_cq_batch_size(cfg, 0);
+	assert(ret == -1);
+
+	ret = rpma_config_set_cq_batch_size(cfg, RPMA_MAX_CQ_BATCH_SIZE + 1);
+	assert(ret == -1);
+}
+
+/*
+ * test_config_set_send_signal_interval - test setting send signaling interval
+ */
+static void
+test_config_set_send_signal_interval()
+{
+	struct rpma_config *cfg;
+	rpma_config_new(&cfg);
+
+	int ret = rpma_config_set_send_signal_interval(
+		cfg, RPMA_SEND_SIGNAL_INTERVAL);
+	assert(ret == 0);
+	assert(cfg->send_signal_interval == RPMA_SEND_SIGNAL_INTERVAL);
+
+	ret = rpma_config_set_send_signal_interval(cfg, 0);
+	assert(ret == -1);
+}
+
+/*
+ * test_config_set_inline_threshold - test setting inline data threshold
+ */
+static void
+test_config_set_inline_threshold()
+{
+	struct rpma_config *cfg;
+	rpma_config_new(&cfg);
+
+	int ret = rpma_config_set_inline_threshold(cfg, RPMA_INLINE_THRESHOLD);
+	assert(ret == 0);
+	assert(cfg->inline_threshold == RPMA_INLINE_THRESHOLD);
+
+	ret = rpma_config_set_inline_threshold(cfg, 0);
+	assert(ret == 0);
+	assert(cfg->inline_threshold == 0);
+}
+
+/*
+ * test_config_set_max_sge - test setting max # of scatter-gather elements
+ */
+static void
+test_config_set_max_sge()
+{
+	struct rpma_config *cfg;
+	rpma_config_new(&cfg);
+
+	int ret = rpma_config_set_max_sge(cfg, RPMA_MAX_SGE_VALUE);
+	assert(ret == 0);
+	assert(cfg->max_sge == RPMA_MAX_SGE_VALUE);
+
+	ret = rpma_config_set_max_sge(cfg, 0);
+	assert(ret == -1);
+
+	ret = rpma_config_set_max_sge(cfg, RPMA_MAX_SGE + 1);
+	assert(ret == -1);
+}
+
+/*
+ * test_config_set_srq - test setting SRQ length and low watermark
+ */
+static void
+test_config_set_srq()
+{
+	struct rpma_config *cfg;
+	rpma_config_new(&cfg);
+
+	int ret = rpma_config_set_srq(cfg, RPMA_SRQ_LENGTH,
+				      RPMA_SRQ_LOW_WATERMARK);
+	assert(ret == 0);
+	assert(cfg->srq_length == RPMA_SRQ_LENGTH);
+	assert(cfg->srq_low_watermark == RPMA_SRQ_LOW_WATERMARK);
+
+	ret = rpma_config_set_srq(cfg, 0, 0);
+	assert(ret == -1);
+
+	ret = rpma_config_set_srq(cfg, RPMA_SRQ_LENGTH, 0);
+	assert(ret == -1);
+
+	ret = rpma_config_set_srq(cfg, RPMA_SRQ_LENGTH, RPMA_SRQ_LENGTH + 1);
+	assert(ret == -1);
+}
+
+/*
+ * test_config_set_lanes - test setting # of lanes and their queue length
+ */
+static void
+test_config_set_lanes()
+{
+	struct rpma_config *cfg;
+	rpma_config_new(&cfg);
+
+	int ret = rpma_config_set_lanes(cfg, RPMA_NLANES,
+					RPMA_LANE_QUEUE_LENGTH);
+	assert(ret == 0);
+	assert(cfg->nlanes == RPMA_NLANES);
+	assert(cfg->lane_queue_length == RPMA_LANE_QUEUE_LENGTH);
+
+	ret = rpma_config_set_lanes(cfg, RPMA_NLANES, 1);
+	assert(ret == -1);
+}
+
+/*
+ * test_config_set_dispatch_mode - test setting the dispatch mode
+ */
+static void
+test_config_set_dispatch_mode()
+{
+	struct rpma_config *cfg;
+	rpma_config_new(&cfg);
+
+	int ret = rpma_config_set_dispatch_mode(cfg, RPMA_DISPATCH_HYBRID,
+						RPMA_POLL_BUDGET);
+	assert(ret == 0);
+	assert(cfg->dispatch_mode == RPMA_DISPATCH_HYBRID);
+	assert(cfg->poll_budget == RPMA_POLL_BUDGET);
+
+	ret = rpma_config_set_dispatch_mode(cfg, RPMA_DISPATCH_ADAPTIVE, 0);
+	assert(ret == 0);
+	assert(cfg->dispatch_mode == RPMA_DISPATCH_ADAPTIVE);
+	assert(cfg->poll_budget == 0);
+
+	ret = rpma_config_set_dispatch_mode(cfg, -1, RPMA_POLL_BUDGET);
+	assert(ret == -1);
+}
+
+/*
+ * test_config_set_listen_backlog - test setting the listen backlog
+ */
+static void
+test_config_set_listen_backlog()
+{
+	struct rpma_config *cfg;
+	rpma_config_new(&cfg);
+
+	int ret = rpma_config_set_listen_backlog(cfg, RPMA_LISTEN_BACKLOG);
+	assert(ret == 0);
+	assert(cfg->listen_backlog == RPMA_LISTEN_BACKLOG);
+
+	ret = rpma_config_set_listen_backlog(cfg, -1);
+	assert(ret == -1);
+}
+
+/*
+ * test_config_set_conn_cache - test setting # of the cached connections
+ */
+static void
+test_config_set_conn_cache()
+{
+	struct rpma_config *cfg;
+	rpma_config_new(&cfg);
+
+	int ret = rpma_config_set_conn_cache(cfg, RPMA_CONN_CACHE);
+	assert(ret == 0);
+	assert(cfg->conn_cache == RPMA_CONN_CACHE);
+}
+
 /*
  * test_config_set_queue_alloc_funcs - test setting alloc functions
  */
@@ -223,6 +468,19 @@ main(int argc, char **argv)
 	test_config_set_msg_size();
 	test_config_set_send_queue_length();
 	test_config_set_recv_queue_length();
+	test_config_set_rma_queue_length();
+	test_config_set_cq_size();
+	test_config_set_initiator_depth();
+	test_config_set_cq_batch_size();
+	test_config_set_invalid_cq_batch_size();
+	test_config_set_send_signal_interval();
+	test_config_set_inline_threshold();
+	test_config_set_max_sge();
+	test_config_set_srq();
+	test_config_set_lanes();
+	test_config_set_dispatch_mode();
+	test_config_set_listen_backlog();
+	test_config_set_conn_cache();
 	test_config_set_queue_alloc_funcs();
 	test_config_set_valid_flag();
 }
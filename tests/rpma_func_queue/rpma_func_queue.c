@@ -0,0 +1,421 @@
+/*
+ * Copyright 2020, Intel Corporation
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in
+ *       the documentation and/or other materials provided with the
+ *       distribution.
+ *
+ *     * Neither the name of the copyright holder nor the names of its
+ *       contributors may be used to endorse or promote products derived
+ *       from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * rpma_func_queue.c -- rpma_func_queue unittest
+ */
+
+#include <assert.h>
+#include <errno.h>
+#include <stdint.h>
+
+#include "../src/func_queue.h"
+#include "os_thread.h"
+#include "unittest.h"
+
+#define QUEUE_SIZE RPMA_DISPATCHER_FUNC_QUEUE_SIZE
+#define NLAPS 3
+#define NOVERFLOW 16
+#define NPRODUCERS 4
+#define NITEMS (4 * QUEUE_SIZE) /* per producer, more than the ring takes */
+
+#define CONN ((struct rpma_connection *)0x1)
+
+/* the args passed to func_record() in the order of the calls */
+static uintptr_t called[QUEUE_SIZE + NOVERFLOW];
+static uint64_t ncalled;
+
+/*
+ * func_record -- a queue func which records its arg
+ */
+static int
+func_record(struct rpma_connection *conn, void *arg)
+{
+	assert(conn == CONN);
+	assert(ncalled < QUEUE_SIZE + NOVERFLOW);
+
+	called[ncalled++] = (uintptr_t)arg;
+
+	return 0;
+}
+
+/*
+ * test_func_queue_push_pop -- the funcs are taken in the order of pushing
+ */
+static void
+test_func_queue_push_pop()
+{
+	struct rpma_dispatcher_func_queue q;
+	struct rpma_dispatcher_func_slot f;
+
+	int ret = rpma_func_queue_init(&q);
+	assert(ret == 0);
+
+	/* nothing to take from an empty queue */
+	ret = rpma_func_queue_pop(&q, &f);
+	assert(ret == -EAGAIN);
+
+	for (uintptr_t i = 0; i < 3; ++i) {
+		ret = rpma_func_queue_push(&q, CONN, func_record, (void *)i);
+		assert(ret == 0);
+	}
+
+	for (uintptr_t i = 0; i < 3; ++i) {
+		ret = rpma_func_queue_pop(&q, &f);
+		assert(ret == 0);
+		assert(f.conn == CONN);
+		assert(f.func == func_record);
+		assert(f.arg == (void *)i);
+	}
+
+	ret = rpma_func_queue_pop(&q, &f);
+	assert(ret == -EAGAIN);
+
+	rpma_func_queue_fini(&q);
+}
+
+/*
+ * test_func_queue_full -- a push to the full ring fails until a slot is freed
+ */
+static void
+test_func_queue_full()
+{
+	struct rpma_dispatcher_func_queue q;
+	struct rpma_dispatcher_func_slot f;
+
+	int ret = rpma_func_queue_init(&q);
+	assert(ret == 0);
+
+	for (uintptr_t i = 0; i < QUEUE_SIZE; ++i) {
+		ret = rpma_func_queue_push(&q, CONN, func_record, (void *)i);
+		assert(ret == 0);
+	}
+
+	ret = rpma_func_queue_push(&q, CONN, func_record, (void *)QUEUE_SIZE);
+	assert(ret == -EAGAIN);
+
+	ret = rpma_func_queue_pop(&q, &f);
+	assert(ret == 0);
+	assert(f.arg == (void *)0);
+
+	ret = rpma_func_queue_push(&q, CONN, func_record, (void *)QUEUE_SIZE);
+	assert(ret == 0);
+
+	/* the slot freed at the beginning of the ring is taken last */
+	for (uintptr_t i = 1; i <= QUEUE_SIZE; ++i) {
+		ret = rpma_func_queue_pop(&q, &f);
+		assert(ret == 0);
+		assert(f.arg == (void *)i);
+	}
+
+	ret = rpma_func_queue_pop(&q, &f);
+	assert(ret == -EAGAIN);
+
+	rpma_func_queue_fini(&q);
+}
+
+/*
+ * test_func_queue_wraparound -- the ring keeps the order over many laps when
+ * the positions wrap around the size of the ring
+ */
+static void
+test_func_queue_wraparound()
+{
+	struct rpma_dispatcher_func_queue q;
+	struct rpma_dispatcher_func_slot f;
+	uintptr_t pushed = 0;
+	uintptr_t popped = 0;
+
+	int ret = rpma_func_queue_init(&q);
+	assert(ret == 0);
+
+	/* keep the ring half full so the head and the tail are in other laps */
+	for (unsigned i = 0; i < QUEUE_SIZE / 2; ++i) {
+		ret = rpma_func_queue_push(&q, CONN, func_record,
+					   (void *)pushed++);
+		assert(ret == 0);
+	}
+
+	while (pushed < NLAPS * QUEUE_SIZE) {
+		ret = rpma_func_queue_push(&q, CONN, func_record,
+					   (void *)pushed++);
+		assert(ret == 0);
+
+		ret = rpma_func_queue_pop(&q, &f);
+		assert(ret == 0);
+		assert(f.arg == (void *)popped++);
+	}
+
+	while (popped < pushed) {
+		ret = rpma_func_queue_pop(&q, &f);
+		assert(ret == 0);
+		assert(f.arg == (void *)popped++);
+	}
+
+	ret = rpma_func_queue_pop(&q, &f);
+	assert(ret == -EAGAIN);
+
+	rpma_func_queue_fini(&q);
+}
+
+/*
+ * test_func_queue_pop_shared -- the shared consumer takes the funcs in order
+ * and over the laps of the ring as well
+ */
+static void
+test_func_queue_pop_shared()
+{
+	struct rpma_dispatcher_func_queue q;
+	struct rpma_dispatcher_func_slot f;
+
+	int ret = rpma_func_queue_init(&q);
+	assert(ret == 0);
+
+	ret = rpma_func_queue_pop_shared(&q, &f);
+	assert(ret == -EAGAIN);
+
+	for (unsigned lap = 0; lap < NLAPS; ++lap) {
+		for (uintptr_t i = 0; i < QUEUE_SIZE; ++i) {
+			ret = rpma_func_queue_push(&q, CONN, func_record,
+						   (void *)i);
+			assert(ret == 0);
+		}
+
+		ret = rpma_func_queue_push(&q, CONN, func_record, NULL);
+		assert(ret == -EAGAIN);
+
+		for (uintptr_t i = 0; i < QUEUE_SIZE; ++i) {
+			ret = rpma_func_queue_pop_shared(&q, &f);
+			assert(ret == 0);
+			assert(f.arg == (void *)i);
+		}
+
+		ret = rpma_func_queue_pop_shared(&q, &f);
+		assert(ret == -EAGAIN);
+	}
+
+	rpma_func_queue_fini(&q);
+}
+
+/*
+ * test_func_queue_overflow -- the funcs which do not fit in the ring are
+ * called after the ring in the order of enqueuing, the next funcs go to the
+ * overflow list as long as it is not empty
+ */
+static void
+test_func_queue_overflow()
+{
+	struct rpma_dispatcher_func_queue q;
+	struct rpma_pool pool;
+	struct rpma_dispatcher_func_slot f;
+	uint64_t high_water;
+	uint64_t nobjs;
+	uint64_t nfuncs = 0;
+
+	int ret = rpma_func_queue_init(&q);
+	assert(ret == 0);
+
+	ret = rpma_pool_init(&pool, sizeof(struct rpma_dispatcher_func_entry),
+			     NOVERFLOW / 2);
+	assert(ret == 0);
+
+	for (uintptr_t i = 0; i < QUEUE_SIZE + NOVERFLOW / 2; ++i) {
+		ret = rpma_func_queue_enqueue(&q, &pool, CONN, func_record,
+					      (void *)i);
+		assert(ret == 0);
+	}
+	assert(q.overflow_num == NOVERFLOW / 2);
+
+	/* a slot of the ring is free but the overflow list goes first */
+	ret = rpma_func_queue_pop(&q, &f);
+	assert(ret == 0);
+	assert(f.arg == (void *)0);
+	called[ncalled++] = 0;
+
+	for (uintptr_t i = QUEUE_SIZE + NOVERFLOW / 2;
+	     i < QUEUE_SIZE + NOVERFLOW; ++i) {
+		ret = rpma_func_queue_enqueue(&q, &pool, CONN, func_record,
+					      (void *)i);
+		assert(ret == 0);
+	}
+	assert(q.overflow_num == NOVERFLOW);
+
+	/* the overflow entries are taken from the pool */
+	rpma_pool_get_stats(&pool, &high_water, &nobjs);
+	assert(high_water == NOVERFLOW);
+
+	ret = rpma_func_queue_process(&q, &pool, &nfuncs);
+	assert(ret == 0);
+	assert(nfuncs == QUEUE_SIZE + NOVERFLOW - 1);
+	assert(q.overflow_num == 0);
+
+	assert(ncalled == QUEUE_SIZE + NOVERFLOW);
+	for (uintptr_t i = 0; i < QUEUE_SIZE + NOVERFLOW; ++i)
+		assert(called[i] == i);
+
+	/* the queue is empty, the next func goes to the ring again */
+	ret = rpma_func_queue_enqueue(&q, &pool, CONN, func_record, NULL);
+	assert(ret == 0);
+	assert(q.overflow_num == 0);
+
+	ret = rpma_func_queue_pop(&q, &f);
+	assert(ret == 0);
+	assert(f.arg == NULL);
+
+	rpma_pool_fini(&pool);
+	rpma_func_queue_fini(&q);
+}
+
+struct producer_args {
+	struct rpma_dispatcher_func_queue *q;
+	struct rpma_pool *pool;
+	uintptr_t id;
+};
+
+/* the next expected item of each producer and the number of the calls */
+static uintptr_t mp_next[NPRODUCERS];
+static uint64_t mp_ncalled;
+
+/*
+ * func_mp_record -- a queue func which checks the items of each producer are
+ * called once and in the order of enqueuing (only the consumer calls it)
+ */
+static int
+func_mp_record(struct rpma_connection *conn, void *arg)
+{
+	uintptr_t id = (uintptr_t)arg / NITEMS;
+	uintptr_t i = (uintptr_t)arg % NITEMS;
+
+	assert(conn == CONN);
+	assert(id < NPRODUCERS);
+
+	/* a lost item leaves a gap, a duplicated one goes back */
+	assert(mp_next[id] == i);
+	++mp_next[id];
+	++mp_ncalled;
+
+	return 0;
+}
+
+/*
+ * producer -- enqueue NITEMS funcs tagged with the id of the producer
+ */
+static void *
+producer(void *arg)
+{
+	struct producer_args *pa = arg;
+
+	for (uintptr_t i = 0; i < NITEMS; ++i) {
+		int ret = rpma_func_queue_enqueue(pa->q, pa->pool, CONN,
+						  func_mp_record,
+						  (void *)(pa->id * NITEMS + i));
+		assert(ret == 0);
+	}
+
+	return NULL;
+}
+
+/*
+ * test_func_queue_multi_producer -- the funcs of many producers are called
+ * by a single consumer exactly once, including the funcs which went to the
+ * overflow list
+ */
+static void
+test_func_queue_multi_producer()
+{
+	struct rpma_dispatcher_func_queue q;
+	struct rpma_pool pool;
+	struct producer_args pa[NPRODUCERS];
+	os_thread_t threads[NPRODUCERS];
+	uint64_t overflow_num;
+	uint64_t high_water;
+	uint64_t nobjs;
+	uint64_t nfuncs = 0;
+
+	int ret = rpma_func_queue_init(&q);
+	assert(ret == 0);
+
+	ret = rpma_pool_init(&pool, sizeof(struct rpma_dispatcher_func_entry),
+			     NOVERFLOW);
+	assert(ret == 0);
+
+	for (uintptr_t id = 0; id < NPRODUCERS; ++id) {
+		pa[id].q = &q;
+		pa[id].pool = &pool;
+		pa[id].id = id;
+		ret = os_thread_create(&threads[id], NULL, producer, &pa[id]);
+		assert(ret == 0);
+	}
+
+	/* the producers alone fill up the ring so the overflow list is used */
+	do {
+		util_atomic_load_explicit64(&q.overflow_num, &overflow_num,
+					    memory_order_acquire);
+	} while (overflow_num == 0);
+
+	/* consume along with the producers until all the items are called */
+	while (nfuncs < NPRODUCERS * NITEMS) {
+		ret = rpma_func_queue_process(&q, &pool, &nfuncs);
+		assert(ret == 0);
+	}
+
+	for (unsigned id = 0; id < NPRODUCERS; ++id) {
+		ret = os_thread_join(&threads[id], NULL);
+		assert(ret == 0);
+	}
+
+	/* nothing is left behind */
+	ret = rpma_func_queue_process(&q, &pool, &nfuncs);
+	assert(ret == 0);
+	assert(nfuncs == NPRODUCERS * NITEMS);
+	assert(mp_ncalled == NPRODUCERS * NITEMS);
+	for (unsigned id = 0; id < NPRODUCERS; ++id)
+		assert(mp_next[id] == NITEMS);
+	assert(q.overflow_num == 0);
+
+	rpma_pool_get_stats(&pool, &high_water, &nobjs);
+	assert(high_water > 0);
+
+	rpma_pool_fini(&pool);
+	rpma_func_queue_fini(&q);
+}
+
+int
+main(int argc, char **argv)
+{
+	test_func_queue_push_pop();
+	test_func_queue_full();
+	test_func_queue_wraparound();
+	test_func_queue_pop_shared();
+	test_func_queue_overflow();
+	test_func_queue_multi_producer();
+}
@@ -0,0 +1,209 @@
+/*
+ * Copyright 2020, Intel Corporation
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in
+ *       the documentation and/or other materials provided with the
+ *       distribution.
+ *
+ *     * Neither the name of the copyright holder nor the names of its
+ *       contributors may be used to endorse or promote products derived
+ *       from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * rpma_pool.c -- rpma_pool unittest
+ */
+
+#include <assert.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "../src/pool.h"
+#include "unittest.h"
+
+#define OBJ_SIZE 24
+#define SLAB_SIZE 8
+
+/*
+ * test_pool_init_fini -- the pool starts with a single slab
+ */
+static void
+test_pool_init_fini()
+{
+	struct rpma_pool pool;
+	uint64_t high_water;
+	uint64_t nobjs;
+
+	int ret = rpma_pool_init(&pool, OBJ_SIZE, SLAB_SIZE);
+	assert(ret == 0);
+
+	rpma_pool_get_stats(&pool, &high_water, &nobjs);
+	assert(high_water == 0);
+	assert(nobjs == SLAB_SIZE);
+
+	rpma_pool_fini(&pool);
+}
+
+/*
+ * test_pool_small_objs -- an object smaller than a pointer still has room for
+ * the free list link
+ */
+static void
+test_pool_small_objs()
+{
+	struct rpma_pool pool;
+
+	int ret = rpma_pool_init(&pool, 1, SLAB_SIZE);
+	assert(ret == 0);
+	assert(pool.obj_size >= sizeof(void *));
+
+	char *objs[SLAB_SIZE];
+	for (unsigned i = 0; i < SLAB_SIZE; ++i) {
+		objs[i] = rpma_pool_get(&pool);
+		assert(objs[i] != NULL);
+		*objs[i] = (char)i;
+	}
+
+	/* the objects do not overlap */
+	for (unsigned i = 0; i < SLAB_SIZE; ++i)
+		assert(*objs[i] == (char)i);
+
+	for (unsigned i = 0; i < SLAB_SIZE; ++i)
+		rpma_pool_put(&pool, objs[i]);
+
+	rpma_pool_fini(&pool);
+}
+
+/*
+ * test_pool_get_put -- a released object is reused before a new one
+ */
+static void
+test_pool_get_put()
+{
+	struct rpma_pool pool;
+
+	int ret = rpma_pool_init(&pool, OBJ_SIZE, SLAB_SIZE);
+	assert(ret == 0);
+
+	void *obj = rpma_pool_get(&pool);
+	assert(obj != NULL);
+	memset(obj, 0xff, OBJ_SIZE);
+	rpma_pool_put(&pool, obj);
+
+	void *again = rpma_pool_get(&pool);
+	assert(again == obj);
+	rpma_pool_put(&pool, again);
+
+	rpma_pool_fini(&pool);
+}
+
+/*
+ * test_pool_grow -- the pool grows by a slab when it runs out of the objects
+ */
+static void
+test_pool_grow()
+{
+	struct rpma_pool pool;
+	uint64_t high_water;
+	uint64_t nobjs;
+	void *objs[SLAB_SIZE + 1];
+
+	int ret = rpma_pool_init(&pool, OBJ_SIZE, SLAB_SIZE);
+	assert(ret == 0);
+
+	for (unsigned i = 0; i < SLAB_SIZE + 1; ++i) {
+		objs[i] = rpma_pool_get(&pool);
+		assert(objs[i] != NULL);
+		memset(objs[i], (int)i, OBJ_SIZE);
+	}
+
+	rpma_pool_get_stats(&pool, &high_water, &nobjs);
+	assert(high_water == SLAB_SIZE + 1);
+	assert(nobjs == 2 * SLAB_SIZE);
+
+	for (unsigned i = 0; i < SLAB_SIZE + 1; ++i)
+		rpma_pool_put(&pool, objs[i]);
+
+	/* the objects are kept until the pool is destroyed */
+	rpma_pool_get_stats(&pool, &high_water, &nobjs);
+	assert(high_water == SLAB_SIZE + 1);
+	assert(nobjs == 2 * SLAB_SIZE);
+
+	rpma_pool_fini(&pool);
+}
+
+/*
+ * test_pool_refill -- the refill grows the pool only below the low watermark
+ */
+static void
+test_pool_refill()
+{
+	struct rpma_pool pool;
+	uint64_t high_water;
+	uint64_t nobjs;
+	void *objs[SLAB_SIZE];
+
+	int ret = rpma_pool_init(&pool, OBJ_SIZE, SLAB_SIZE);
+	assert(ret == 0);
+
+	/* plenty of the free objects */
+	ret = rpma_pool_refill(&pool);
+	assert(ret == 0);
+	rpma_pool_get_stats(&pool, &high_water, &nobjs);
+	assert(nobjs == SLAB_SIZE);
+
+	/* leave fewer free objects than the low watermark */
+	unsigned nget = SLAB_SIZE - (unsigned)pool.low_watermark + 1;
+	for (unsigned i = 0; i < nget; ++i)
+		objs[i] = rpma_pool_get(&pool);
+
+	ret = rpma_pool_refill(&pool);
+	assert(ret == 0);
+	rpma_pool_get_stats(&pool, &high_water, &nobjs);
+	assert(high_water == nget);
+	assert(nobjs == 2 * SLAB_SIZE);
+
+	/* the objects of the new slab are taken without growing again */
+	for (unsigned i = 0; i < SLAB_SIZE; ++i) {
+		void *obj = rpma_pool_get(&pool);
+		assert(obj != NULL);
+		rpma_pool_put(&pool, obj);
+	}
+	rpma_pool_get_stats(&pool, &high_water, &nobjs);
+	assert(nobjs == 2 * SLAB_SIZE);
+
+	for (unsigned i = 0; i < nget; ++i)
+		rpma_pool_put(&pool, objs[i]);
+
+	rpma_pool_fini(&pool);
+}
+
+int
+main(int argc, char **argv)
+{
+	test_pool_init_fini();
+	test_pool_small_objs();
+	test_pool_get_put();
+	test_pool_grow();
+	test_pool_refill();
+}